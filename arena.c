@@ -0,0 +1,61 @@
+/**
+ * @file arena.c
+ * @brief Huge-page backed bump allocator
+ **/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* MAP_HUGETLB */
+#endif
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+/* map size bytes (rounded up to huge pages); -1 if even 4k pages fail */
+int arena_init(arena_t *a, size_t size)
+{
+    void *p;
+
+    size = (size + ARENA_HUGE_PAGE - 1) / ARENA_HUGE_PAGE * ARENA_HUGE_PAGE;
+    a->size = size;
+    a->used = 0;
+    a->hugetlb = 1;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (p == MAP_FAILED) {
+        /* no reserved huge pages: ask for transparent ones */
+        a->hugetlb = 0;
+        if (posix_memalign(&p, ARENA_HUGE_PAGE, size) != 0) {
+            a->base = NULL;
+            a->size = 0;
+            return -1;
+        }
+        madvise(p, size, MADV_HUGEPAGE);
+    }
+    a->base = p;
+    return 0;
+}
+
+void arena_destroy(arena_t *a)
+{
+    if (a->base == NULL)
+        return;
+    if (a->hugetlb)
+        munmap(a->base, a->size);
+    else
+        free(a->base);
+    a->base = NULL;
+    a->size = a->used = 0;
+}
+
+void *arena_alloc(arena_t *a, size_t size, size_t align)
+{
+    size_t start = (a->used + align - 1) & ~(align - 1);
+    if (a->base == NULL || start + size > a->size)
+        return NULL;
+    a->used = start + size;
+    return a->base + start;
+}
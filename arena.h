@@ -0,0 +1,41 @@
+/**
+ * @file arena.h
+ * @brief A bump allocator over one huge-page mapping, reused across calls
+ *
+ * The mapping comes from hugetlbfs when pages are reserved there, and
+ * otherwise is 2MB-aligned memory advised to become transparent huge
+ * pages. Either way its pages are only committed when first touched, and
+ * allocations are released all at once, back to a mark.
+ **/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_HUGE_PAGE (1L << 21)
+
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+    int hugetlb;            /* 1 if hugetlbfs pages, 0 if THP advised */
+} arena_t;
+
+int arena_init(arena_t *a, size_t size);
+void arena_destroy(arena_t *a);
+/* NULL if the arena is full; align must be a power of two */
+void *arena_alloc(arena_t *a, size_t size, size_t align);
+
+/* everything allocated after a mark is freed by releasing it */
+static inline size_t arena_mark(const arena_t *a)
+{
+    return a->used;
+}
+
+static inline void arena_release(arena_t *a, size_t mark)
+{
+    a->used = mark;
+}
+
+#endif /* ARENA_H */
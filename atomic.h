@@ -1,7 +1,20 @@
 #ifndef _ATOMIC_H_
 #define _ATOMIC_H_
 
+#include <stdint.h>
+
 extern int atomic_swap(int *dst, int val);
 extern int atomic_increment(int *dst, int delta);
+extern int atomic_cas(int *dst, int expected, int val);
+extern long atomic_swap64(long *dst, long val);
+extern long atomic_cas64(long *dst, long expected, long val);
+extern long atomic_increment64(long *dst, long delta);
+extern int atomic_fetch_or(int *dst, int mask);
+extern int atomic_fetch_and(int *dst, int mask);
+extern long atomic_fetch_or64(long *dst, long mask);
+extern long atomic_fetch_and64(long *dst, long mask);
+/* dst must be 16-byte aligned; on failure expected receives its contents */
+extern int atomic_cas128(void *dst, uint64_t expected[2], uint64_t lo,
+                         uint64_t hi);
 
 #endif /* _ATOMIC_H_ */
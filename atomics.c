@@ -0,0 +1,349 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include "atomic.h"
+#include "func_time.h"
+#include "perf.h"
+#include "env.h"
+#ifdef BENCH_RUNNER
+#include "bench.h"
+#endif
+
+/** @brief Largest thread count of a sweep */
+#define MAX_THREADS 64
+/** @brief Operations of each thread in one run */
+#define OPS_PER_THREAD (1 << 18)
+/** @brief Uncontended samples, and back-to-back operations in each */
+#define LATENCY_SAMPLES 10000
+#define LATENCY_BATCH 16
+
+/**
+ * @brief The word a thread operates on, alone on its cache line. Aligned
+ * enough for cmpxchg16b.
+ */
+typedef struct {
+	uint64_t w[2];
+} __attribute__((aligned(64))) slot_t;
+
+/** @brief A read-modify-write primitive, applied once to a slot */
+typedef struct {
+	const char *name;
+	const char *description;
+	void (*op)(slot_t *s);
+} prim_t;
+
+static void op_plain(slot_t *s) {
+	(*(volatile uint64_t *) &s->w[0])++;
+}
+
+static void op_xadd(slot_t *s) {
+	atomic_increment((int *) s->w, 1);
+}
+
+static void op_xadd64(slot_t *s) {
+	atomic_increment64((long *) s->w, 1);
+}
+
+static void op_xchg(slot_t *s) {
+	atomic_swap((int *) s->w, 1);
+}
+
+static void op_xchg64(slot_t *s) {
+	atomic_swap64((long *) s->w, 1);
+}
+
+/* one attempt: a failed compare-and-swap still takes the line */
+static void op_cas(slot_t *s) {
+	int v = *(volatile int *) s->w;
+	atomic_cas((int *) s->w, v, v + 1);
+}
+
+static void op_cas64(slot_t *s) {
+	long v = *(volatile long *) s->w;
+	atomic_cas64((long *) s->w, v, v + 1);
+}
+
+static void op_or(slot_t *s) {
+	atomic_fetch_or((int *) s->w, 1);
+}
+
+static void op_and(slot_t *s) {
+	atomic_fetch_and((int *) s->w, ~1);
+}
+
+static void op_or64(slot_t *s) {
+	atomic_fetch_or64((long *) s->w, 1);
+}
+
+static void op_and64(slot_t *s) {
+	atomic_fetch_and64((long *) s->w, ~1L);
+}
+
+static void op_cas128(slot_t *s) {
+	uint64_t expected[2] = { s->w[0], s->w[1] };
+	atomic_cas128(s->w, expected, expected[0] + 1, expected[1]);
+}
+
+/** @brief The primitives, cheapest first */
+static const prim_t prims[] = {
+	{ "plain", "Non-atomic increment (reference)", op_plain },
+	{ "xadd", "lock xadd", op_xadd },
+	{ "xadd64", "lock xadd, 64-bit", op_xadd64 },
+	{ "xchg", "xchg", op_xchg },
+	{ "xchg64", "xchg, 64-bit", op_xchg64 },
+	{ "cas", "lock cmpxchg, one attempt", op_cas },
+	{ "cas64", "lock cmpxchg, 64-bit, one attempt", op_cas64 },
+	{ "or", "Fetch-and-or (cmpxchg loop)", op_or },
+	{ "and", "Fetch-and-and (cmpxchg loop)", op_and },
+	{ "or64", "Fetch-and-or, 64-bit", op_or64 },
+	{ "and64", "Fetch-and-and, 64-bit", op_and64 },
+	{ "cas128", "lock cmpxchg16b, one attempt", op_cas128 },
+};
+#define N_PRIMS (int) (sizeof(prims) / sizeof(prims[0]))
+
+/** @brief The words operated on: slot 0 when the threads share a line */
+static slot_t slots[MAX_THREADS];
+
+/** @brief Shape of the current test */
+static const prim_t *prim;
+static int n_threads;
+static int same_line;
+/** @brief The CPUs the threads are pinned to in turn; ids may have gaps */
+static int cpus[MAX_THREADS];
+static int n_cpus;
+static pthread_barrier_t start;
+
+/**
+ * @brief Applies the primitive OPS_PER_THREAD times, once every thread is
+ * ready.
+ *
+ * @param arg The thread's index.
+ *
+ * @return NULL
+ */
+static void *do_ops(void *arg) {
+	slot_t *s = &slots[same_line ? 0 : (long) arg];
+	void (*op)(slot_t *) = prim->op;
+	pthread_barrier_wait(&start);
+	for (int i = 0; i < OPS_PER_THREAD; i++)
+		op(s);
+	return NULL;
+}
+
+/**
+ * @brief Runs the threads of one test, thread i pinned to the i-th CPU we
+ * may run on, modulo their number.
+ *
+ * @return void
+ */
+static void do_test(void) {
+	pthread_t threads[MAX_THREADS];
+	pthread_attr_t attr;
+
+	pthread_barrier_init(&start, NULL, n_threads);
+	pthread_attr_init(&attr);
+	for (long i = 0; i < n_threads; i++) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpus[i % n_cpus], &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		if (pthread_create(&threads[i], &attr, do_ops, (void *) i) != 0) {
+			fprintf(stderr, "pthread_create(): Failed to create thread.\n");
+			exit(-1);
+		}
+	}
+	for (int i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_attr_destroy(&attr);
+	pthread_barrier_destroy(&start);
+}
+
+/**
+ * @brief Sets up a test of one primitive.
+ *
+ * @param p The primitive to apply.
+ * @param threads The number of threads applying it.
+ * @param same Whether they share one cache line or each have their own.
+ *
+ * @return void
+ */
+static void test_setup(const prim_t *p, int threads, int same) {
+	prim = p;
+	n_threads = threads;
+	same_line = same;
+	n_cpus = env_cpus(cpus, MAX_THREADS);
+	if (n_cpus < 1) {
+		cpus[0] = 0;
+		n_cpus = 1;
+	}
+	memset(slots, 0, sizeof(slots));
+}
+
+/**
+ * @brief Finds a primitive by name.
+ *
+ * @param name The name of the primitive.
+ *
+ * @return Its index in prims, or -1.
+ */
+static int find_prim(const char *name) {
+	for (int i = 0; i < N_PRIMS; i++)
+		if (strcmp(prims[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+#ifdef BENCH_RUNNER
+BENCH(bench_atomics, "atomics/rmw",
+      "op=xadd|xadd64|xchg|cas|cas64|or|or64|cas128 threads=1|2|4"
+      " line=same|different") {
+	int p = find_prim(bench_param(ctx, "op", "xadd"));
+	int threads = bench_param_long(ctx, "threads", 1);
+	const char *line = bench_param(ctx, "line", "same");
+	if (p < 0 || threads < 1 || threads > MAX_THREADS) {
+		fprintf(stderr, "atomics: invalid op or thread count.\n");
+		return;
+	}
+	test_setup(&prims[p], threads, strcmp(line, "same") == 0);
+	bench_time(ctx, "time", do_test);
+}
+#else
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Times back-to-back operations on a line the caller owns: the
+ * latency of the primitive without any contention.
+ *
+ * @param p The primitive to time.
+ *
+ * @return void
+ */
+static void time_uncontended(const prim_t *p) {
+	static uint64_t samples[LATENCY_SAMPLES];
+	test_setup(p, 1, 1);
+	for (int i = 0; i < LATENCY_SAMPLES; i++) {
+		uint64_t t0 = tsc_start();
+		for (int j = 0; j < LATENCY_BATCH; j++)
+			p->op(&slots[0]);
+		uint64_t t1 = tsc_stop();
+		samples[i] = t1 - t0 > tsc_overhead ? t1 - t0 - tsc_overhead : 0;
+	}
+	qsort(samples, LATENCY_SAMPLES, sizeof(uint64_t), compare_u64);
+	double min = (double) samples[0] / LATENCY_BATCH;
+	double median = (double) samples[LATENCY_SAMPLES / 2] / LATENCY_BATCH;
+	printf("  %-8s min = %5.1lf cycles (%5.1lfns), median = %5.1lf cycles "
+	       "(%5.1lfns)\n", p->name, min, min / tsc_ghz, median,
+	       median / tsc_ghz);
+}
+
+/**
+ * @brief Times one primitive at one thread count.
+ *
+ * @return The throughput of all threads together, in millions of
+ * operations per second.
+ */
+static double run_test(const prim_t *p, int threads, int same) {
+	func_stats_t stats;
+	test_setup(p, threads, same);
+	double time = func_time_stats(do_test, 0.001, FUNC_TRIALS, &stats);
+	return (double) OPS_PER_THREAD * threads / time / 1e6;
+}
+
+/**
+ * @brief Returns the thread count after t in a sweep: doubling, but ending
+ * at max_threads.
+ */
+static int next_threads(int t, int max_threads) {
+	return (t < max_threads && 2 * t > max_threads) ? max_threads : 2 * t;
+}
+
+/**
+ * @brief Prints the usage instructions to stderr.
+ *
+ * @param argv The argv program's argument vector.
+ *
+ * @return void
+ */
+static void print_usage(char *argv[]) {
+	fprintf(stderr, "Usage: %s [max_threads] [--op=name]\n", argv[0]);
+	fprintf(stderr, "Sweeps 1, 2, 4, ... up to max_threads (default: the "
+	        "CPUs it may run on,\nat least 2) threads, pinned to those CPUs "
+	        "in turn, on one shared cache line\nand on a line each.\n"
+	        "Primitives:\n");
+	for (int i = 0; i < N_PRIMS; i++)
+		fprintf(stderr, "\t%-8s %s\n", prims[i].name, prims[i].description);
+}
+
+/**
+ * @brief Prints the uncontended latency of every primitive, then the
+ * throughput tables of the shared and the separate cache lines.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv A vector of the command line arguments.
+ *
+ * @return Zero on success or negative error code on failure.
+ */
+int main(int argc, char *argv[]) {
+	int max_threads = env_cpus(cpus, MAX_THREADS);
+	int only = -1;
+	env_t env;
+
+	/* env_cpus stops at MAX_THREADS, the size of threads[] and slots[] */
+	if (max_threads < 2)
+		max_threads = 2;
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--op=", 5) == 0) {
+			only = find_prim(argv[i] + 5);
+			if (only < 0) {
+				print_usage(argv);
+				exit(-1);
+			}
+		} else {
+			max_threads = atoi(argv[i]);
+			if (max_threads < 1 || max_threads > MAX_THREADS) {
+				print_usage(argv);
+				exit(-1);
+			}
+		}
+	}
+
+	env_capture(&env);
+	env_print(stdout, &env);
+	if (tsc_init() < 0)
+		fprintf(stderr, "Warning: the TSC is not invariant.\n");
+
+	printf("Uncontended latency (%d back-to-back operations per sample):\n",
+	       LATENCY_BATCH);
+	for (int p = 0; p < N_PRIMS; p++)
+		if (only < 0 || p == only)
+			time_uncontended(&prims[p]);
+
+	for (int same = 1; same >= 0; same--) {
+		printf("\nThroughput (Mops/s, all threads), %s:\n%-10s",
+		       same ? "one shared cache line" : "a cache line per thread",
+		       "threads");
+		for (int t = 1; t <= max_threads; t = next_threads(t, max_threads))
+			printf(" %8d", t);
+		printf("\n");
+		for (int p = 0; p < N_PRIMS; p++) {
+			if (only >= 0 && p != only)
+				continue;
+			printf("%-10s", prims[p].name);
+			for (int t = 1; t <= max_threads;
+			     t = next_threads(t, max_threads)) {
+				printf(" %8.2lf", run_test(&prims[p], t, same));
+				fflush(stdout);
+			}
+			printf("\n");
+		}
+	}
+	return 0;
+}
+#endif /* BENCH_RUNNER */
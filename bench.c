@@ -0,0 +1,454 @@
+/**
+ * @file bench.c
+ * @brief Unified benchmark runner
+ *
+ * Runs every benchmark registered with BENCH() whose name matches one of the
+ * globs on the command line, once per combination of its parameters, and
+ * writes one CSV or JSON record per measurement. Given a baseline file (an
+ * earlier CSV output), flags the measurements that got significantly
+ * slower: the confidence intervals do not overlap and the median moved by
+ * more than a threshold.
+ *
+ * Every result carries the fingerprint of the machine and its settings
+ * (env.c), and the drift of the core clock: the frequency is probed before
+ * and after the measurement, not during it, so a dip that recovers in
+ * between goes unnoticed.
+ *
+ * --cpu pins only the measuring thread. The threads a benchmark creates
+ * call bench_worker() to run on every CPU again, unless they set their own
+ * affinity (smt keeps all of its threads on CPU 0 on purpose).
+ **/
+#include <fnmatch.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "env.h"
+
+#define MAX_BENCHES 128
+#define MAX_PARAMS 256
+#define MAX_BASELINE 4096
+#define DEFAULT_THRESHOLD 0.05
+#define DEFAULT_ERROR 0.001
+#define DEFAULT_DRIFT 0.02
+
+enum {
+    FORMAT_CSV,
+    FORMAT_JSON
+};
+
+struct bench_ctx {
+    const bench_t *bench;
+    char params[MAX_PARAMS];    /* one combination: "key=value key=value" */
+    char values[MAX_PARAMS];    /* params split in place at the spaces */
+    double freq;                /* env_freq_probe before the measurement */
+};
+
+/* a measurement of an earlier run */
+typedef struct {
+    char name[64];
+    char params[MAX_PARAMS];
+    char metric[64];
+    double median, ci_low, ci_high;
+} baseline_t;
+
+static const bench_t *benches[MAX_BENCHES];
+static int n_benches;
+
+static int trials = FUNC_TRIALS;
+static long double error = DEFAULT_ERROR;
+static int format = FORMAT_CSV;
+static double threshold = DEFAULT_THRESHOLD;
+static char overrides[MAX_PARAMS];  /* from -p, take precedence */
+static double max_drift = DEFAULT_DRIFT;
+
+static env_t env;
+static double freq_ref;             /* cycles per TSC tick at startup */
+
+static baseline_t *baseline;
+static int n_baseline;
+static int n_regressions, n_improvements;
+
+void bench_register(const bench_t *b)
+{
+    if (n_benches == MAX_BENCHES) {
+        fprintf(stderr, "Too many benchmarks, raise MAX_BENCHES.\n");
+        exit(1);
+    }
+    benches[n_benches++] = b;
+}
+
+/**
+ * @brief Looks a key up in a "key=value key=value" string.
+ *
+ * @return A pointer to the value (ending at a space or NUL), or NULL.
+ */
+static const char *find_param(const char *params, const char *key)
+{
+    size_t len = strlen(key);
+    const char *p = params;
+    while (p != NULL && *p != '\0') {
+        while (*p == ' ')
+            p++;
+        if (strncmp(p, key, len) == 0 && p[len] == '=')
+            return p + len + 1;
+        p = strchr(p, ' ');
+    }
+    return NULL;
+}
+
+const char *bench_param(bench_ctx_t *ctx, const char *key, const char *def)
+{
+    const char *v = find_param(ctx->params, key);
+    if (v == NULL)
+        return def;
+    /* the same value, NUL-terminated, valid until the benchmark returns */
+    return ctx->values + (v - ctx->params);
+}
+
+long bench_param_long(bench_ctx_t *ctx, const char *key, long def)
+{
+    const char *v = bench_param(ctx, key, NULL);
+    return v == NULL ? def : atol(v);
+}
+
+int bench_trials(bench_ctx_t *ctx)
+{
+    return trials;
+}
+
+long double bench_error(bench_ctx_t *ctx)
+{
+    return error;
+}
+
+/**
+ * @brief Compares a measurement with the baseline and prints a verdict to
+ * stderr if it changed significantly.
+ */
+static void compare_baseline(bench_ctx_t *ctx, const char *metric,
+                             const func_stats_t *s)
+{
+    for (int i = 0; i < n_baseline; i++) {
+        baseline_t *b = &baseline[i];
+        if (strcmp(b->name, ctx->bench->name) != 0 ||
+            strcmp(b->params, ctx->params) != 0 ||
+            strcmp(b->metric, metric) != 0)
+            continue;
+
+        double change = (s->median - b->median) / b->median;
+        if (s->ci_low > b->ci_high && change > threshold) {
+            n_regressions++;
+            fprintf(stderr, "REGRESSION  ");
+        } else if (s->ci_high < b->ci_low && -change > threshold) {
+            n_improvements++;
+            fprintf(stderr, "IMPROVEMENT ");
+        } else {
+            return;
+        }
+        fprintf(stderr, "%s [%s] %s: %.6gs -> %.6Lgs (%+.1f%%)\n",
+                ctx->bench->name, ctx->params, metric, b->median, s->median,
+                change * 100);
+        return;
+    }
+}
+
+/**
+ * @brief Probes the core clock and returns its largest relative departure
+ * from the startup frequency since the previous probe of ctx.
+ *
+ * @return The drift, or NAN without a cycles counter.
+ */
+static double measure_drift(bench_ctx_t *ctx)
+{
+    double freq = env_freq_probe();
+    double drift = fmax(fabs(ctx->freq - freq_ref),
+                        fabs(freq - freq_ref)) / freq_ref;
+    ctx->freq = freq;
+    if (drift > max_drift)
+        fprintf(stderr, "Warning: the core clock moved by %.1f%% during "
+                "%s [%s].\n", drift * 100, ctx->bench->name, ctx->params);
+    return drift;
+}
+
+void bench_report(bench_ctx_t *ctx, const char *metric,
+                  const func_stats_t *s)
+{
+    double drift = measure_drift(ctx);
+    if (format == FORMAT_JSON) {
+        printf("{\"benchmark\": \"%s\", \"params\": \"%s\", "
+               "\"metric\": \"%s\", \"median\": %.9Lg, \"min\": %.9Lg, "
+               "\"mad\": %.9Lg, \"ci_low\": %.9Lg, \"ci_high\": %.9Lg, "
+               "\"trials\": %d, \"outliers\": %d, ",
+               ctx->bench->name, ctx->params, metric, s->median, s->min,
+               s->mad, s->ci_low, s->ci_high, s->trials, s->outliers);
+        if (isnan(drift))
+            printf("\"freq_drift\": null, \"env\": ");
+        else
+            printf("\"freq_drift\": %.4f, \"env\": ", drift);
+        env_print_json(stdout, &env);
+        printf("}\n");
+    } else {
+        printf("%s,%s,%s,%.9Lg,%.9Lg,%.9Lg,%.9Lg,%.9Lg,%d,%d,%.4f\n",
+               ctx->bench->name, ctx->params, metric, s->median, s->min,
+               s->mad, s->ci_low, s->ci_high, s->trials, s->outliers, drift);
+    }
+    fflush(stdout);
+    compare_baseline(ctx, metric, s);
+}
+
+void bench_worker(void)
+{
+    env_unpin();
+}
+
+long double bench_time(bench_ctx_t *ctx, const char *metric, test_funct P)
+{
+    func_stats_t stats;
+    /* the setup since the last probe is no part of this measurement */
+    ctx->freq = env_freq_probe();
+    func_time_stats(P, error, trials, &stats);
+    bench_report(ctx, metric, &stats);
+    return stats.median;
+}
+
+/**
+ * @brief Loads a baseline written by an earlier run in the CSV format.
+ *
+ * @return Zero on success or -1 if the file cannot be read.
+ */
+static int load_baseline(const char *path)
+{
+    char line[1024], machine[ENV_MACHINE_LEN];
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    env_machine(&env, machine, sizeof(machine));
+    baseline = calloc(MAX_BASELINE, sizeof(baseline_t));
+    while (fgets(line, sizeof(line), f) != NULL && n_baseline < MAX_BASELINE) {
+        baseline_t *b = &baseline[n_baseline];
+        char *fields[8], *rest = line;
+        int n = 0;
+        if (strncmp(line, "# machine: ", 11) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            if (strcmp(line + 11, machine) != 0)
+                fprintf(stderr, "Warning: the baseline was measured on "
+                        "another machine:\n  %s\n", line + 11);
+            continue;
+        }
+        if (line[0] == '#')
+            continue;
+        /* strsep rather than sscanf: the params field may be empty */
+        while (n < 8 && (fields[n] = strsep(&rest, ",\n")) != NULL)
+            n++;
+        if (n < 8 || strcmp(fields[0], "benchmark") == 0)
+            continue;
+        snprintf(b->name, sizeof(b->name), "%s", fields[0]);
+        snprintf(b->params, sizeof(b->params), "%s", fields[1]);
+        snprintf(b->metric, sizeof(b->metric), "%s", fields[2]);
+        b->median = atof(fields[3]);
+        b->ci_low = atof(fields[6]);
+        b->ci_high = atof(fields[7]);
+        n_baseline++;
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * @brief Runs a benchmark once for every combination of the values in
+ * params, expanding the first key with several "|"-separated values.
+ *
+ * @param b The benchmark.
+ * @param params The parameters left to expand.
+ */
+static void run_combinations(const bench_t *b, const char *params)
+{
+    const char *bar = strchr(params, '|');
+    if (bar == NULL) {
+        bench_ctx_t ctx = { .bench = b, .freq = env_freq_probe() };
+        snprintf(ctx.params, sizeof(ctx.params), "%s", params);
+        for (size_t i = 0; i < sizeof(ctx.values); i++)
+            ctx.values[i] = ctx.params[i] == ' ' ? '\0' : ctx.params[i];
+        fprintf(stderr, "Running %s [%s]\n", b->name, ctx.params);
+        b->run(&ctx);
+        return;
+    }
+
+    /* the values of the key around bar, between the '=' and a space */
+    const char *start = bar;
+    while (start > params && start[-1] != '=')
+        start--;
+    const char *end = start + strcspn(start, " ");
+    const char *value = start;
+    while (value < end) {
+        size_t len = strcspn(value, "| ");
+        if (value + len > end)
+            len = end - value;
+        char expanded[MAX_PARAMS];
+        snprintf(expanded, sizeof(expanded), "%.*s%.*s%s",
+                 (int) (start - params), params, (int) len, value, end);
+        run_combinations(b, expanded);
+        value += len + 1;
+    }
+}
+
+/**
+ * @brief Runs a benchmark with its defaults, replacing the values of the
+ * keys given with -p on the command line.
+ */
+static void run_bench(const bench_t *b)
+{
+    char params[MAX_PARAMS] = "";
+    const char *p = b->params;
+
+    while (*p != '\0') {
+        while (*p == ' ')
+            p++;
+        size_t len = strcspn(p, " ");
+        size_t key = strcspn(p, "=");
+        char name[MAX_PARAMS];
+        snprintf(name, sizeof(name), "%.*s", (int) key, p);
+        const char *v = find_param(overrides, name);
+        size_t used = strlen(params);
+        if (v != NULL)
+            snprintf(params + used, sizeof(params) - used, "%s%s=%.*s",
+                     used ? " " : "", name, (int) strcspn(v, " "), v);
+        else
+            snprintf(params + used, sizeof(params) - used, "%s%.*s",
+                     used ? " " : "", (int) len, p);
+        p += len;
+    }
+    run_combinations(b, params);
+}
+
+static void print_usage(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] [GLOB...]\n", argv[0]);
+    fprintf(stderr, "Runs the benchmarks whose name matches a glob "
+            "(all by default).\n");
+    fprintf(stderr, "Optional Arguments:\n");
+    fprintf(stderr, "\t--list            List benchmarks and parameters\n");
+    fprintf(stderr, "\t-p KEY=VALUE      Override a parameter "
+            "(v1|v2 sweeps)\n");
+    fprintf(stderr, "\t--trials=N        Trials per measurement [%d]\n",
+            FUNC_TRIALS);
+    fprintf(stderr, "\t--error=E         Error bound of each trial [%g]\n",
+            DEFAULT_ERROR);
+    fprintf(stderr, "\t--format=FMT      csv [DEFAULT] or json\n");
+    fprintf(stderr, "\t--baseline=FILE   Compare against an earlier csv "
+            "output\n");
+    fprintf(stderr, "\t--threshold=F     Smallest relative change flagged "
+            "[%g]\n", DEFAULT_THRESHOLD);
+    fprintf(stderr, "\t--cpu=N           Pin the measuring thread to CPU N "
+            "(not the\n\t                  threads it creates)\n");
+    fprintf(stderr, "\t--governor=NAME   Set the cpufreq governor of every "
+            "CPU first\n");
+    fprintf(stderr, "\t--turbo=on|off    Enable or disable turbo first\n");
+    fprintf(stderr, "\t--drift=F         Warn when the core clock moves by "
+            "more [%g]\n", DEFAULT_DRIFT);
+    fprintf(stderr, "Exits with status 2 if a regression was detected.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *globs[argc];
+    const char *baseline_path = NULL, *governor = NULL;
+    int n_globs = 0, list = 0, cpu = ENV_UNKNOWN, turbo = ENV_UNKNOWN;
+
+    for (int i = 1; i < argc; i++) {
+        char *s = argv[i];
+        if (strcmp(s, "--list") == 0) {
+            list = 1;
+        } else if (strcmp(s, "-p") == 0 && i + 1 < argc) {
+            size_t used = strlen(overrides);
+            snprintf(overrides + used, sizeof(overrides) - used, "%s%s",
+                     used ? " " : "", argv[++i]);
+        } else if (strncmp(s, "--trials=", 9) == 0) {
+            trials = atoi(s + 9);
+        } else if (strncmp(s, "--error=", 8) == 0) {
+            error = strtold(s + 8, NULL);
+        } else if (strcmp(s, "--format=json") == 0) {
+            format = FORMAT_JSON;
+        } else if (strcmp(s, "--format=csv") == 0) {
+            format = FORMAT_CSV;
+        } else if (strncmp(s, "--baseline=", 11) == 0) {
+            baseline_path = s + 11;
+        } else if (strncmp(s, "--threshold=", 12) == 0) {
+            threshold = atof(s + 12);
+        } else if (strncmp(s, "--cpu=", 6) == 0) {
+            cpu = atoi(s + 6);
+        } else if (strncmp(s, "--governor=", 11) == 0) {
+            governor = s + 11;
+        } else if (strcmp(s, "--turbo=on") == 0) {
+            turbo = 1;
+        } else if (strcmp(s, "--turbo=off") == 0) {
+            turbo = 0;
+        } else if (strncmp(s, "--drift=", 8) == 0) {
+            max_drift = atof(s + 8);
+        } else if (s[0] == '-') {
+            print_usage(argv);
+            return 1;
+        } else {
+            globs[n_globs++] = s;
+        }
+    }
+    if (trials < 1) {
+        fprintf(stderr, "At least one trial is needed.\n");
+        return 1;
+    }
+
+
+    /* enforce the settings asked for: results would be mislabeled if not */
+    if (governor != NULL && env_set_governor(governor) < 0) {
+        perror("Cannot set the cpufreq governor");
+        return 1;
+    }
+    if (turbo != ENV_UNKNOWN && env_set_turbo(turbo) < 0) {
+        perror("Cannot set the turbo state");
+        return 1;
+    }
+    if (cpu != ENV_UNKNOWN && env_pin(cpu) < 0) {
+        fprintf(stderr, "Cannot pin to CPU %d.\n", cpu);
+        return 1;
+    }
+    env_capture(&env);
+    if (baseline_path != NULL && load_baseline(baseline_path) < 0) {
+        perror(baseline_path);
+        return 1;
+    }
+
+    if (!list) {
+        if (env.loadavg >= 1)
+            fprintf(stderr, "Warning: the machine is not idle (load average "
+                    "%.2f).\n", env.loadavg);
+        if (env_freq_init() < 0)
+            fprintf(stderr, "Warning: no cycles counter, frequency drift "
+                    "will not be detected.\n");
+        freq_ref = env_freq_probe();
+    }
+    if (!list && format == FORMAT_CSV) {
+        env_print(stdout, &env);
+        printf("benchmark,params,metric,median,min,mad,ci_low,ci_high,"
+               "trials,outliers,freq_drift\n");
+    }
+    for (int b = 0; b < n_benches; b++) {
+        int match = (n_globs == 0);
+        for (int g = 0; g < n_globs && !match; g++)
+            match = fnmatch(globs[g], benches[b]->name, 0) == 0;
+        if (!match)
+            continue;
+        if (list)
+            printf("%-24s %s\n", benches[b]->name, benches[b]->params);
+        else
+            run_bench(benches[b]);
+    }
+
+    env_freq_close();
+    if (n_baseline > 0)
+        fprintf(stderr, "%d regression(s), %d improvement(s) against the "
+                "baseline.\n", n_regressions, n_improvements);
+    return n_regressions > 0 ? 2 : 0;
+}
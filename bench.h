@@ -0,0 +1,58 @@
+/**
+ * @file bench.h
+ * @brief Registry of benchmarks for the unified runner (bench.c)
+ *
+ * Every benchmark program registers its measurements with BENCH() when built
+ * into the runner (-DBENCH_RUNNER), and reports them with bench_report().
+ **/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "func_time.h"
+
+typedef struct bench_ctx bench_ctx_t;
+typedef void (*bench_funct)(bench_ctx_t *ctx);
+
+/* a registered benchmark */
+typedef struct {
+    const char *name;       /* "program/variant", matched by the runner's globs */
+    const char *params;     /* defaults, "key=value key=v1|v2..." (| sweeps) */
+    bench_funct run;
+} bench_t;
+
+void bench_register(const bench_t *b);
+
+/*
+ * Define and register a benchmark function: BENCH(fn, "lock/atomic",
+ * "threads=1|2|4") { ... } runs fn once per combination of parameters.
+ */
+#define BENCH(fn, name, params)                                         \
+    static void fn(bench_ctx_t *ctx);                                   \
+    __attribute__((constructor)) static void fn##_register(void) {      \
+        static const bench_t b = { name, params, fn };                  \
+        bench_register(&b);                                             \
+    }                                                                   \
+    static void fn(bench_ctx_t *ctx)
+
+const char *bench_param(bench_ctx_t *ctx, const char *key, const char *def);
+long bench_param_long(bench_ctx_t *ctx, const char *key, long def);
+
+/* trials and error bound the runner asks every measurement to use */
+int bench_trials(bench_ctx_t *ctx);
+long double bench_error(bench_ctx_t *ctx);
+
+/*
+ * Call first in every thread a benchmark creates without an affinity of its
+ * own: it would otherwise inherit the CPU the runner's --cpu pinned the
+ * measuring thread to, and share it with all the others.
+ */
+void bench_worker(void);
+
+/* measure P with func_time_stats and report it as metric */
+long double bench_time(bench_ctx_t *ctx, const char *metric, test_funct P);
+/* report a summary measured by the benchmark itself (lower is better) */
+void bench_report(bench_ctx_t *ctx, const char *metric,
+                  const func_stats_t *stats);
+
+#endif /* BENCH_H */
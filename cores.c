@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <time.h>
 #include <pthread.h>
+#ifdef BENCH_RUNNER
+#include "bench.h"
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -14,7 +17,7 @@
 
 typedef struct timespec timespec;
 
-double timespec_diff(timespec *start, timespec *end) {
+static double timespec_diff(timespec *start, timespec *end) {
   double sec_diff  = (double) (end->tv_sec  - start->tv_sec );
   double nsec_diff = (double) (end->tv_nsec - start->tv_nsec);
   return sec_diff + nsec_diff * 1e-9;
@@ -22,21 +25,31 @@ double timespec_diff(timespec *start, timespec *end) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void *dumb_work() {
+static int niter = NITER;
+
+static void *dumb_work() {
   volatile uint32_t x = 0;
-  for(int i = 0; i < NITER; i++) while(++x);
+  for(int i = 0; i < niter; i++) while(++x);
   return NULL;
 }
 
-pthread_t tid[NTHREADS_MAX];
+// the created threads, unlike the caller, leave the runner's --cpu behind
+static void *worker() {
+#ifdef BENCH_RUNNER
+  bench_worker();
+#endif
+  return dumb_work();
+}
+
+static pthread_t tid[NTHREADS_MAX];
 
-double experiment(int n) {
+static double experiment(int n) {
 
   timespec start, end;
   clock_gettime(CLOCK_ID, &start);
 
   for(int i = 0; i < n-1; i++)
-    pthread_create(&tid[i], NULL, dumb_work, NULL);
+    pthread_create(&tid[i], NULL, worker, NULL);
 
   dumb_work();
 
@@ -50,6 +63,24 @@ double experiment(int n) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+#ifdef BENCH_RUNNER
+
+// Each wrap of the counter takes seconds: reduce niter or --trials for speed
+static int bench_threads;
+static void bench_experiment() { experiment(bench_threads); }
+
+BENCH(bench_cores, "cores/threads", "threads=1|2|4|8 niter=1") {
+  bench_threads = bench_param_long(ctx, "threads", 1);
+  niter = bench_param_long(ctx, "niter", NITER);
+  if(bench_threads < 1 || bench_threads > NTHREADS_MAX) {
+    fprintf(stderr, "cores: threads must be in [1, %d].\n", NTHREADS_MAX);
+    return;
+  }
+  bench_time(ctx, "time", bench_experiment);
+}
+
+#else
+
 int main (int argc, char *argv[]) {
 
   printf("n  time    \n");
@@ -62,3 +93,5 @@ int main (int argc, char *argv[]) {
   return 0;
 
 }
+
+#endif // BENCH_RUNNER
@@ -0,0 +1,295 @@
+/**
+ * @file env.c
+ * @brief Pin the measuring thread, read and set the CPU frequency knobs in
+ * sysfs, detect frequency changes and fingerprint the machine
+ **/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* affinity and sched_getcpu */
+#endif
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include "env.h"
+#include "perf.h"
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define FREQ_PROBE_NS 1000000   /* spin of a frequency probe */
+
+/* cycles counter of the probing thread, or -1 */
+static int cycles_fd = -1;
+
+/* read the first line of a file, without its newline; -1 if unreadable */
+static int read_line(const char *path, char *buf, size_t len)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    if (fgets(buf, len, f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/* write a value to a sysfs file; -1 (with errno set) on failure */
+static int write_line(const char *path, const char *value)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+    int ok = fputs(value, f) >= 0;
+    if (fclose(f) != 0)
+        ok = 0;
+    return ok ? 0 : -1;
+}
+
+/* copy the value of the first "key : value" line of /proc/cpuinfo */
+static void read_cpuinfo(const char *key, char *buf, size_t len)
+{
+    char line[256];
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    snprintf(buf, len, "unknown");
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *colon = strchr(line, ':');
+        if (colon == NULL || strncmp(line, key, strlen(key)) != 0)
+            continue;
+        colon += strspn(colon + 1, " \t") + 1;
+        colon[strcspn(colon, "\n")] = '\0';
+        snprintf(buf, len, "%s", colon);
+        break;
+    }
+    fclose(f);
+}
+
+/* the affinity of the thread env_pin first pinned, for env_unpin */
+static cpu_set_t unpinned;
+static int have_unpinned;
+
+/*
+ * pin the calling thread to a CPU, or to the one it runs on if cpu < 0;
+ * threads it creates afterwards inherit the pinning
+ */
+int env_pin(int cpu)
+{
+    cpu_set_t set;
+    if (cpu < 0)
+        cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return -1;
+    if (!have_unpinned &&
+        pthread_getaffinity_np(pthread_self(), sizeof(unpinned),
+                               &unpinned) == 0)
+        have_unpinned = 1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        return -1;
+    return cpu;
+}
+
+/* give the calling thread back the CPUs env_pin took from its creator */
+int env_unpin(void)
+{
+    if (!have_unpinned)
+        return 0;
+    return pthread_setaffinity_np(pthread_self(), sizeof(unpinned),
+                                  &unpinned) == 0 ? 0 : -1;
+}
+
+/*
+ * list up to max of the CPUs the caller may run on, as before env_pin
+ * narrowed them; -1 if unknown
+ */
+int env_cpus(int *cpus, int max)
+{
+    cpu_set_t set;
+    int n = 0;
+    if (have_unpinned)
+        set = unpinned;
+    else if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        return -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++)
+        if (CPU_ISSET(cpu, &set))
+            cpus[n++] = cpu;
+    return n;
+}
+
+/* return the CPU the caller is pinned to, or ENV_UNKNOWN if it may move */
+static int pinned_cpu(void)
+{
+    cpu_set_t set;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0 ||
+        CPU_COUNT(&set) != 1)
+        return ENV_UNKNOWN;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set))
+            return cpu;
+    return ENV_UNKNOWN;
+}
+
+/* turbo from intel_pstate (no_turbo) or acpi-cpufreq (boost) */
+static int read_turbo(void)
+{
+    char buf[16];
+    if (read_line(SYSFS_CPU "/intel_pstate/no_turbo", buf, sizeof(buf)) == 0)
+        return atoi(buf) == 0;
+    if (read_line(SYSFS_CPU "/cpufreq/boost", buf, sizeof(buf)) == 0)
+        return atoi(buf) != 0;
+    return ENV_UNKNOWN;
+}
+
+static int read_smt(void)
+{
+    char buf[64];
+    if (read_line(SYSFS_CPU "/smt/active", buf, sizeof(buf)) == 0)
+        return atoi(buf) != 0;
+    /* older kernels: does cpu0 share its core with another CPU? */
+    if (read_line(SYSFS_CPU "/cpu0/topology/thread_siblings_list", buf,
+                  sizeof(buf)) == 0)
+        return strpbrk(buf, ",-") != NULL;
+    return ENV_UNKNOWN;
+}
+
+/* fill in the fingerprint of the machine and the caller's settings */
+void env_capture(env_t *env)
+{
+    char path[128], buf[64];
+    struct utsname u;
+
+    read_cpuinfo("model name", env->cpu_model, sizeof(env->cpu_model));
+    read_cpuinfo("microcode", env->microcode, sizeof(env->microcode));
+    if (uname(&u) == 0)
+        snprintf(env->kernel, sizeof(env->kernel), "%s %s", u.release,
+                 u.version);
+    else
+        snprintf(env->kernel, sizeof(env->kernel), "unknown");
+    env->smt = read_smt();
+
+    env->cpu = pinned_cpu();
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cpufreq/scaling_governor",
+             env->cpu == ENV_UNKNOWN ? 0 : env->cpu);
+    if (read_line(path, env->governor, sizeof(env->governor)) < 0)
+        snprintf(env->governor, sizeof(env->governor), "unknown");
+    env->turbo = read_turbo();
+
+    env->loadavg = -1;
+    if (read_line("/proc/loadavg", buf, sizeof(buf)) == 0)
+        env->loadavg = atof(buf);
+}
+
+static const char *state_name(int state)
+{
+    return state == ENV_UNKNOWN ? "unknown" : state ? "on" : "off";
+}
+
+/* describe the machine, which results are only comparable within */
+void env_machine(const env_t *env, char *buf, size_t len)
+{
+    snprintf(buf, len, "cpu=\"%s\" microcode=%s kernel=\"%s\" smt=%s",
+             env->cpu_model, env->microcode, env->kernel,
+             state_name(env->smt));
+}
+
+/* print the fingerprint as two comment lines: machine and settings */
+void env_print(FILE *out, const env_t *env)
+{
+    char machine[ENV_MACHINE_LEN];
+    env_machine(env, machine, sizeof(machine));
+    fprintf(out, "# machine: %s\n", machine);
+    fprintf(out, "# settings: pinned=");
+    if (env->cpu == ENV_UNKNOWN)
+        fprintf(out, "none");
+    else
+        fprintf(out, "cpu%d", env->cpu);
+    fprintf(out, " governor=%s turbo=%s loadavg=%.2f\n", env->governor,
+            state_name(env->turbo), env->loadavg);
+}
+
+/* print the fingerprint as a JSON object */
+void env_print_json(FILE *out, const env_t *env)
+{
+    fprintf(out, "{\"cpu_model\": \"%s\", \"microcode\": \"%s\", "
+            "\"kernel\": \"%s\", \"smt\": \"%s\", \"pinned\": %d, "
+            "\"governor\": \"%s\", \"turbo\": \"%s\", \"loadavg\": %.2f}",
+            env->cpu_model, env->microcode, env->kernel,
+            state_name(env->smt), env->cpu, env->governor,
+            state_name(env->turbo), env->loadavg);
+}
+
+/* set the scaling governor of every CPU that has one */
+int env_set_governor(const char *governor)
+{
+    char path[128];
+    int found = 0;
+    long n = sysconf(_SC_NPROCESSORS_CONF);
+
+    for (long cpu = 0; cpu < n; cpu++) {
+        snprintf(path, sizeof(path),
+                 SYSFS_CPU "/cpu%ld/cpufreq/scaling_governor", cpu);
+        if (access(path, F_OK) != 0)
+            continue;
+        if (write_line(path, governor) < 0)
+            return -1;
+        found = 1;
+    }
+    if (!found)
+        errno = ENOENT;
+    return found ? 0 : -1;
+}
+
+int env_set_turbo(int on)
+{
+    if (access(SYSFS_CPU "/intel_pstate/no_turbo", F_OK) == 0)
+        return write_line(SYSFS_CPU "/intel_pstate/no_turbo", on ? "0" : "1");
+    if (access(SYSFS_CPU "/cpufreq/boost", F_OK) == 0)
+        return write_line(SYSFS_CPU "/cpufreq/boost", on ? "1" : "0");
+    errno = ENOENT;
+    return -1;
+}
+
+/*
+ * open the cycles counter of the calling thread, which must be the one to
+ * call env_freq_probe; returns -1 if the host has no cycles counter
+ */
+int env_freq_init(void)
+{
+    if (tsc_ghz == 0)
+        tsc_init();
+    cycles_fd = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    return cycles_fd < 0 ? -1 : 0;
+}
+
+/* spin for FREQ_PROBE_NS and return core cycles per TSC tick, or NAN */
+double env_freq_probe(void)
+{
+    if (cycles_fd < 0)
+        return NAN;
+    uint64_t ticks = FREQ_PROBE_NS * tsc_ghz;
+    long long c0 = read_counter(cycles_fd);
+    uint64_t t0 = tsc_start();
+    uint64_t t1;
+    while ((t1 = tsc_stop()) - t0 < ticks)
+        continue;
+    long long c1 = read_counter(cycles_fd);
+    if (c0 < 0 || c1 < 0)
+        return NAN;
+    return (double) (c1 - c0) / (t1 - t0);
+}
+
+void env_freq_close(void)
+{
+    if (cycles_fd >= 0)
+        close_counter(cycles_fd);
+    cycles_fd = -1;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file env.h
+ * @brief Control and record the environment benchmarks run in
+ **/
+
+#ifndef ENV_H
+#define ENV_H
+
+#include <stdio.h>
+
+#define ENV_UNKNOWN -1
+#define ENV_MACHINE_LEN 512
+
+/* fingerprint of the machine and of the settings that move our numbers */
+typedef struct {
+    char cpu_model[128];
+    char microcode[32];
+    char kernel[192];       /* uname release and version */
+    int smt;                /* 1 if SMT is active, 0 if not, or ENV_UNKNOWN */
+    int cpu;                /* CPU the caller is pinned to, or ENV_UNKNOWN */
+    char governor[32];      /* cpufreq scaling governor, or "unknown" */
+    int turbo;              /* 1 if turbo is enabled, 0 if not, or ENV_UNKNOWN */
+    double loadavg;         /* 1 minute load average: is the machine idle? */
+} env_t;
+
+int env_pin(int cpu);
+int env_unpin(void);
+int env_cpus(int *cpus, int max);
+void env_capture(env_t *env);
+void env_machine(const env_t *env, char *buf, size_t len);
+void env_print(FILE *out, const env_t *env);
+void env_print_json(FILE *out, const env_t *env);
+
+/* write the sysfs knobs of every CPU; -1 (with errno set) if not permitted */
+int env_set_governor(const char *governor);
+int env_set_turbo(int on);
+
+/*
+ * Frequency probe: the ratio of core cycles to TSC ticks while the caller
+ * spins for a moment. The TSC ticks at a constant rate, so the ratio moves
+ * whenever the core clock does (turbo, thermal throttling, governor).
+ */
+int env_freq_init(void);
+double env_freq_probe(void);
+void env_freq_close(void);
+
+#endif /* ENV_H */
@@ -1,10 +1,18 @@
 #include "func_time.h"
 #include "perf.h"
+#include <math.h>
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 #define SAMPLE_SIZE 1000
+/* shortest trial of func_time_stats, so that every trial spans many ticks */
+#define MIN_TRIAL_TIME 1e-3
+#define WARMUP_RUNS 2
+#define OVERHEAD_RUNS 5
+/* modified z-score above which a trial is an outlier (Iglewicz & Hoaglin) */
+#define OUTLIER_Z 3.5
 
 /**
  * @brief Computes an estimate for the value of delta on the system's
@@ -94,9 +102,9 @@ long double time_for_n_iterations_hw(test_funct P, unsigned n)
     P();
 
     // time n-many iterations of the operation
-    ts = get_etime();
+    ts = get_etime_hw();
     for(i = 0; i < n; ++i) P();
-    tf = get_etime();
+    tf = get_etime_hw();
 
     return tf - ts;
 }
@@ -153,15 +161,182 @@ long double func_time(test_funct P, long double E)
 long double func_time_hw(test_funct P, long double E)
 {
     unsigned n = 1;
-    long double delta = get_delta();
+    long double delta = get_delta_hw();
     long double t_threshold = minimum_observed_time(E, delta);
 
     while (1) {
         long double t_aggregate = time_for_n_iterations_hw(P, n);
         // in order for our math to hold, observed time must be >= delta
         if (t_aggregate >= MAX(delta, t_threshold)) {
-            return (t_aggregate * 10e3) / n;
+            return t_aggregate / n;
         }
         n *= 2;
     }
 }
+
+/**
+ * @brief The empty function, timed to measure the overhead of the loop and
+ * the indirect call around P.
+ */
+static void empty_funct(void)
+{
+}
+
+/**
+ * @brief Times n-many back-to-back executions of P on the hardware clock.
+ *
+ * @param P The function to time.
+ * @param n The number of executions to time.
+ *
+ * @return The total time taken for n-many executions of function P.
+ */
+static long double time_trial(test_funct P, unsigned n)
+{
+    unsigned i;
+    long double ts, tf;
+
+    init_etime_hw();
+    ts = get_etime_hw();
+    for(i = 0; i < n; ++i) P();
+    tf = get_etime_hw();
+
+    return tf - ts;
+}
+
+static int compare_ld(const void *a, const void *b)
+{
+    long double x = *(const long double *) a, y = *(const long double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Computes the median of a sorted array.
+ */
+static long double sorted_median(const long double *x, int n)
+{
+    return (n % 2) ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+}
+
+/**
+ * @brief Computes the median absolute deviation of an array from its
+ * median.
+ */
+static long double median_abs_dev(const long double *x, int n,
+                                  long double median)
+{
+    long double *dev = malloc(n * sizeof(long double));
+    for (int i = 0; i < n; i++)
+        dev[i] = fabsl(x[i] - median);
+    qsort(dev, n, sizeof(long double), compare_ld);
+    long double mad = sorted_median(dev, n);
+    free(dev);
+    return mad;
+}
+
+/**
+ * @brief Returns the two-sided 95% quantile of Student's t distribution.
+ *
+ * @param dof The degrees of freedom.
+ */
+static long double student_t95(int dof)
+{
+    static const long double t[] = { 0, 12.71, 4.30, 3.18, 2.78, 2.57, 2.45,
+                                     2.36, 2.31, 2.26, 2.23 };
+    return dof <= 10 ? t[dof] : 1.96 + 2.5 / dof;
+}
+
+/**
+ * @brief Times a function over many independent trials and summarizes
+ * them robustly.
+ *
+ * @note P is first run a few times to warm caches and branch predictors.
+ * The doubling procedure of func_time then picks the number of executions
+ * per trial so that each trial meets the error bound E (and lasts at least
+ * MIN_TRIAL_TIME). The per-execution cost of an empty loop is subtracted
+ * from every trial. Trials whose modified z-score exceeds OUTLIER_Z are
+ * rejected before computing the summary.
+ *
+ * @param P The function to time.
+ * @param E The acceptable measurement error of each trial.
+ * @param trials The number of trials to run.
+ * @param stats Filled in with the summary (all times are per execution).
+ *
+ * @return The median running time of function P.
+ */
+long double func_time_stats(test_funct P, long double E, int trials,
+                            func_stats_t *stats)
+{
+    unsigned n = 1;
+    long double delta = get_delta_hw();
+    long double t_threshold = MAX(minimum_observed_time(E, delta),
+                                  MIN_TRIAL_TIME);
+    long double *t = malloc(trials * sizeof(long double));
+
+    for (int i = 0; i < WARMUP_RUNS; i++)
+        P();
+
+    while (time_trial(P, n) < t_threshold)
+        n *= 2;
+
+    // the cheapest empty loop is the one least disturbed by noise
+    stats->overhead = -1;
+    for (int i = 0; i < OVERHEAD_RUNS; i++) {
+        long double o = time_trial(empty_funct, n) / n;
+        if (stats->overhead < 0 || o < stats->overhead)
+            stats->overhead = o;
+    }
+
+    for (int i = 0; i < trials; i++) {
+        t[i] = time_trial(P, n) / n - stats->overhead;
+    }
+    qsort(t, trials, sizeof(long double), compare_ld);
+
+    // reject outliers, then summarize what is left
+    long double median = sorted_median(t, trials);
+    long double mad = median_abs_dev(t, trials, median);
+    int kept = 0;
+    for (int i = 0; i < trials; i++) {
+        if (mad == 0 || 0.6745 * fabsl(t[i] - median) / mad <= OUTLIER_Z)
+            t[kept++] = t[i];
+    }
+
+    long double mean = 0, var = 0;
+    for (int i = 0; i < kept; i++)
+        mean += t[i];
+    mean /= kept;
+    for (int i = 0; i < kept; i++)
+        var += (t[i] - mean) * (t[i] - mean);
+    var = kept > 1 ? var / (kept - 1) : 0;
+    long double half = kept > 1 ? student_t95(kept - 1) * sqrtl(var / kept) : 0;
+
+    stats->iterations = n;
+    stats->trials = kept;
+    stats->outliers = trials - kept;
+    stats->min = t[0];
+    stats->median = sorted_median(t, kept);
+    stats->mad = median_abs_dev(t, kept, stats->median);
+    stats->mean = mean;
+    stats->ci_low = mean - half;
+    stats->ci_high = mean + half;
+
+    free(t);
+    return stats->median;
+}
+
+/**
+ * @brief Prints a summary computed by func_time_stats on one line.
+ *
+ * @param out The stream to print to.
+ * @param stats The summary.
+ * @param scale Multiplier from seconds to the printed unit (e.g. 1e3).
+ * @param unit The name of the printed unit (e.g. "ms").
+ */
+void func_stats_print(FILE *out, const func_stats_t *stats,
+                      long double scale, const char *unit)
+{
+    fprintf(out, "median = %.4Lf%s (min %.4Lf, MAD %.4Lf, "
+            "95%% CI of mean [%.4Lf, %.4Lf]; %d trials, %d outliers)\n",
+            stats->median * scale, unit, stats->min * scale,
+            stats->mad * scale, stats->ci_low * scale, stats->ci_high * scale,
+            stats->trials, stats->outliers);
+}
@@ -3,7 +3,31 @@
 #ifndef FUNC_TIME_H
 #define FUNC_TIME_H
 
+#include <stdio.h>
+
 typedef void (*test_funct)(void);
 long double func_time(test_funct P, long double E);
 long double func_time_hw(test_funct P, long double E);
+
+/* default number of trials for func_time_stats */
+#define FUNC_TRIALS 15
+
+/* summary of many trials, in seconds per execution */
+typedef struct {
+    long double min;
+    long double median;
+    long double mad;        /* median absolute deviation */
+    long double mean;
+    long double ci_low;     /* 95% confidence interval of the mean */
+    long double ci_high;
+    long double overhead;   /* empty-loop cost subtracted from each trial */
+    unsigned iterations;    /* executions per trial */
+    int trials;             /* trials kept */
+    int outliers;           /* trials rejected */
+} func_stats_t;
+
+long double func_time_stats(test_funct P, long double E, int trials,
+                            func_stats_t *stats);
+void func_stats_print(FILE *out, const func_stats_t *stats,
+                      long double scale, const char *unit);
 #endif /* FUNC_TIME_H */
\ No newline at end of file
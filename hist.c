@@ -0,0 +1,66 @@
+/**
+ * @file hist.c
+ * @brief Log-linear latency histograms: merging and percentiles
+ **/
+#include <string.h>
+#include "hist.h"
+
+void hist_reset(hist_t *h)
+{
+    memset(h, 0, sizeof(hist_t));
+}
+
+/* add the values of h to acc */
+void hist_merge(hist_t *acc, const hist_t *h)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        acc->counts[i] += h->counts[i];
+    acc->total += h->total;
+    if (h->max > acc->max)
+        acc->max = h->max;
+}
+
+/* the largest value of a bucket */
+static uint64_t bucket_high(int b)
+{
+    if (b < HIST_SUB)
+        return b;
+    int shift = b / HIST_SUB - 1;
+    uint64_t low = (uint64_t) (b % HIST_SUB + HIST_SUB) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+/*
+ * return the value at or below which a fraction p of the values lie, as the
+ * top of its bucket (but never above the largest value recorded)
+ */
+uint64_t hist_percentile(const hist_t *h, double p)
+{
+    uint64_t rank = p * h->total, seen = 0;
+    if (h->total == 0)
+        return 0;
+    if (rank >= h->total)
+        rank = h->total - 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen > rank) {
+            uint64_t v = bucket_high(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* print p50/p99/p99.9/max, also converted to nanoseconds */
+void hist_print(FILE *out, const hist_t *h, double ns_per_unit)
+{
+    const double ps[] = { 0.5, 0.99, 0.999 };
+    const char *names[] = { "p50", "p99", "p99.9" };
+
+    for (int i = 0; i < 3; i++) {
+        uint64_t v = hist_percentile(h, ps[i]);
+        fprintf(out, "%s = %lu (%.1lfns), ", names[i], v, v * ns_per_unit);
+    }
+    fprintf(out, "max = %lu (%.1lfns); %lu samples\n", h->max,
+            h->max * ns_per_unit, h->total);
+}
@@ -0,0 +1,52 @@
+/**
+ * @file hist.h
+ * @brief Log-linear latency histograms (in the style of HdrHistogram)
+ *
+ * Values below HIST_SUB have a bucket each; above, every power of two is
+ * split into HIST_SUB linear buckets, so a percentile is within 1/HIST_SUB
+ * (about 3%) of the exact value whatever its magnitude, and recording is a
+ * few instructions.
+ **/
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 48        /* larger values count as 2^48 - 1 */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} __attribute__((aligned(64))) hist_t;
+
+/* index of the bucket of a value */
+static inline int hist_bucket(uint64_t v)
+{
+    if (v >= (1ULL << HIST_MAX_BITS))
+        v = (1ULL << HIST_MAX_BITS) - 1;
+    if (v < HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+static inline void hist_record(hist_t *h, uint64_t v)
+{
+    h->counts[hist_bucket(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+void hist_reset(hist_t *h);
+void hist_merge(hist_t *acc, const hist_t *h);
+uint64_t hist_percentile(const hist_t *h, double p);
+void hist_print(FILE *out, const hist_t *h, double ns_per_unit);
+
+#endif /* HIST_H */
@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <time.h>
 #include <pthread.h>
+#ifdef BENCH_RUNNER
+#include "bench.h"
+#endif
 
 #define NITER     (1 << 30)
 #define ALIGN     (1 << 26)
@@ -14,7 +17,7 @@
 
 typedef struct timespec timespec;
 
-double timespec_diff(timespec *start, timespec *end) {
+static double timespec_diff(timespec *start, timespec *end) {
   double sec_diff  = (double) (end->tv_sec  - start->tv_sec );
   double nsec_diff = (double) (end->tv_nsec - start->tv_nsec);
   return sec_diff + nsec_diff * 1e-9;
@@ -22,19 +25,23 @@ double timespec_diff(timespec *start, timespec *end) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-uint8_t *data;
+static uint8_t *data;
+static long niter = NITER;
 
-void init_data() {
+static void init_data() {
    posix_memalign((void**) &data, ALIGN, 2 * LINE_MAX);
 }
 
-void *dumb_work(void* ptr) {
+static void *dumb_work(void* ptr) {
   uint8_t *x = (uint8_t*) ptr;
-  for(int i = 0; i < NITER; i++) (*x)++;
+#ifdef BENCH_RUNNER
+  bench_worker();
+#endif
+  for(long i = 0; i < niter; i++) (*x)++;
   return NULL;
 }
 
-double experiment(int n) {
+static double experiment(int n) {
   pthread_t t1, t2;
   timespec start, end;
   clock_gettime(CLOCK_ID, &start);
@@ -50,6 +57,24 @@ double experiment(int n) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+#ifdef BENCH_RUNNER
+
+static int bench_sep;
+static void bench_experiment() { experiment(bench_sep); }
+
+BENCH(bench_linesize, "linesize/sep", "sep=4|32|64|128|256 niter=16777216") {
+  bench_sep = bench_param_long(ctx, "sep", LINE_MIN);
+  niter = bench_param_long(ctx, "niter", NITER);
+  if(bench_sep < 1 || bench_sep > 2 * LINE_MAX - 1) {
+    fprintf(stderr, "linesize: sep must be in [1, %d].\n", 2 * LINE_MAX - 1);
+    return;
+  }
+  if(data == NULL) init_data();
+  bench_time(ctx, "time", bench_experiment);
+}
+
+#else
+
 int main (int argc, char *argv[]) {
 
   init_data();
@@ -65,3 +90,5 @@ int main (int argc, char *argv[]) {
   return 0;
 
 }
+
+#endif // BENCH_RUNNER
@@ -1,57 +1,841 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <semaphore.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <x86intrin.h>
 #include "atomic.h"
 #include "func_time.h"
+#include "perf.h"
+#include "env.h"
+#include "hist.h"
+#ifdef BENCH_RUNNER
+#include "bench.h"
+#endif
 
-static void *(*incr_func)(void*);
+/** @brief Spins of a lock waiter before it yields the CPU to the holder */
+#define SPIN_YIELD 1024
+/** @brief Bounds of the exponential backoff of the TTAS lock, in pauses */
+#define BACKOFF_MIN 4
+#define BACKOFF_MAX 1024
+/** @brief Largest thread count of a sweep */
+#define MAX_THREADS 256
+/** @brief Words of protected data; critical-section work wraps around them */
+#define SHARED_WORDS 1024
+/** @brief Threads sharing a first-level counter of the combining counter */
+#define COMBINE_FANOUT 4
+/** @brief Increments a counter holds back before passing them on */
+#define COUNTER_BATCH 64
+/** @brief Think times of the throughput surface (--surface) */
+#define THINK_LEVELS { 0, 16, 256, 4096 }
+
+/** @brief Keeps the compiler from moving memory accesses across it */
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+/** @brief MCS queue node: each waiter spins on its own flag */
+typedef struct mcs_node {
+	struct mcs_node *volatile next;
+	volatile int locked;
+} __attribute__((aligned(64))) mcs_node_t;
+
+/** @brief CLH queue node: each waiter spins on its predecessor's flag */
+typedef struct {
+	volatile int locked;
+} __attribute__((aligned(64))) clh_node_t;
+
+/** @brief Per-thread state of the queue and reader-writer locks */
+typedef struct {
+	mcs_node_t mcs;
+	clh_node_t *clh;        /**< The node this thread enqueues next */
+	clh_node_t *clh_pred;   /**< Its predecessor, recycled on release */
+	int id;                 /**< The thread's slot (big-reader lock, counters) */
+	unsigned seq;           /**< Sequence number a seqlock reader started at */
+	int batch;              /**< Increments the batched counter holds back */
+} lock_node_t;
+
+/**
+ * @brief A lock implementation, selected with --<name>. Reader-writer locks
+ * also have a shared mode; a read_release returning non-zero means that the
+ * read raced with a writer and must be retried (seqlock).
+ *
+ * Counters have no lock: writes call add, reads call read, and every thread
+ * calls flush (if any) before it exits.
+ */
+typedef struct {
+	const char *name;
+	const char *description;
+	void (*init)(void);
+	void (*acquire)(lock_node_t *node);
+	void (*release)(lock_node_t *node);
+	void (*read_acquire)(lock_node_t *node);
+	int (*read_release)(lock_node_t *node);
+	void (*add)(lock_node_t *node);
+	long (*read)(void);
+	void (*flush)(lock_node_t *node);
+} lock_t;
+
+static const lock_t *lock;
 static pthread_t *threads;
-static sem_t sem;
 static int n_threads;
-static int n_increments;
+static int n_increments; /* operations per thread */
 static int n = 0;
+static int use_counters;
+static perf_counts_t *thread_counts; /* per thread, summed over test runs */
+static int test_runs;
+static int n_writes; /* by every thread in the last run: the expected n */
+static long n_ops;   /* by every thread in the last run */
+/* over every run since test_setup: a rate of ops and time of the same runs */
+static long ops_total;
+static double seconds_total;
+/* the threads and do_test wait at it, so the threads start together */
+static pthread_barrier_t start_line;
+static int spin_yield = SPIN_YIELD; /* 1 with more threads than CPUs */
 
-enum {
-	MODE_SEMAPHORE,
-	MODE_ATOMIC
-};
+/* shape of the contention, see print_usage */
+static int cs_work = 1;
+static int think_work = 0;
+static double read_ratio = 0;
+
+/*
+ * --latency: acquire-wait histograms and operations of each thread, summed
+ * over test runs; each run ends when the first thread finishes its share
+ */
+static int use_latency;
+static hist_t *thread_hists;
+static long *thread_ops;
+static volatile int stop_run;
+
+/* the data the lock protects; n counts the writes */
+static volatile int shared[SHARED_WORDS];
+static volatile long read_sink;
 
 typedef struct {
+	lock_node_t node;
 	int *n;
 	int n_iters;
-	sem_t *sem;
+	int id;
+	int n_writes;           /**< Write operations done, to check n against */
+	int n_ops;              /**< Operations done */
 } args_t;
 
+/**
+ * @brief Waits for a lock a little longer: pauses at first, then yields so
+ * that a preempted holder (or, for the FIFO locks, the next in line) can
+ * run when there are more threads than CPUs.
+ *
+ * @param spins The number of waits so far, updated.
+ *
+ * @return void
+ */
+static inline void spin_wait(int *spins) {
+	if (++*spins < spin_yield)
+		_mm_pause();
+	else
+		sched_yield();
+}
+
+/* POSIX semaphore */
+
+static sem_t sem;
+
+static void sem_lock_init(void) {
+	sem_destroy(&sem);
+	sem_init(&sem, 0, 1);
+}
+
+static void sem_lock_acquire(lock_node_t *node) {
+	sem_wait(&sem);
+}
+
+static void sem_lock_release(lock_node_t *node) {
+	sem_post(&sem);
+}
+
+/* test-and-test-and-set with exponential backoff */
+
+static volatile int ttas;
+
+static void ttas_init(void) {
+	ttas = 0;
+}
+
+static void ttas_acquire(lock_node_t *node) {
+	int delay = BACKOFF_MIN, spins = 0;
+	while (1) {
+		/* spin on our cached copy until the lock looks free */
+		while (ttas)
+			spin_wait(&spins);
+		if (atomic_swap((int *) &ttas, 1) == 0)
+			return;
+		/* lost the race: back off so the winners do not all collide again */
+		for (int i = 0; i < delay; i++)
+			_mm_pause();
+		if (delay < BACKOFF_MAX)
+			delay *= 2;
+	}
+}
+
+static void ttas_release(lock_node_t *node) {
+	barrier();
+	ttas = 0;
+}
+
+/* ticket lock: FIFO, but every waiter spins on the same line */
+
+static int next_ticket;
+static volatile int now_serving;
+
+static void ticket_init(void) {
+	next_ticket = 0;
+	now_serving = 0;
+}
+
+static void ticket_acquire(lock_node_t *node) {
+	int ticket = atomic_increment(&next_ticket, 1), spins = 0;
+	while (now_serving != ticket)
+		spin_wait(&spins);
+	barrier();
+}
+
+static void ticket_release(lock_node_t *node) {
+	barrier();
+	now_serving = now_serving + 1;
+}
+
+/* MCS queue lock: FIFO, every waiter spins on its own node */
+
+static mcs_node_t *mcs_tail;
+
+static void mcs_init(void) {
+	mcs_tail = NULL;
+}
+
+static void mcs_acquire(lock_node_t *node) {
+	mcs_node_t *me = &node->mcs, *pred;
+	int spins = 0;
+	me->next = NULL;
+	me->locked = 1;
+	pred = (mcs_node_t *) atomic_swap64((long *) &mcs_tail, (long) me);
+	if (pred == NULL)
+		return;
+	pred->next = me;
+	while (me->locked)
+		spin_wait(&spins);
+	barrier();
+}
+
+static void mcs_release(lock_node_t *node) {
+	mcs_node_t *me = &node->mcs;
+	int spins = 0;
+	barrier();
+	if (me->next == NULL) {
+		/* no known successor: try to empty the queue */
+		if (atomic_cas64((long *) &mcs_tail, (long) me, 0) == (long) me)
+			return;
+		/* a successor swapped itself in but has not linked to us yet */
+		while (me->next == NULL)
+			spin_wait(&spins);
+	}
+	me->next->locked = 0;
+}
+
+/* CLH queue lock: FIFO, every waiter spins on its predecessor's node */
+
+static clh_node_t *clh_nodes; /* one per thread plus the initial tail */
+static clh_node_t *clh_tail;
+
+static void clh_init(void) {
+	clh_nodes[n_threads].locked = 0;
+	clh_tail = &clh_nodes[n_threads];
+}
+
+static void clh_acquire(lock_node_t *node) {
+	int spins = 0;
+	node->clh->locked = 1;
+	node->clh_pred = (clh_node_t *) atomic_swap64((long *) &clh_tail,
+	                                              (long) node->clh);
+	while (node->clh_pred->locked)
+		spin_wait(&spins);
+	barrier();
+}
+
+static void clh_release(lock_node_t *node) {
+	barrier();
+	node->clh->locked = 0;
+	/* our node now belongs to the successor: take over the predecessor's */
+	node->clh = node->clh_pred;
+}
+
+/* pthread spinlock and mutex */
+
+static pthread_spinlock_t spinlock;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void spin_init(void) {
+	pthread_spin_init(&spinlock, PTHREAD_PROCESS_PRIVATE);
+}
+
+static void spin_acquire(lock_node_t *node) {
+	pthread_spin_lock(&spinlock);
+}
+
+static void spin_release(lock_node_t *node) {
+	pthread_spin_unlock(&spinlock);
+}
+
+static void mutex_acquire(lock_node_t *node) {
+	pthread_mutex_lock(&mutex);
+}
+
+static void mutex_release(lock_node_t *node) {
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * futex mutex ("Futexes Are Tricky", mutex 2): 0 is unlocked, 1 locked, 2
+ * locked with possible waiters, so that an uncontended release makes no
+ * system call
+ */
+
+static int futex_word;
+
+static void futex_init(void) {
+	futex_word = 0;
+}
+
+static void futex_acquire(lock_node_t *node) {
+	int c = atomic_cas(&futex_word, 0, 1);
+	if (c == 0)
+		return;
+	if (c != 2)
+		c = atomic_swap(&futex_word, 2);
+	while (c != 0) {
+		syscall(SYS_futex, &futex_word, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+		c = atomic_swap(&futex_word, 2);
+	}
+}
+
+static void futex_release(lock_node_t *node) {
+	if (atomic_increment(&futex_word, -1) != 1) {
+		futex_word = 0;
+		syscall(SYS_futex, &futex_word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+/* pthread reader-writer lock */
+
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void rwlock_acquire(lock_node_t *node) {
+	pthread_rwlock_wrlock(&rwlock);
+}
+
+static void rwlock_release(lock_node_t *node) {
+	pthread_rwlock_unlock(&rwlock);
+}
+
+static void rwlock_read_acquire(lock_node_t *node) {
+	pthread_rwlock_rdlock(&rwlock);
+}
+
+static int rwlock_read_release(lock_node_t *node) {
+	pthread_rwlock_unlock(&rwlock);
+	return 0;
+}
+
+/*
+ * seqlock: writers make the sequence odd while they write; readers take no
+ * lock at all and retry if the sequence moved under them
+ */
+
+static volatile int seq;
+
+static void seqlock_init(void) {
+	seq = 0;
+}
+
+static void seqlock_acquire(lock_node_t *node) {
+	int spins = 0;
+	while (1) {
+		int s = seq;
+		if (!(s & 1) && atomic_cas((int *) &seq, s, s + 1) == s)
+			break;
+		spin_wait(&spins);
+	}
+	barrier();
+}
+
+static void seqlock_release(lock_node_t *node) {
+	barrier();
+	seq = seq + 1;
+}
+
+static void seqlock_read_acquire(lock_node_t *node) {
+	int spins = 0;
+	while ((node->seq = seq) & 1)
+		spin_wait(&spins);
+	barrier();
+}
+
+static int seqlock_read_release(lock_node_t *node) {
+	barrier();
+	return seq != (int) node->seq;
+}
+
+/*
+ * big-reader lock: one lock per thread (rather than per CPU, as the threads
+ * are not pinned); readers take only their own, writers take them all
+ */
+
+typedef struct {
+	volatile int locked;
+} __attribute__((aligned(64))) br_slot_t;
+
+static br_slot_t *br_slots;
+
+static void br_init(void) {
+	for (int i = 0; i < n_threads; i++)
+		br_slots[i].locked = 0;
+}
+
+static void br_slot_acquire(br_slot_t *slot) {
+	int spins = 0;
+	while (slot->locked || atomic_swap((int *) &slot->locked, 1) != 0)
+		spin_wait(&spins);
+	barrier();
+}
+
+static void br_acquire(lock_node_t *node) {
+	/* always in the same order, so that writers cannot deadlock */
+	for (int i = 0; i < n_threads; i++)
+		br_slot_acquire(&br_slots[i]);
+}
+
+static void br_release(lock_node_t *node) {
+	barrier();
+	for (int i = 0; i < n_threads; i++)
+		br_slots[i].locked = 0;
+}
+
+static void br_read_acquire(lock_node_t *node) {
+	br_slot_acquire(&br_slots[node->id]);
+}
+
+static int br_read_release(lock_node_t *node) {
+	barrier();
+	br_slots[node->id].locked = 0;
+	return 0;
+}
+
+/* atomic_increment on the single shared count */
+
+static void atomic_add(lock_node_t *node) {
+	atomic_increment(&n, 1);
+}
+
+static long atomic_read(void) {
+	return *(volatile int *) &n;
+}
+
+/*
+ * sharded counter: one padded slot per thread, written only by its owner
+ * with plain stores, summed by readers
+ */
+
+typedef struct {
+	volatile int count;
+} __attribute__((aligned(64))) counter_slot_t;
+
+static counter_slot_t *counter_slots;
+
+static void sharded_init(void) {
+	for (int i = 0; i < n_threads; i++)
+		counter_slots[i].count = 0;
+}
+
+static void sharded_add(lock_node_t *node) {
+	counter_slots[node->id].count = counter_slots[node->id].count + 1;
+}
+
+static long sharded_read(void) {
+	long sum = 0;
+	for (int i = 0; i < n_threads; i++)
+		sum += counter_slots[i].count;
+	return sum;
+}
+
+/*
+ * combining counter: COMBINE_FANOUT threads share a first-level counter (in
+ * counter_slots), and whichever increment completes a batch there carries
+ * it up to the root, so the root line sees one atomic per COUNTER_BATCH
+ */
+
+static int combine_root;
+
+static void combining_init(void) {
+	sharded_init();
+	combine_root = 0;
+}
+
+static void combining_add(lock_node_t *node) {
+	counter_slot_t *leaf = &counter_slots[node->id / COMBINE_FANOUT];
+	if ((atomic_increment((int *) &leaf->count, 1) + 1) % COUNTER_BATCH == 0)
+		atomic_increment(&combine_root, COUNTER_BATCH);
+}
+
+static long combining_read(void) {
+	long sum = *(volatile int *) &combine_root;
+	for (int i = 0; i < n_threads; i += COMBINE_FANOUT)
+		sum += counter_slots[i / COMBINE_FANOUT].count % COUNTER_BATCH;
+	return sum;
+}
+
+/*
+ * batched counter: each thread counts privately and adds COUNTER_BATCH at a
+ * time to the shared count, which readers see up to n_threads batches late
+ */
 
-void *do_semaphore(void *arg) {
+static void batched_add(lock_node_t *node) {
+	if (++node->batch == COUNTER_BATCH) {
+		atomic_increment(&n, COUNTER_BATCH);
+		node->batch = 0;
+	}
+}
+
+static void batched_flush(lock_node_t *node) {
+	atomic_increment(&n, node->batch);
+	node->batch = 0;
+}
+
+/** @brief Every mode; counters (atomic first) have no lock */
+static const lock_t locks[] = {
+	{ .name = "atomic", .description = "atomic_increment [DEFAULT]",
+	  .add = atomic_add, .read = atomic_read },
+	{ "sem", "POSIX semaphore", sem_lock_init, sem_lock_acquire,
+	  sem_lock_release },
+	{ "ttas", "Test-and-test-and-set with exponential backoff", ttas_init,
+	  ttas_acquire, ttas_release },
+	{ "ticket", "Ticket lock", ticket_init, ticket_acquire,
+	  ticket_release },
+	{ "mcs", "MCS queue lock", mcs_init, mcs_acquire, mcs_release },
+	{ "clh", "CLH queue lock", clh_init, clh_acquire, clh_release },
+	{ "spin", "pthread_spinlock", spin_init, spin_acquire, spin_release },
+	{ "mutex", "pthread_mutex", NULL, mutex_acquire, mutex_release },
+	{ "futex", "Futex mutex", futex_init, futex_acquire, futex_release },
+	{ "rwlock", "pthread_rwlock", NULL, rwlock_acquire, rwlock_release,
+	  rwlock_read_acquire, rwlock_read_release },
+	{ "seqlock", "Seqlock", seqlock_init, seqlock_acquire, seqlock_release,
+	  seqlock_read_acquire, seqlock_read_release },
+	{ "brlock", "Big-reader lock", br_init, br_acquire, br_release,
+	  br_read_acquire, br_read_release },
+	{ .name = "sharded", .description = "Sharded counter (padded slot per "
+	  "thread)", .init = sharded_init, .add = sharded_add,
+	  .read = sharded_read },
+	{ .name = "combining", .description = "Combining counter (two levels)",
+	  .init = combining_init, .add = combining_add, .read = combining_read },
+	{ .name = "batched", .description = "Batched counter (local, then "
+	  "flushed)", .add = batched_add, .read = atomic_read,
+	  .flush = batched_flush },
+};
+
+#define N_LOCKS ((int) (sizeof(locks) / sizeof(locks[0])))
+
+/**
+ * @brief Opens a counter group for the calling worker thread.
+ *
+ * @param g The group to open (left unopened if counters are disabled).
+ */
+static void counters_start(perf_group_t *g) {
+	g->leader = -1;
+	if (use_counters)
+		perf_group_open(g, 0, -1);
+}
+
+/**
+ * @brief Adds the counts of a worker thread to its running totals.
+ *
+ * @param g The group opened by counters_start.
+ * @param id The worker's index.
+ */
+static void counters_stop(perf_group_t *g, int id) {
+	perf_counts_t c;
+	if (!use_counters)
+		return;
+	perf_group_read(g, &c);
+	perf_group_close(g);
+	perf_counts_add(&thread_counts[id], &c);
+}
+
+
+/**
+ * @brief Decides whether the next operation of a thread is a read.
+ *
+ * @param rng The thread's xorshift state, updated.
+ *
+ * @return Non-zero for a read, with probability read_ratio.
+ */
+static inline int next_is_read(uint32_t *rng) {
+	*rng ^= *rng << 13;
+	*rng ^= *rng >> 17;
+	*rng ^= *rng << 5;
+	return *rng < read_ratio * 4294967296.0;
+}
+
+/**
+ * @brief Timestamps the start of an acquisition if latencies are recorded.
+ *
+ * @return The TSC, or zero.
+ */
+static inline uint64_t wait_start(void) {
+	return use_latency ? tsc_start() : 0;
+}
+
+/**
+ * @brief Records the wait of an acquisition in the thread's histogram.
+ *
+ * @param args The thread's arguments.
+ * @param t0 The timestamp of wait_start.
+ *
+ * @return void
+ */
+static inline void wait_stop(args_t *args, uint64_t t0) {
+	if (use_latency)
+		hist_record(&thread_hists[args->id], tsc_stop() - t0);
+}
+
+/**
+ * @brief Ends the operations of a thread, and with --latency those of every
+ * thread: counting operations over a common interval shows starvation,
+ * which a fixed share per thread would hide.
+ *
+ * @param args The thread's arguments.
+ * @param i The number of operations it did.
+ *
+ * @return void
+ */
+static void finish_ops(args_t *args, int i) {
+	args->n_ops = i;
+	if (use_latency) {
+		stop_run = 1;
+		thread_ops[args->id] += i;
+	}
+}
+
+/**
+ * @brief Works outside the lock between two operations.
+ *
+ * @return void
+ */
+static inline void think(void) {
+	volatile int x = 0;
+	for (int i = 0; i < think_work; i++)
+		x++;
+}
+
+void *do_lock(void *arg) {
 	args_t *args = arg;
-	for (int i = 0; i < args->n_iters; i++) {
-		sem_wait(args->sem);
-		(*args->n)++;
-		sem_post(args->sem);
+	perf_group_t g;
+	uint32_t rng = 2463534242u + args->id;
+	int i;
+#ifdef BENCH_RUNNER
+	bench_worker();
+#endif
+	counters_start(&g);
+	pthread_barrier_wait(&start_line);
+	for (i = 0; i < args->n_iters && !stop_run; i++) {
+		if (next_is_read(&rng)) {
+			long sum;
+			do {
+				uint64_t t0 = wait_start();
+				if (lock->read_acquire != NULL)
+					lock->read_acquire(&args->node);
+				else
+					lock->acquire(&args->node);
+				wait_stop(args, t0);
+				sum = *args->n;
+				for (int w = 0; w < cs_work; w++)
+					sum += shared[w % SHARED_WORDS];
+				if (lock->read_release == NULL) {
+					lock->release(&args->node);
+					break;
+				}
+			} while (lock->read_release(&args->node));
+			read_sink = sum;
+		} else {
+			uint64_t t0 = wait_start();
+			lock->acquire(&args->node);
+			wait_stop(args, t0);
+			(*args->n)++;
+			for (int w = 1; w < cs_work; w++)
+				shared[w % SHARED_WORDS]++;
+			lock->release(&args->node);
+			args->n_writes++;
+		}
+		think();
 	}
+	finish_ops(args, i);
+	counters_stop(&g, args->id);
+	return NULL;
 }
 
-void *do_atomic(void *arg) {
+void *do_counter(void *arg) {
 	args_t *args = arg;
-    for (int i = 0; i < args->n_iters; i++) {
-		atomic_increment(args->n, 1);
+	perf_group_t g;
+	uint32_t rng = 2463534242u + args->id;
+	int i;
+#ifdef BENCH_RUNNER
+	bench_worker();
+#endif
+	counters_start(&g);
+	pthread_barrier_wait(&start_line);
+    for (i = 0; i < args->n_iters && !stop_run; i++) {
+		if (next_is_read(&rng)) {
+			long sum = lock->read();
+			for (int w = 0; w < cs_work; w++)
+				sum += shared[w % SHARED_WORDS];
+			read_sink = sum;
+		} else {
+			uint64_t t0 = wait_start();
+			lock->add(&args->node);
+			wait_stop(args, t0);
+			for (int w = 1; w < cs_work; w++)
+				atomic_increment((int *) &shared[w % SHARED_WORDS], 1);
+			args->n_writes++;
+		}
+		think();
 	}
+	if (lock->flush != NULL)
+		lock->flush(&args->node);
+	finish_ops(args, i);
+	counters_stop(&g, args->id);
+	return NULL;
 }
 
 void do_test(void) {
-	args_t args  = { .n = &n, .n_iters = n_increments, .sem = &sem };
+	args_t args[n_threads];
+	struct timespec start, end;
     n = 0;
+	n_writes = 0;
+	n_ops = 0;
+	stop_run = 0;
+	if (lock->init != NULL)
+		lock->init();
 	for (int i = 0; i < n_threads; i++) {
-		pthread_create(&threads[i], NULL, incr_func, &args);
+		args[i] = (args_t) { .n = &n, .n_iters = n_increments, .id = i };
+		args[i].node.clh = &clh_nodes[i];
+		args[i].node.id = i;
+		pthread_create(&threads[i], NULL,
+		               lock->add != NULL ? do_counter : do_lock, &args[i]);
 	}
 
+	/* the first to finish must not have had a head start on the others */
+	pthread_barrier_wait(&start_line);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	for (int i = 0; i < n_threads; i++) {
 		pthread_join(threads[i], NULL);
+		n_writes += args[i].n_writes;
+		n_ops += args[i].n_ops;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ops_total += n_ops;
+	seconds_total += (end.tv_sec - start.tv_sec) +
+	                 (end.tv_nsec - start.tv_nsec) * 1e-9;
+	if (lock->read != NULL)
+		n = lock->read();
+	test_runs++;
+}
+
+/**
+ * @brief Allocates the per-thread state of a run of one lock.
+ *
+ * @param l The lock to test.
+ * @param threads_wanted The number of threads contending for it.
+ *
+ * @return void
+ */
+static void test_setup(const lock_t *l, int threads_wanted) {
+	lock = l;
+	n_threads = threads_wanted;
+	n_increments = (1 << 20) / n_threads;
+	threads = malloc(n_threads * sizeof(pthread_t));
+	thread_counts = calloc(n_threads, sizeof(perf_counts_t));
+	clh_nodes = aligned_alloc(64, (n_threads + 1) * sizeof(clh_node_t));
+	br_slots = aligned_alloc(64, n_threads * sizeof(br_slot_t));
+	counter_slots = aligned_alloc(64, n_threads * sizeof(counter_slot_t));
+	thread_hists = aligned_alloc(64, n_threads * sizeof(hist_t));
+	memset(thread_hists, 0, n_threads * sizeof(hist_t));
+	thread_ops = calloc(n_threads, sizeof(long));
+	test_runs = 0;
+	ops_total = 0;
+	seconds_total = 0;
+	pthread_barrier_init(&start_line, NULL, n_threads + 1);
+	spin_yield = n_threads > sysconf(_SC_NPROCESSORS_ONLN) ? 1 : SPIN_YIELD;
+	sem_init(&sem, 0, 1);
+}
+
+/**
+ * @brief Frees the state of test_setup.
+ *
+ * @return void
+ */
+static void test_teardown(void) {
+	sem_destroy(&sem);
+	pthread_barrier_destroy(&start_line);
+	free(threads);
+	free(thread_counts);
+	free(clh_nodes);
+	free(br_slots);
+	free(counter_slots);
+	free(thread_hists);
+	free(thread_ops);
+}
+
+/**
+ * @brief Computes Jain's fairness index, from 1/n when one thread did all
+ * the work to 1 when every thread did the same.
+ *
+ * @param x The work of each thread.
+ * @param count The number of threads.
+ *
+ * @return The index.
+ */
+static double jain_index(const long *x, int count) {
+	double sum = 0, sum_sq = 0;
+	for (int i = 0; i < count; i++) {
+		sum += x[i];
+		sum_sq += (double) x[i] * x[i];
 	}
+	return sum_sq > 0 ? sum * sum / (count * sum_sq) : 1;
+}
+
+/**
+ * @brief Prints the acquire latencies of every thread together, and the
+ * operations of each thread.
+ *
+ * @param out The stream to print to.
+ *
+ * @return void
+ */
+static void print_latency(FILE *out) {
+	hist_t *all = aligned_alloc(64, sizeof(hist_t));
+	hist_reset(all);
+	for (int i = 0; i < n_threads; i++)
+		hist_merge(all, &thread_hists[i]);
+	fprintf(out, "  acquire wait in cycles: ");
+	hist_print(out, all, 1 / tsc_ghz);
+	fprintf(out, "  operations per thread (per run):");
+	for (int i = 0; i < n_threads; i++)
+		fprintf(out, " %ld", thread_ops[i] / test_runs);
+	fprintf(out, "; Jain's fairness index = %.4lf\n",
+	       jain_index(thread_ops, n_threads));
+	free(all);
 }
 
 /**
@@ -64,26 +848,158 @@ void do_test(void) {
 void print_usage(char *argv[]) {
 	fprintf(stderr, "Usage: %s <n_threads>\n", argv[0]);
 	fprintf(stderr, "Optional Arguments:\n");
-	fprintf(stderr, "\t--sem    Use a semaphore\n");
-	fprintf(stderr, "\t--atomic Use atomic_increment [DEFAULT]\n");
+	for (int i = 0; i < N_LOCKS; i++)
+		fprintf(stderr, "\t--%-8s %s\n", locks[i].name, locks[i].description);
+	fprintf(stderr, "\t--all     Test every mode in turn (or give several)\n");
+	fprintf(stderr, "\t--sweep   Test 1, 2, 4, ... up to n_threads threads\n");
+	fprintf(stderr, "\t--cs=N    Words of shared data each operation "
+	        "touches [1]\n");
+	fprintf(stderr, "\t--think=N Loop iterations between operations [0]\n");
+	fprintf(stderr, "\t--read=F  Fraction of read-only operations [0]\n");
+	fprintf(stderr, "\t--surface Print the throughput over think time x "
+	        "thread count\n");
+	fprintf(stderr, "\t--counters Report hardware counters per thread\n");
+	fprintf(stderr, "\t--latency Report acquire-wait percentiles and the "
+	        "fairness of\n\t          runs that stop with the first thread "
+	        "to finish\n");
+	fprintf(stderr, "\t--tsc    Also time single uncontended operations\n");
 }
 
 /**
- * @brief Gets the mode to use for this test run.
+ * @brief Gets the modes to use for this test run.
  *
  * @param argc The number of command line arguments.
  * @param argv Vector of command line arguments.
+ * @param selected Set to non-zero for every mode to test, in locks order
+ * (atomic if none was given, all of them with --all).
  *
- * @return The mode to use for this test (atomic/semaphore).
+ * @return void
  */
-int get_mode(int argc, char *argv[]) {
+void get_modes(int argc, char *argv[], int *selected) {
+	int any = 0;
+	for (int l = 0; l < N_LOCKS; l++)
+		selected[l] = 0;
 	for(int i = 0; i < argc; i++) {
 		char *s = argv[i];
-		if (strcmp(s, "--sem") == 0)
-			return MODE_SEMAPHORE;
+		for (int l = 0; l < N_LOCKS; l++) {
+			if (strcmp(s, "--all") == 0 ||
+			    (strncmp(s, "--", 2) == 0 && strcmp(s + 2, locks[l].name) == 0))
+				selected[l] = any = 1;
+		}
+	}
+
+	if (!any)
+		selected[0] = 1;
+}
+
+#define SINGLE_OP_SAMPLES 10000
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Times single uncontended operations with the TSC and prints the
+ * minimum and median of many samples, net of the timer's own overhead.
+ *
+ * @param node The calling thread's state.
+ * @param name The name of the operation.
+ * @param read Whether to time a read rather than a write (or acquire and
+ * release).
+ *
+ * @return void
+ */
+static void time_single_op(lock_node_t *node, const char *name, int read) {
+	static uint64_t samples[SINGLE_OP_SAMPLES];
+	for (int i = 0; i < SINGLE_OP_SAMPLES; i++) {
+		uint64_t t0 = tsc_start();
+		if (read) {
+			read_sink = lock->read();
+		} else if (lock->add != NULL) {
+			lock->add(node);
+		} else {
+			lock->acquire(node);
+			lock->release(node);
+		}
+		uint64_t t1 = tsc_stop();
+		samples[i] = t1 - t0 > tsc_overhead ? t1 - t0 - tsc_overhead : 0;
+	}
+	qsort(samples, SINGLE_OP_SAMPLES, sizeof(uint64_t), compare_u64);
+	printf("Single %s: min = %lu cycles (%.1lfns), "
+	       "median = %lu cycles (%.1lfns)\n", name,
+	       samples[0], tsc_to_ns(samples[0]),
+	       samples[SINGLE_OP_SAMPLES / 2],
+	       tsc_to_ns(samples[SINGLE_OP_SAMPLES / 2]));
+}
+
+/**
+ * @brief Times single uncontended operations of every selected mode, and
+ * the reads of the counters: their cost can grow with the thread count.
+ *
+ * @param selected The modes to time, as set by get_modes.
+ * @param threads_wanted The threads to size the per-thread state for.
+ *
+ * @return void
+ */
+void time_single_ops(const int *selected, int threads_wanted) {
+	if (tsc_init() < 0)
+		fprintf(stderr, "Warning: the TSC is not invariant.\n");
+	printf("Single operations, with state for %d thread(s):\n",
+	       threads_wanted);
+
+	for (int op = 0; op < N_LOCKS; op++) {
+		lock_node_t node = { 0 };
+		char name[64];
+		if (!selected[op])
+			continue;
+		test_setup(&locks[op], threads_wanted);
+		node.clh = &clh_nodes[0];
+		if (lock->init != NULL)
+			lock->init();
+		time_single_op(&node, lock->name, 0);
+		if (lock->read != NULL) {
+			snprintf(name, sizeof(name), "%s read", lock->name);
+			time_single_op(&node, name, 1);
+		}
+		if (lock->flush != NULL)
+			lock->flush(&node);
+		test_teardown();
+	}
+}
+
+/**
+ * @brief Gets the value of a "--name=value" option.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv Vector of command line arguments.
+ * @param prefix The option up to and including the '='.
+ *
+ * @return The value, or NULL if the option is absent.
+ */
+const char *get_option(int argc, char *argv[], const char *prefix) {
+	for (int i = 0; i < argc; i++) {
+		if (strncmp(argv[i], prefix, strlen(prefix)) == 0)
+			return argv[i] + strlen(prefix);
 	}
+	return NULL;
+}
 
-	return MODE_ATOMIC;
+/**
+ * @brief Checks whether a flag was passed on the command line.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv Vector of command line arguments.
+ * @param flag The flag to look for.
+ *
+ * @return Non-zero if the flag is present.
+ */
+int has_flag(int argc, char *argv[], const char *flag) {
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], flag) == 0)
+			return 1;
+	}
+	return 0;
 }
 
 inline int *get_index(int *addr, int cols, int r, int c) {
@@ -94,6 +1010,98 @@ void print_2d_array(int *addr, int rows, int cols) {
 
 }
 
+#ifdef BENCH_RUNNER
+/**
+ * @brief Times do_test for the lock and shape given by the runner.
+ *
+ * @param ctx The runner's context.
+ *
+ * @return void
+ */
+static void bench_mode(bench_ctx_t *ctx) {
+	const char *name = bench_param(ctx, "lock", "atomic");
+	int l, threads_wanted = bench_param_long(ctx, "threads", 1);
+	cs_work = bench_param_long(ctx, "cs", 1);
+	think_work = bench_param_long(ctx, "think", 0);
+	read_ratio = atof(bench_param(ctx, "read", "0"));
+	use_latency = bench_param_long(ctx, "latency", 0);
+	if (use_latency && tsc_ghz == 0 && tsc_init() < 0)
+		fprintf(stderr, "Warning: the TSC is not invariant.\n");
+	for (l = 0; l < N_LOCKS && strcmp(name, locks[l].name) != 0; l++)
+		continue;
+	if (l == N_LOCKS || threads_wanted < 1 || threads_wanted > MAX_THREADS) {
+		fprintf(stderr, "lock: invalid lock or thread count.\n");
+		return;
+	}
+
+	test_setup(&locks[l], threads_wanted);
+	bench_time(ctx, "time", do_test);
+	/* the report is no CSV or JSON record: it goes along with the progress */
+	if (use_latency)
+		print_latency(stderr);
+	assert(n == n_writes);
+	test_teardown();
+}
+
+BENCH(bench_lock, "lock/increment",
+      "lock=atomic|sem|ttas|ticket|mcs|clh|spin|mutex|futex|rwlock|seqlock|brlock"
+      " threads=1|2|4|8 cs=1 think=0 read=0 latency=0") {
+	bench_mode(ctx);
+}
+
+BENCH(bench_counter, "lock/counter",
+      "lock=atomic|sem|sharded|combining|batched threads=1|2|4|8 cs=1 think=0"
+      " read=0|0.1 latency=0") {
+	bench_mode(ctx);
+}
+#else
+/**
+ * @brief Steps a thread count sweep: powers of two, ending at the maximum.
+ *
+ * @param t The current thread count.
+ * @param max_threads The last thread count of the sweep.
+ *
+ * @return The next thread count, above max_threads at the end.
+ */
+static int next_threads(int t, int max_threads) {
+	return (t < max_threads && 2 * t > max_threads) ? max_threads : 2 * t;
+}
+
+/**
+ * @brief Times one lock at one thread count and logs the result.
+ *
+ * @param l The lock to test.
+ * @param threads_wanted The number of threads contending for it.
+ * @param verbose Whether to print the result (and counters).
+ *
+ * @return The throughput, in millions of operations per second.
+ */
+double run_test(const lock_t *l, int threads_wanted, int verbose) {
+	func_stats_t stats;
+	test_setup(l, threads_wanted);
+
+	double time = func_time_stats(do_test, 0.001, FUNC_TRIALS, &stats);
+	/* runs stopped by --latency vary in length: rate them all together */
+	double mops = ops_total / seconds_total / 1e6;
+	if (verbose) {
+		printf("Using %s with %d thread(s): time = %lfs (%.2lf Mops/s)\n",
+		       lock->description, n_threads, time, mops);
+		printf("  ");
+		func_stats_print(stdout, &stats, 1, "s");
+		if (use_latency)
+			print_latency(stdout);
+	}
+
+	for (int i = 0; verbose && use_counters && i < n_threads; i++) {
+		char label[32];
+		snprintf(label, sizeof(label), "  thread %d (per run)", i);
+		perf_counts_print(stdout, label, &thread_counts[i], 1.0 / test_runs);
+	}
+	assert(n == n_writes);
+	test_teardown();
+	return mops;
+}
+
 /**
  * @brief Parses the command line arguments, runs the test using the
  * specified parameters, and logs the results.
@@ -104,30 +1112,72 @@ void print_2d_array(int *addr, int rows, int cols) {
  * @return Zero on success or negative error code on failure.s
  */
 int main(int argc, char *argv[]) {
-	int mode;
+	int selected[N_LOCKS], max_threads, sweep, surface;
+	const char *value;
+	const int think_levels[] = THINK_LEVELS;
+	const int n_levels = sizeof(think_levels) / sizeof(think_levels[0]);
 
 	if (argc < 2) {
 		print_usage(argv);
 		exit(-1);
 	}
 
-	n_threads = atoi(argv[1]);
-	n_increments = (1 << 20) / n_threads;
-	mode = get_mode(argc, argv);
-	incr_func = (mode == MODE_SEMAPHORE) ? do_semaphore : do_atomic;
+	max_threads = atoi(argv[1]);
+	if (max_threads < 1 || max_threads > MAX_THREADS) {
+		print_usage(argv);
+		exit(-1);
+	}
+	get_modes(argc, argv, selected);
+	surface = has_flag(argc, argv, "--surface");
+	sweep = surface || has_flag(argc, argv, "--sweep");
+	if ((value = get_option(argc, argv, "--cs=")) != NULL)
+		cs_work = atoi(value);
+	if ((value = get_option(argc, argv, "--think=")) != NULL)
+		think_work = atoi(value);
+	if ((value = get_option(argc, argv, "--read=")) != NULL)
+		read_ratio = atof(value);
 
-	sem_init(&sem, 0, 1);
-	threads = malloc(n_threads * sizeof(pthread_t));
+	use_counters = has_flag(argc, argv, "--counters");
+	use_latency = has_flag(argc, argv, "--latency");
+	if (use_latency && tsc_init() < 0)
+		fprintf(stderr, "Warning: the TSC is not invariant.\n");
 
-	double time = func_time(do_test, 0.001);
-    printf("Using %s with %d thread(s): time = %lfs\n",
-            mode == MODE_SEMAPHORE ? "semaphore" : "atomic operations",
-            n_threads, time);
+	env_t env;
+	env_capture(&env);
+	env_print(stdout, &env);
+	printf("# cs=%d think=%d read=%.2lf\n", cs_work, think_work, read_ratio);
 
-	sem_destroy(&sem);
-	free(threads);
+	for (int l = 0; l < N_LOCKS; l++) {
+		if (!selected[l])
+			continue;
+		if (surface) {
+			printf("%s, Mops/s\n%-14s", locks[l].description,
+			       "think\\threads");
+			for (int t = 1; t <= max_threads; t = next_threads(t, max_threads))
+				printf(" %8d", t);
+			printf("\n");
+		}
+		for (int k = 0; k < (surface ? n_levels : 1); k++) {
+			if (surface) {
+				think_work = think_levels[k];
+				printf("%-14d", think_work);
+			}
+			for (int t = sweep ? 1 : max_threads; t <= max_threads;
+			     t = next_threads(t, max_threads)) {
+				double mops = run_test(&locks[l], t, !surface);
+				if (surface) {
+					printf(" %8.2lf", mops);
+					fflush(stdout);
+				}
+			}
+			if (surface)
+				printf("\n");
+		}
+	}
 
-	assert(n == n_threads * n_increments);
+	if (has_flag(argc, argv, "--tsc"))
+		time_single_ops(selected, max_threads);
 
 	return 0;
 }
+#endif /* BENCH_RUNNER */
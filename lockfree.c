@@ -0,0 +1,193 @@
+/**
+ * @file lockfree.c
+ * @brief Bounded MPMC and SPSC rings and an ABA-safe Treiber stack
+ **/
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "atomic.h"
+#include "lockfree.h"
+
+/* keeps the compiler from moving memory accesses across it */
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+/* allocate a ring of a power of two of elements, on its own cache lines */
+static void *alloc_ring(long capacity, size_t size)
+{
+    void *p;
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (posix_memalign(&p, 64, capacity * size) != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return p;
+}
+
+int mpmc_init(mpmc_ring_t *r, long capacity)
+{
+    memset(r, 0, sizeof(*r));
+    r->cells = alloc_ring(capacity, sizeof(mpmc_cell_t));
+    if (r->cells == NULL)
+        return -1;
+    r->mask = capacity - 1;
+    for (long i = 0; i < capacity; i++)
+        r->cells[i].seq = i;
+    return 0;
+}
+
+void mpmc_destroy(mpmc_ring_t *r)
+{
+    free(r->cells);
+    r->cells = NULL;
+}
+
+/*
+ * a cell is free for the enqueue at position pos when its sequence number
+ * is pos, and full for the dequeue at pos when it is pos + 1
+ */
+int mpmc_push(mpmc_ring_t *r, long value)
+{
+    long pos = r->enqueue;
+    mpmc_cell_t *cell;
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        long diff = cell->seq - pos;
+        if (diff == 0) {
+            long seen = atomic_cas64((long *) &r->enqueue, pos, pos + 1);
+            if (seen == pos)
+                break;
+            pos = seen;
+        } else if (diff < 0) {
+            return -1;          /* the cell still holds a lap-old value */
+        } else {
+            pos = r->enqueue;   /* another producer took it */
+        }
+    }
+    cell->value = value;
+    barrier();
+    cell->seq = pos + 1;
+    return 0;
+}
+
+int mpmc_pop(mpmc_ring_t *r, long *value)
+{
+    long pos = r->dequeue;
+    mpmc_cell_t *cell;
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        long diff = cell->seq - (pos + 1);
+        if (diff == 0) {
+            long seen = atomic_cas64((long *) &r->dequeue, pos, pos + 1);
+            if (seen == pos)
+                break;
+            pos = seen;
+        } else if (diff < 0) {
+            return -1;          /* not filled yet */
+        } else {
+            pos = r->dequeue;
+        }
+    }
+    *value = cell->value;
+    barrier();
+    cell->seq = pos + r->mask + 1;  /* free for the next lap */
+    return 0;
+}
+
+int spsc_init(spsc_ring_t *r, long capacity)
+{
+    memset(r, 0, sizeof(*r));
+    r->values = alloc_ring(capacity, sizeof(long));
+    if (r->values == NULL)
+        return -1;
+    r->mask = capacity - 1;
+    return 0;
+}
+
+void spsc_destroy(spsc_ring_t *r)
+{
+    free(r->values);
+    r->values = NULL;
+}
+
+int spsc_push(spsc_ring_t *r, long value)
+{
+    return spsc_push_n(r, &value, 1) == 1 ? 0 : -1;
+}
+
+int spsc_pop(spsc_ring_t *r, long *value)
+{
+    return spsc_pop_n(r, value, 1) == 1 ? 0 : -1;
+}
+
+int spsc_push_n(spsc_ring_t *r, const long *values, int n)
+{
+    long tail = r->tail;
+    long room = r->mask + 1 - (tail - r->head_cache);
+    if (room < n) {
+        r->head_cache = r->head;
+        room = r->mask + 1 - (tail - r->head_cache);
+    }
+    if (n > room)
+        n = room;
+    for (int i = 0; i < n; i++)
+        r->values[(tail + i) & r->mask] = values[i];
+    barrier();
+    r->tail = tail + n;
+    return n;
+}
+
+int spsc_pop_n(spsc_ring_t *r, long *values, int n)
+{
+    long head = r->head;
+    long avail = r->tail_cache - head;
+    if (avail < n) {
+        r->tail_cache = r->tail;
+        avail = r->tail_cache - head;
+    }
+    if (n > avail)
+        n = avail;
+    for (int i = 0; i < n; i++)
+        values[i] = r->values[(head + i) & r->mask];
+    barrier();
+    r->head = head + n;
+    return n;
+}
+
+void treiber_init(treiber_stack_t *s)
+{
+    s->top[0] = 0;
+    s->top[1] = 0;
+}
+
+void treiber_push(treiber_stack_t *s, treiber_node_t *node)
+{
+    treiber_push_chain(s, node, node);
+}
+
+/*
+ * The two words of the top are read separately and may not match; then the
+ * compare-and-swap fails and hands back the real pair.
+ */
+void treiber_push_chain(treiber_stack_t *s, treiber_node_t *first,
+                        treiber_node_t *last)
+{
+    uint64_t top[2] = { s->top[0], s->top[1] };
+    do {
+        last->next = (treiber_node_t *) top[0];
+    } while (!atomic_cas128(s->top, top, (uint64_t) first, top[1] + 1));
+}
+
+treiber_node_t *treiber_pop(treiber_stack_t *s)
+{
+    uint64_t top[2] = { s->top[0], s->top[1] };
+    treiber_node_t *node;
+    do {
+        node = (treiber_node_t *) top[0];
+        if (node == NULL)
+            return NULL;
+    } while (!atomic_cas128(s->top, top, (uint64_t) node->next, top[1] + 1));
+    return node;
+}
@@ -0,0 +1,85 @@
+/**
+ * @file lockfree.h
+ * @brief Lock-free queues and stacks built on the primitives of atomic.h
+ *
+ * All three are safe without locks on x86, whose stores are not reordered
+ * with older stores nor loads with older loads; the code only keeps the
+ * compiler from reordering. Values are longs; the rings hold a power of
+ * two of them.
+ **/
+
+#ifndef LOCKFREE_H
+#define LOCKFREE_H
+
+#include <stdint.h>
+
+/*
+ * Bounded multi-producer multi-consumer ring (Vyukov): each cell carries a
+ * sequence number saying whether it is free for the enqueue at its
+ * position or full for the dequeue, so a single compare-and-swap of the
+ * head or the tail claims it.
+ */
+typedef struct {
+    volatile long seq;
+    long value;
+} mpmc_cell_t;
+
+typedef struct {
+    mpmc_cell_t *cells;
+    long mask;
+    volatile long enqueue __attribute__((aligned(64)));  /* next to fill */
+    volatile long dequeue __attribute__((aligned(64)));  /* next to empty */
+} __attribute__((aligned(64))) mpmc_ring_t;
+
+int mpmc_init(mpmc_ring_t *r, long capacity);
+void mpmc_destroy(mpmc_ring_t *r);
+int mpmc_push(mpmc_ring_t *r, long value);     /* -1 if full */
+int mpmc_pop(mpmc_ring_t *r, long *value);     /* -1 if empty */
+
+/*
+ * Single-producer single-consumer ring. Each side keeps a copy of the
+ * other's index and only rereads it (a cache miss) when the copy says the
+ * ring is full or empty; the batch calls publish their index once.
+ */
+typedef struct {
+    long *values;
+    long mask;
+    /* written by the producer */
+    volatile long tail __attribute__((aligned(64)));
+    long head_cache;
+    /* written by the consumer */
+    volatile long head __attribute__((aligned(64)));
+    long tail_cache;
+} __attribute__((aligned(64))) spsc_ring_t;
+
+int spsc_init(spsc_ring_t *r, long capacity);
+void spsc_destroy(spsc_ring_t *r);
+int spsc_push(spsc_ring_t *r, long value);     /* -1 if full */
+int spsc_pop(spsc_ring_t *r, long *value);     /* -1 if empty */
+int spsc_push_n(spsc_ring_t *r, const long *values, int n);  /* # pushed */
+int spsc_pop_n(spsc_ring_t *r, long *values, int n);         /* # popped */
+
+/*
+ * Treiber stack. The top pointer is paired with a tag bumped by every
+ * change, so a pop that read a node which was popped and pushed back in
+ * between fails its compare-and-swap instead of corrupting the stack (the
+ * ABA problem). Nodes belong to the caller and must stay mapped while the
+ * stack is in use, since a racing pop may still read their next field.
+ */
+typedef struct treiber_node {
+    struct treiber_node *next;
+    long value;
+} treiber_node_t;
+
+typedef struct {
+    uint64_t top[2];        /* the top node and its tag, for cmpxchg16b */
+} __attribute__((aligned(64))) treiber_stack_t;
+
+void treiber_init(treiber_stack_t *s);
+void treiber_push(treiber_stack_t *s, treiber_node_t *node);
+/* push the nodes first..last, already linked through next, at once */
+void treiber_push_chain(treiber_stack_t *s, treiber_node_t *first,
+                        treiber_node_t *last);
+treiber_node_t *treiber_pop(treiber_stack_t *s);   /* NULL if empty */
+
+#endif /* LOCKFREE_H */
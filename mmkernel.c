@@ -0,0 +1,456 @@
+/**
+ * @file mmkernel.c
+ * @brief Scalar, SSE4.1, AVX2/FMA and AVX-512 micro-kernels and their
+ * runtime dispatch
+ *
+ * Each instruction set's kernels are compiled for it with a target pragma,
+ * so the file builds without -m flags and runs anywhere; mm_kernel_select
+ * only hands out the ones CPUID says the CPU can execute.
+ **/
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <immintrin.h>
+#include "mmkernel.h"
+
+/* cache sizes when sysconf does not know them */
+#define DEFAULT_L1 (32 << 10)
+#define DEFAULT_L2 (1 << 20)
+#define DEFAULT_L3 (8 << 20)
+/* largest mc, kc and nc, which bound the workspace */
+#define MAX_MC 1024
+#define MAX_KC 512
+#define MAX_NC 4096
+
+/* scalar: the fallback, and the edges of every other kernel */
+
+#define NAME scalar_i32
+#define EDGE_NAME edge_i32
+#define ELEM int32_t
+#define VEC int32_t
+#define VLEN 1
+#define MR 4
+#define NV 4
+#define VZERO() 0
+#define VLOADU(p) (*(p))
+#define VSTOREU(p, v) (*(p) = (v))
+#define VBCAST(x) (x)
+#define VADD(a, b) ((a) + (b))
+#define VMADD(acc, a, b) ((acc) + (a) * (b))
+#include "mmkernel_tmpl.h"
+
+#define NAME scalar_f32
+#define EDGE_NAME edge_f32
+#define ELEM float
+#define VEC float
+#define VLEN 1
+#define MR 4
+#define NV 4
+#define VZERO() 0
+#define VLOADU(p) (*(p))
+#define VSTOREU(p, v) (*(p) = (v))
+#define VBCAST(x) (x)
+#define VADD(a, b) ((a) + (b))
+#define VMADD(acc, a, b) ((acc) + (a) * (b))
+#include "mmkernel_tmpl.h"
+
+#define NAME scalar_f64
+#define EDGE_NAME edge_f64
+#define ELEM double
+#define VEC double
+#define VLEN 1
+#define MR 4
+#define NV 4
+#define VZERO() 0
+#define VLOADU(p) (*(p))
+#define VSTOREU(p, v) (*(p) = (v))
+#define VBCAST(x) (x)
+#define VADD(a, b) ((a) + (b))
+#define VMADD(acc, a, b) ((acc) + (a) * (b))
+#include "mmkernel_tmpl.h"
+
+/* SSE4.1, for pmulld: 4 x 8 (4 x 4 double) tiles in 8 of 16 registers */
+
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+
+#define NAME sse4_i32
+#define ELEM int32_t
+#define VEC __m128i
+#define VLEN 4
+#define MR 4
+#define NV 2
+#define VZERO() _mm_setzero_si128()
+#define VLOADU(p) _mm_loadu_si128((const __m128i *) (p))
+#define VSTOREU(p, v) _mm_storeu_si128((__m128i *) (p), (v))
+#define VBCAST(x) _mm_set1_epi32(x)
+#define VADD(a, b) _mm_add_epi32((a), (b))
+#define VMADD(acc, a, b) _mm_add_epi32((acc), _mm_mullo_epi32((a), (b)))
+#include "mmkernel_tmpl.h"
+
+#define NAME sse4_f32
+#define ELEM float
+#define VEC __m128
+#define VLEN 4
+#define MR 4
+#define NV 2
+#define VZERO() _mm_setzero_ps()
+#define VLOADU(p) _mm_loadu_ps(p)
+#define VSTOREU(p, v) _mm_storeu_ps((p), (v))
+#define VBCAST(x) _mm_set1_ps(x)
+#define VADD(a, b) _mm_add_ps((a), (b))
+#define VMADD(acc, a, b) _mm_add_ps((acc), _mm_mul_ps((a), (b)))
+#include "mmkernel_tmpl.h"
+
+#define NAME sse4_f64
+#define ELEM double
+#define VEC __m128d
+#define VLEN 2
+#define MR 4
+#define NV 2
+#define VZERO() _mm_setzero_pd()
+#define VLOADU(p) _mm_loadu_pd(p)
+#define VSTOREU(p, v) _mm_storeu_pd((p), (v))
+#define VBCAST(x) _mm_set1_pd(x)
+#define VADD(a, b) _mm_add_pd((a), (b))
+#define VMADD(acc, a, b) _mm_add_pd((acc), _mm_mul_pd((a), (b)))
+#include "mmkernel_tmpl.h"
+
+#pragma GCC pop_options
+
+/*
+ * AVX2/FMA: 4 x 16 (4 x 8 double) tiles, 8 accumulators: as many as the
+ * FMAs in flight (2 ports x 4 cycles) needed to reach peak
+ */
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+
+#define NAME avx2_i32
+#define ELEM int32_t
+#define VEC __m256i
+#define VLEN 8
+#define MR 4
+#define NV 2
+#define VZERO() _mm256_setzero_si256()
+#define VLOADU(p) _mm256_loadu_si256((const __m256i *) (p))
+#define VSTOREU(p, v) _mm256_storeu_si256((__m256i *) (p), (v))
+#define VBCAST(x) _mm256_set1_epi32(x)
+#define VADD(a, b) _mm256_add_epi32((a), (b))
+#define VMADD(acc, a, b) _mm256_add_epi32((acc), _mm256_mullo_epi32((a), (b)))
+#include "mmkernel_tmpl.h"
+
+#define NAME avx2_f32
+#define ELEM float
+#define VEC __m256
+#define VLEN 8
+#define MR 4
+#define NV 2
+#define VZERO() _mm256_setzero_ps()
+#define VLOADU(p) _mm256_loadu_ps(p)
+#define VSTOREU(p, v) _mm256_storeu_ps((p), (v))
+#define VBCAST(x) _mm256_set1_ps(x)
+#define VADD(a, b) _mm256_add_ps((a), (b))
+#define VMADD(acc, a, b) _mm256_fmadd_ps((a), (b), (acc))
+#include "mmkernel_tmpl.h"
+
+#define NAME avx2_f64
+#define ELEM double
+#define VEC __m256d
+#define VLEN 4
+#define MR 4
+#define NV 2
+#define VZERO() _mm256_setzero_pd()
+#define VLOADU(p) _mm256_loadu_pd(p)
+#define VSTOREU(p, v) _mm256_storeu_pd((p), (v))
+#define VBCAST(x) _mm256_set1_pd(x)
+#define VADD(a, b) _mm256_add_pd((a), (b))
+#define VMADD(acc, a, b) _mm256_fmadd_pd((a), (b), (acc))
+#include "mmkernel_tmpl.h"
+
+#pragma GCC pop_options
+
+/* AVX-512: 8 x 16 tiles, 8 (16 for double) of the 32 registers */
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+#define NAME avx512_i32
+#define ELEM int32_t
+#define VEC __m512i
+#define VLEN 16
+#define MR 8
+#define NV 1
+#define VZERO() _mm512_setzero_si512()
+#define VLOADU(p) _mm512_loadu_si512(p)
+#define VSTOREU(p, v) _mm512_storeu_si512((p), (v))
+#define VBCAST(x) _mm512_set1_epi32(x)
+#define VADD(a, b) _mm512_add_epi32((a), (b))
+#define VMADD(acc, a, b) _mm512_add_epi32((acc), _mm512_mullo_epi32((a), (b)))
+#include "mmkernel_tmpl.h"
+
+#define NAME avx512_f32
+#define ELEM float
+#define VEC __m512
+#define VLEN 16
+#define MR 8
+#define NV 1
+#define VZERO() _mm512_setzero_ps()
+#define VLOADU(p) _mm512_loadu_ps(p)
+#define VSTOREU(p, v) _mm512_storeu_ps((p), (v))
+#define VBCAST(x) _mm512_set1_ps(x)
+#define VADD(a, b) _mm512_add_ps((a), (b))
+#define VMADD(acc, a, b) _mm512_fmadd_ps((a), (b), (acc))
+#include "mmkernel_tmpl.h"
+
+#define NAME avx512_f64
+#define ELEM double
+#define VEC __m512d
+#define VLEN 8
+#define MR 8
+#define NV 2
+#define VZERO() _mm512_setzero_pd()
+#define VLOADU(p) _mm512_loadu_pd(p)
+#define VSTOREU(p, v) _mm512_storeu_pd((p), (v))
+#define VBCAST(x) _mm512_set1_pd(x)
+#define VADD(a, b) _mm512_add_pd((a), (b))
+#define VMADD(acc, a, b) _mm512_fmadd_pd((a), (b), (acc))
+#include "mmkernel_tmpl.h"
+
+#pragma GCC pop_options
+
+/* every kernel, the best instruction set of each type first */
+static const mm_kernel_t kernels[] = {
+    { "avx512", MM_INT32, 8, 16, avx512_i32, edge_i32 },
+    { "avx2", MM_INT32, 4, 16, avx2_i32, edge_i32 },
+    { "sse4", MM_INT32, 4, 8, sse4_i32, edge_i32 },
+    { "scalar", MM_INT32, 4, 4, scalar_i32, edge_i32 },
+    { "avx512", MM_FLOAT, 8, 16, avx512_f32, edge_f32 },
+    { "avx2", MM_FLOAT, 4, 16, avx2_f32, edge_f32 },
+    { "sse4", MM_FLOAT, 4, 8, sse4_f32, edge_f32 },
+    { "scalar", MM_FLOAT, 4, 4, scalar_f32, edge_f32 },
+    { "avx512", MM_DOUBLE, 8, 16, avx512_f64, edge_f64 },
+    { "avx2", MM_DOUBLE, 4, 8, avx2_f64, edge_f64 },
+    { "sse4", MM_DOUBLE, 4, 4, sse4_f64, edge_f64 },
+    { "scalar", MM_DOUBLE, 4, 4, scalar_f64, edge_f64 },
+};
+#define N_KERNELS (int) (sizeof(kernels) / sizeof(kernels[0]))
+
+static const char *type_names[MM_N_TYPES] = { "int32", "float", "double" };
+static const size_t type_sizes[MM_N_TYPES] = {
+    sizeof(int32_t), sizeof(float), sizeof(double)
+};
+
+const char *mm_type_name(mm_type_t type)
+{
+    return type_names[type];
+}
+
+int mm_type_parse(const char *name)
+{
+    for (int t = 0; t < MM_N_TYPES; t++)
+        if (strcmp(type_names[t], name) == 0)
+            return t;
+    return -1;
+}
+
+size_t mm_type_size(mm_type_t type)
+{
+    return type_sizes[type];
+}
+
+/* does CPUID (and the OS, for the wider registers) allow the set? */
+static int isa_supported(const char *isa)
+{
+    __builtin_cpu_init();
+    if (strcmp(isa, "avx512") == 0)
+        return __builtin_cpu_supports("avx512f");
+    if (strcmp(isa, "avx2") == 0)
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (strcmp(isa, "sse4") == 0)
+        return __builtin_cpu_supports("sse4.1");
+    return strcmp(isa, "scalar") == 0;
+}
+
+const mm_kernel_t *mm_kernel_select(mm_type_t type, const char *isa)
+{
+    for (int i = 0; i < N_KERNELS; i++) {
+        if (kernels[i].type != type ||
+            (isa != NULL && strcmp(kernels[i].isa, isa) != 0))
+            continue;
+        if (isa_supported(kernels[i].isa))
+            return &kernels[i];
+    }
+    return NULL;
+}
+
+/* tile C with the micro-kernel, then do the right and bottom edges */
+void mm_kernel_run(const mm_kernel_t *kern, int m, int n, int k,
+                   const void *a, long lda, const void *b, long ldb, void *c,
+                   long ldc)
+{
+    size_t size = mm_type_size(kern->type);
+    const char *a_ = a, *b_ = b;
+    char *c_ = c;
+    int m_full = m - m % kern->mr;
+    int n_full = n - n % kern->nr;
+
+    for (int i = 0; i < m_full; i += kern->mr)
+        for (int j = 0; j < n_full; j += kern->nr)
+            kern->kernel(k, a_ + i * lda * size, lda, 1, b_ + j * size, ldb,
+                         c_ + (i * ldc + j) * size, ldc, 0);
+    if (n_full < n)
+        kern->edge(m_full, n - n_full, k, a_, lda, b_ + n_full * size, ldb,
+                   c_ + n_full * size, ldc);
+    if (m_full < m)
+        kern->edge(m - m_full, n, k, a_ + m_full * lda * size, lda, b_, ldb,
+                   c_ + m_full * ldc * size, ldc);
+}
+
+static long cache_size(int name, long fallback)
+{
+    long size = sysconf(name);
+    return size > 0 ? size : fallback;
+}
+
+static int clamp_to(long v, int step, int max)
+{
+    if (v > max)
+        v = max;
+    v -= v % step;
+    return v < step ? step : v;
+}
+
+void mm_blocking(const mm_kernel_t *kern, mm_blocking_t *bl)
+{
+    long size = mm_type_size(kern->type);
+    long l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, DEFAULT_L1);
+    long l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, DEFAULT_L2);
+    long l3 = cache_size(_SC_LEVEL3_CACHE_SIZE, DEFAULT_L3);
+
+    bl->kc = clamp_to(l1 / 2 / ((kern->mr + kern->nr) * size), 16, MAX_KC);
+    bl->mc = clamp_to(l2 / 2 / (bl->kc * size), kern->mr, MAX_MC);
+    bl->nc = clamp_to(l3 / 2 / (bl->kc * size), kern->nr, MAX_NC);
+}
+
+static long round_up(long v, int step)
+{
+    return (v + step - 1) / step * step;
+}
+
+size_t mm_gemm_workspace(const mm_kernel_t *kern, int m, int n)
+{
+    mm_blocking_t bl;
+    size_t size = mm_type_size(kern->type);
+    mm_blocking(kern, &bl);
+    long mc = round_up(m < bl.mc ? m : bl.mc, kern->mr);
+    long nc = round_up(n < bl.nc ? n : bl.nc, kern->nr);
+    /* the panels, an edge tile, and alignment slack for each */
+    return (mc + nc) * bl.kc * size + kern->mr * kern->nr * size + 3 * 64;
+}
+
+/*
+ * Packing only moves bits, so one loop per element size serves every type,
+ * and the zero padding reads as 0 in each.
+ */
+#define PACK_A(T) \
+    for (int ir = 0; ir < mc; ir += mr, dst += mr * kc) { \
+        const T *src = (const T *) a + ir * lda; \
+        int m = mc - ir < mr ? mc - ir : mr; \
+        for (int i = 0; i < mr; i++) \
+            for (int p = 0; p < kc; p++) \
+                dst[p * mr + i] = i < m ? src[i * lda + p] : 0; \
+    }
+
+/* A[mc][kc] as mr-row panels, each column by column */
+static void pack_a(size_t size, int mr, int mc, int kc, const void *a,
+                   long lda, void *ap)
+{
+    if (size == 4) {
+        uint32_t *dst = ap;
+        PACK_A(uint32_t);
+    } else {
+        uint64_t *dst = ap;
+        PACK_A(uint64_t);
+    }
+}
+
+/* B[kc][nc] as nr-column panels, each row by row */
+static void pack_b(size_t size, int nr, int kc, int nc, const void *b,
+                   long ldb, void *bp)
+{
+    char *dst = bp;
+    for (int jr = 0; jr < nc; jr += nr) {
+        int n = nc - jr < nr ? nc - jr : nr;
+        for (int p = 0; p < kc; p++) {
+            memcpy(dst, (const char *) b + (p * ldb + jr) * size, n * size);
+            memset(dst + n * size, 0, (nr - n) * size);
+            dst += nr * size;
+        }
+    }
+}
+
+/* copy an m x n corner of a tile, between ldc and a dense nr-wide tile */
+static void copy_tile(size_t size, int m, int n, const char *src,
+                      long lds, char *dst, long ldd)
+{
+    for (int i = 0; i < m; i++)
+        memcpy(dst + i * ldd * size, src + i * lds * size, n * size);
+}
+
+void mm_gemm(const mm_kernel_t *kern, int m, int n, int k, const void *a,
+             long lda, const void *b, long ldb, void *c, long ldc,
+             arena_t *arena)
+{
+    size_t size = mm_type_size(kern->type);
+    int mr = kern->mr, nr = kern->nr;
+    mm_blocking_t bl;
+    mm_blocking(kern, &bl);
+
+    size_t mark = arena_mark(arena);
+    char *ap = arena_alloc(arena, round_up(m < bl.mc ? m : bl.mc, mr) *
+                           bl.kc * size, 64);
+    char *bp = arena_alloc(arena, round_up(n < bl.nc ? n : bl.nc, nr) *
+                           bl.kc * size, 64);
+    char *tile = arena_alloc(arena, mr * nr * size, 64);
+    if (ap == NULL || bp == NULL || tile == NULL || k == 0) {
+        arena_release(arena, mark);
+        mm_kernel_run(kern, m, n, k, a, lda, b, ldb, c, ldc);
+        return;
+    }
+
+    for (int jc = 0; jc < n; jc += bl.nc) {
+        int nc = n - jc < bl.nc ? n - jc : bl.nc;
+        for (int pc = 0; pc < k; pc += bl.kc) {
+            int kc = k - pc < bl.kc ? k - pc : bl.kc;
+            pack_b(size, nr, kc, nc, (const char *) b +
+                   ((long) pc * ldb + jc) * size, ldb, bp);
+            for (int ic = 0; ic < m; ic += bl.mc) {
+                int mc = m - ic < bl.mc ? m - ic : bl.mc;
+                pack_a(size, mr, mc, kc, (const char *) a +
+                       ((long) ic * lda + pc) * size, lda, ap);
+                for (int jr = 0; jr < nc; jr += nr) {
+                    for (int ir = 0; ir < mc; ir += mr) {
+                        char *ct = (char *) c +
+                            ((long) (ic + ir) * ldc + jc + jr) * size;
+                        const char *at = ap + (long) ir * kc * size;
+                        const char *bt = bp + (long) jr * kc * size;
+                        int mt = mc - ir < mr ? mc - ir : mr;
+                        int nt = nc - jr < nr ? nc - jr : nr;
+                        if (mt == mr && nt == nr) {
+                            kern->kernel(kc, at, 1, mr, bt, nr, ct, ldc,
+                                         pc > 0);
+                            continue;
+                        }
+                        /* an edge: compute the padded tile on the side */
+                        if (pc > 0)
+                            copy_tile(size, mt, nt, ct, ldc, tile, nr);
+                        kern->kernel(kc, at, 1, mr, bt, nr, tile, nr, pc > 0);
+                        copy_tile(size, mt, nt, tile, nr, ct, ldc);
+                    }
+                }
+            }
+        }
+    }
+    arena_release(arena, mark);
+}
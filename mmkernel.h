@@ -0,0 +1,77 @@
+/**
+ * @file mmkernel.h
+ * @brief Register-tiled matrix multiplication micro-kernels, for int32,
+ * float and double, picked at runtime from what the CPU supports
+ *
+ * A micro-kernel computes an mr x nr tile of C = A * B over the whole K
+ * dimension, holding the tile in vector registers. mm_kernel_run covers a
+ * larger block with it straight from A and B, and the edges that are not a
+ * whole tile with a scalar loop. mm_gemm first packs panels of A and B
+ * into buffers laid out in the order the micro-kernel reads them and sized
+ * for the caches (Goto's algorithm), and pads the edges.
+ **/
+
+#ifndef MMKERNEL_H
+#define MMKERNEL_H
+
+#include <stddef.h>
+#include "arena.h"
+
+typedef enum {
+    MM_INT32,
+    MM_FLOAT,
+    MM_DOUBLE,
+    MM_N_TYPES
+} mm_type_t;
+
+/*
+ * C[m][n] = A[m][k] * B[k][n] (+ C if accumulate), row-major with leading
+ * dimensions in elements; the micro-kernels have m = mr and n = nr and
+ * also take the column stride of A, which is mr once A is packed
+ */
+typedef void (*mm_ukernel_t)(int k, const void *a, long rsa, long csa,
+                             const void *b, long ldb, void *c, long ldc,
+                             int accumulate);
+typedef void (*mm_edge_t)(int m, int n, int k, const void *a, long lda,
+                          const void *b, long ldb, void *c, long ldc);
+
+typedef struct {
+    const char *isa;        /* "avx512", "avx2", "sse4" or "scalar" */
+    mm_type_t type;
+    int mr, nr;             /* the tile of C the micro-kernel computes */
+    mm_ukernel_t kernel;
+    mm_edge_t edge;         /* any m x n, for the rest */
+} mm_kernel_t;
+
+const char *mm_type_name(mm_type_t type);
+int mm_type_parse(const char *name);    /* -1 if unknown */
+size_t mm_type_size(mm_type_t type);
+
+/*
+ * the kernel of a type for an instruction set, or for the best one the CPU
+ * has if isa is NULL; NULL if the CPU lacks it
+ */
+const mm_kernel_t *mm_kernel_select(mm_type_t type, const char *isa);
+
+void mm_kernel_run(const mm_kernel_t *kern, int m, int n, int k,
+                   const void *a, long lda, const void *b, long ldb, void *c,
+                   long ldc);
+
+/*
+ * Cache blocking of mm_gemm: a kc x nr panel of B and an mr x kc panel of A
+ * share half of L1, an mc x kc block of A takes half of L2 and a kc x nc
+ * block of B half of L3
+ */
+typedef struct {
+    int mc, kc, nc;
+} mm_blocking_t;
+
+void mm_blocking(const mm_kernel_t *kern, mm_blocking_t *bl);
+/* bytes of arena mm_gemm needs for an m x n product */
+size_t mm_gemm_workspace(const mm_kernel_t *kern, int m, int n);
+/* like mm_kernel_run, packing into the arena (unpacked if it is too small) */
+void mm_gemm(const mm_kernel_t *kern, int m, int n, int k, const void *a,
+             long lda, const void *b, long ldb, void *c, long ldc,
+             arena_t *arena);
+
+#endif /* MMKERNEL_H */
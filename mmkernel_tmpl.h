@@ -0,0 +1,88 @@
+/**
+ * @file mmkernel_tmpl.h
+ * @brief Body of a micro-kernel, included once per element type and
+ * instruction set by mmkernel.c (so it has no include guard)
+ *
+ * The includer defines:
+ *   NAME        the function to define
+ *   ELEM, VEC   the element type and the vector type
+ *   VLEN        elements per vector
+ *   MR, NV      rows of the tile, and vectors per row (nr = NV * VLEN)
+ *   VZERO()     a zero vector
+ *   VLOADU(p), VSTOREU(p, v)   unaligned load and store
+ *   VBCAST(x)   a vector of copies of x
+ *   VADD(a, b), VMADD(acc, a, b)   a + b and acc + a * b
+ * and, for the scalar instantiation only, EDGE_NAME: the m x n loop that
+ * mm_kernel_run uses at the edges.
+ **/
+
+static void NAME(int k, const void *a_, long rsa, long csa, const void *b_,
+                 long ldb, void *c_, long ldc, int accumulate)
+{
+    const ELEM *a = a_;
+    const ELEM *b = b_;
+    ELEM *c = c_;
+    VEC acc[MR][NV];
+
+    /* constant trip counts: unrolled, acc lives in registers */
+#pragma GCC unroll 16
+    for (int i = 0; i < MR; i++)
+#pragma GCC unroll 16
+        for (int v = 0; v < NV; v++)
+            acc[i][v] = VZERO();
+
+    for (int p = 0; p < k; p++) {
+        VEC bv[NV];
+#pragma GCC unroll 16
+        for (int v = 0; v < NV; v++)
+            bv[v] = VLOADU(b + p * ldb + v * VLEN);
+#pragma GCC unroll 16
+        for (int i = 0; i < MR; i++) {
+            VEC av = VBCAST(a[i * rsa + p * csa]);
+#pragma GCC unroll 16
+            for (int v = 0; v < NV; v++)
+                acc[i][v] = VMADD(acc[i][v], av, bv[v]);
+        }
+    }
+
+#pragma GCC unroll 16
+    for (int i = 0; i < MR; i++)
+#pragma GCC unroll 16
+        for (int v = 0; v < NV; v++) {
+            if (accumulate)
+                acc[i][v] = VADD(acc[i][v], VLOADU(c + i * ldc + v * VLEN));
+            VSTOREU(c + i * ldc + v * VLEN, acc[i][v]);
+        }
+}
+
+#ifdef EDGE_NAME
+static void EDGE_NAME(int m, int n, int k, const void *a_, long lda,
+                      const void *b_, long ldb, void *c_, long ldc)
+{
+    const ELEM *a = a_;
+    const ELEM *b = b_;
+    ELEM *c = c_;
+
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < n; j++)
+            c[i * ldc + j] = 0;
+        for (int p = 0; p < k; p++)
+            for (int j = 0; j < n; j++)
+                c[i * ldc + j] += a[i * lda + p] * b[p * ldb + j];
+    }
+}
+#endif
+
+#undef NAME
+#undef EDGE_NAME
+#undef ELEM
+#undef VEC
+#undef VLEN
+#undef MR
+#undef NV
+#undef VZERO
+#undef VLOADU
+#undef VSTOREU
+#undef VBCAST
+#undef VADD
+#undef VMADD
@@ -4,9 +4,18 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include "atomic.h"
 #include <assert.h>
 #include "func_time.h"
+#include "perf.h"
+#include "env.h"
+#include "mmkernel.h"
+#include "pool.h"
+#ifdef BENCH_RUNNER
+#include "bench.h"
+#endif
 
 #define DEBUG
 
@@ -16,16 +25,21 @@
 #define dbg_printf
 #endif
 
-/** @brief The number of threads to use to compute the matrix multiplication */
-#define THREADS 32
-/** @brief The block size to use */
-#define BLOCK 16
-/** @brief The value (in blocks) of the width and height of the matrix */
-#define SIZE 1
-/** @brief the size of the matrix in bytes */
-#define MATRIX_SIZE_BYTES ((BLOCK * SIZE) * (BLOCK * SIZE) * sizeof(int))
+/** @brief The default number of threads (--threads) */
+#define DEFAULT_THREADS 32
+/** @brief The default side of the blocks the threads claim (--block) */
+#define DEFAULT_BLOCK 16
+/** @brief The default side of the matrices, in elements (--size) */
+#define DEFAULT_SIZE 128
+/** @brief The most threads, and the widest block */
+#define MAX_THREADS 256
+#define MAX_BLOCK 1024
 /** @brief The maximum measurement error for timing functions */
 #define ERR_MAX 0.001
+/** @brief Trials of each configuration --autotune tries */
+#define TUNE_TRIALS 5
+/** @brief Where --autotune writes the best configurations by default */
+#define TUNE_FILE "mmt.tune"
 
 /** @brief Represents the coordinates of a block in the matrix */
 typedef struct {
@@ -33,37 +47,250 @@ typedef struct {
 	int col; /**< The block's column */
 } coord_t;
 
+/** @brief A way of computing the blocks claimed by the threads */
+typedef struct {
+	const char *name;
+	const char *description;
+	void (*block)(coord_t *block);
+	bool accumulates; /**< Adds into C, which must start zeroed */
+	bool typed;       /**< Works on Ax, Bx and Cx, of elem_type */
+	void (*run)(void); /**< Computes the whole product, instead of blocks */
+} engine_t;
+
 pthread_mutex_t mutex;
 
-/* the matrices to multiply - we compute the equation A * B = C */
-static int A[SIZE * BLOCK][SIZE * BLOCK];
-static int B[SIZE * BLOCK][SIZE * BLOCK];
-static int C[SIZE * BLOCK][SIZE * BLOCK];
+/** @brief The shape of the product: C[m][n] = A[m][k] * B[k][n] */
+static int dim_m = DEFAULT_SIZE, dim_n = DEFAULT_SIZE, dim_k = DEFAULT_SIZE;
+/** @brief The side of the blocks the threads claim */
+static int block_size = DEFAULT_BLOCK;
+/** @brief The number of threads computing the product */
+static int n_threads = DEFAULT_THREADS;
+
+/* the matrices to multiply - we compute the equation A * B = C, row-major */
+static int *A, *B, *C;
 
 /* matrix to hold a reference brute force solution for verification */
-static int C_sol[SIZE * BLOCK][SIZE * BLOCK];
+static int *C_sol;
+/** @brief Sizes of the packing sweep, in elements per side */
+static const int pack_sizes[] = { 128, 256, 512, 1024 };
+#define N_PACK_SIZES (int) (sizeof(pack_sizes) / sizeof(pack_sizes[0]))
+
+/* A, B and C as elem_type, for the micro-kernels, in huge pages */
+static arena_t matrix_arena;
+static char *Ax, *Bx, *Cx;
+
+/** @brief Panel buffers of each thread for mm_gemm, kept across runs */
+static arena_t thread_arenas[MAX_THREADS];
+/** @brief The panel buffers of the calling thread */
+static __thread arena_t *my_arena;
+
+/** @brief The side of the tiles of the Morton layout: a multiple of the
+ * mr and nr of every micro-kernel */
+#define MORTON_TILE 32
+/**
+ * @brief A matrix of elem_type copied into tiles in Morton order, for the
+ * recursive engine. Its tile rows and tile columns are each padded to a
+ * power of two, so halving either keeps the halves contiguous.
+ */
+typedef struct {
+	char *z;                  /**< The tiles */
+	char *x;                  /**< The row-major matrix it copies */
+	int rows, cols;           /**< Of the matrix, in elements */
+	int tile_rows, tile_cols; /**< Of the layout, in tiles */
+	bool cols_first;          /**< Whether a square of tiles halves its
+	                               columns first, as rec_mul does */
+} morton_t;
+
+/* A, B and C in Morton order, allocated by init_morton */
+static arena_t morton_arena;
+static morton_t Am, Bm, Cm;
+
+/** @brief The element type of the simd engine */
+static mm_type_t elem_type = MM_INT32;
+/** @brief Its instruction set, or NULL for the best the CPU has */
+static const char *kernel_isa;
+/** @brief The micro-kernel picked for them */
+static const mm_kernel_t *kernel;
 
 /** @brief Next block location that will be accessed by a thread */
 static coord_t next_location;
 /** @brief Lock to synchronize access to the next block location */
 pthread_mutex_t next_location_lock;
 
+/** @brief The workers of mm_parallel, created by its first run */
+static pool_t *pool;
+/** @brief Whether mm_parallel creates its threads each run instead */
+static bool spawn_per_call;
+
+/** @brief Whether to collect hardware counters for each thread */
+static int use_counters;
+/** @brief Hardware counters of each thread, summed over every run */
+static perf_counts_t thread_counts[MAX_THREADS];
+/** @brief The counters of each pool worker, opened by its first tile */
+static perf_group_t worker_groups[MAX_THREADS];
+static bool worker_group_open[MAX_THREADS];
+/** @brief The number of timed runs of mm_parallel */
+static int test_runs;
+
 /**
- * @brief Initializes the three matrices to their starting values.
+ * @brief Allocates the matrices for the shape dim_m x dim_n x dim_k and
+ * initializes them to their starting values.
  *
- * @return void
+ * @return Zero on success or -1 if there is no memory.
  */
-void init_matrices(void) {
+int init_matrices(void) {
+	/* small enough that every sum is exact, even as a float */
+	int range = 256;
+	while (range > 1 && (long) range * range * dim_k > (1L << 24))
+		range /= 2;
+
+	free(A);
+	free(B);
+	free(C);
+	free(C_sol);
+	A = malloc((long) dim_m * dim_k * sizeof(int));
+	B = malloc((long) dim_k * dim_n * sizeof(int));
+	C = calloc((long) dim_m * dim_n, sizeof(int));
+	C_sol = malloc((long) dim_m * dim_n * sizeof(int));
+	if (A == NULL || B == NULL || C == NULL || C_sol == NULL) {
+		dbg_printf("Error: malloc returned NULL.\n");
+		return -1;
+	}
+
 	srand(time(NULL));
-	for (int r = 0; r < BLOCK * SIZE; r++) {
-		for(int c = 0; c < BLOCK * SIZE; c++) {
-			A[r][c] = rand();
-			B[r][c] = rand();
-			C[r][c] = 0;
+	for (long i = 0; i < (long) dim_m * dim_k; i++)
+		A[i] = rand() % range;
+	for (long i = 0; i < (long) dim_k * dim_n; i++)
+		B[i] = rand() % range;
+	return 0;
+}
+
+/**
+ * @brief Reads an element of a matrix of elem_type.
+ *
+ * @param m The matrix (Ax, Bx or Cx).
+ * @param r The row of the element.
+ * @param c The column of the element.
+ *
+ * @return The element, as a double.
+ */
+double typed_get(const char *m, int r, int c) {
+	long i = (long) r * dim_n + c;
+	switch (elem_type) {
+	case MM_FLOAT:
+		return ((const float *) m)[i];
+	case MM_DOUBLE:
+		return ((const double *) m)[i];
+	default:
+		return ((const int32_t *) m)[i];
+	}
+}
+
+/**
+ * @brief Makes sure every thread has the panel buffers mm_gemm needs for a
+ * block of block_size, with the kernel picked.
+ *
+ * @return Zero on success or -1 if there is no memory.
+ */
+int init_workspaces(void) {
+	size_t need = mm_gemm_workspace(kernel, block_size, block_size);
+	for (int i = 0; i < n_threads; i++) {
+		if (thread_arenas[i].size >= need)
+			continue;
+		arena_destroy(&thread_arenas[i]);
+		if (arena_init(&thread_arenas[i], need) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Copies one matrix of ints into a matrix of elem_type.
+ *
+ * @param dst The matrix of elem_type.
+ * @param src The matrix of ints.
+ * @param n The number of elements.
+ */
+static void copy_typed(char *dst, const int *src, long n) {
+	for (long i = 0; i < n; i++) {
+		switch (elem_type) {
+		case MM_FLOAT:
+			((float *) dst)[i] = src[i];
+			break;
+		case MM_DOUBLE:
+			((double *) dst)[i] = src[i];
+			break;
+		default:
+			((int32_t *) dst)[i] = src[i];
 		}
 	}
 }
 
+/**
+ * @brief Picks the micro-kernel for elem_type and kernel_isa.
+ *
+ * @return Zero on success or -1 if the CPU lacks the instruction set.
+ */
+int select_kernel(void) {
+	kernel = mm_kernel_select(elem_type, kernel_isa);
+	return kernel != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Copies A and B into Ax and Bx as elem_type, for the kernel
+ * select_kernel picked.
+ *
+ * @return Zero on success or -1 if there is no memory.
+ */
+int init_typed(void) {
+	size_t size = mm_type_size(elem_type);
+	long a_len = (long) dim_m * dim_k, b_len = (long) dim_k * dim_n;
+	long c_len = (long) dim_m * dim_n;
+
+	/* remapped for every shape, with room for the alignment of each */
+	arena_destroy(&matrix_arena);
+	if (arena_init(&matrix_arena, (a_len + b_len + c_len) * size + 3 * 64) < 0)
+		return -1;
+	Ax = arena_alloc(&matrix_arena, a_len * size, 64);
+	Bx = arena_alloc(&matrix_arena, b_len * size, 64);
+	Cx = arena_alloc(&matrix_arena, c_len * size, 64);
+	if (init_workspaces() < 0)
+		return -1;
+	copy_typed(Ax, A, a_len);
+	copy_typed(Bx, B, b_len);
+	return 0;
+}
+
+/** @brief A way of computing the blocks, defined below */
+static const engine_t *engine;
+
+/**
+ * @brief The number of block rows the threads claim.
+ *
+ * @return The rows of A (and C) over block_size, rounded up.
+ */
+static int grid_rows(void) {
+	return (dim_m + block_size - 1) / block_size;
+}
+
+/**
+ * @brief The number of block columns the threads claim.
+ *
+ * @return The columns of C over block_size, rounded up, or those of A for
+ * an engine that adds into C, whose blocks cover A.
+ */
+static int grid_cols(void) {
+	int cols = engine->accumulates ? dim_k : dim_n;
+	return (cols + block_size - 1) / block_size;
+}
+
+/**
+ * @brief The smaller of two ints.
+ */
+static inline int min_int(int a, int b) {
+	return a < b ? a : b;
+}
+
 /**
  * @brief Gets a block of the matrix to operate on.
  *
@@ -88,9 +315,9 @@ int get_block(coord_t *loc) {
 	loc->col = next_location.col;
 
 	/* update the block that the next thread will take */
-	next_location.col = (next_location.col + 1) % SIZE;
+	next_location.col = (next_location.col + 1) % grid_cols();
 	if (next_location.col == 0) {
-		next_location.row = (next_location.row + 1) % SIZE;
+		next_location.row = (next_location.row + 1) % grid_rows();
 		if(next_location.row == 0) {
 			next_location.row = -1;
 			next_location.col = -1;
@@ -109,20 +336,403 @@ int get_block(coord_t *loc) {
  * @param block The coordinates representing the block to operate on.
  */
 void mm_block(coord_t *block) {
-    for (int rr = 0; rr < BLOCK; ++rr) {
-        for (int cc = 0; cc < BLOCK; ++cc) {
+    int r0 = block->row * block_size, c0 = block->col * block_size;
+    int rows = min_int(block_size, dim_m - r0);
+    int cols = min_int(block_size, dim_k - c0);
 
-        	int r = rr + (block->row * BLOCK);
-        	int c = cc + (block->col * BLOCK);
+    for (int rr = 0; rr < rows; ++rr) {
+        for (int cc = 0; cc < cols; ++cc) {
 
-        	for (int i = 0; i < BLOCK*SIZE; i++) {
-        		int delta = A[r][c] * B[c][i];
-        		atomic_increment(&C[r][i], delta);
+        	int r = rr + r0;
+        	int c = cc + c0;
+
+        	for (int i = 0; i < dim_n; i++) {
+        		int delta = A[(long) r * dim_k + c] * B[(long) c * dim_n + i];
+        		atomic_increment(&C[(long) r * dim_n + i], delta);
         	}
         }
     }
 }
 
+/**
+ * @brief Computes one tile of C, output-stationary: the tile accumulates in
+ * a local buffer over the whole K dimension and is written to C once, so
+ * no other thread ever touches its lines and no atomics are needed.
+ *
+ * @param tile The coordinates of the tile of C to compute.
+ */
+void mm_tile(coord_t *tile) {
+	int acc[MAX_BLOCK];
+	int r0 = tile->row * block_size;
+	int c0 = tile->col * block_size;
+	int rows = min_int(block_size, dim_m - r0);
+	int cols = min_int(block_size, dim_n - c0);
+
+	/* a row of the tile at a time, each over the whole K dimension */
+	for (int rr = 0; rr < rows; rr++) {
+		const int *a_row = &A[(long) (r0 + rr) * dim_k];
+		for (int cc = 0; cc < cols; cc++)
+			acc[cc] = 0;
+		for (int k = 0; k < dim_k; k++) {
+			int a = a_row[k];
+			const int *b_row = &B[(long) k * dim_n + c0];
+			for (int cc = 0; cc < cols; cc++)
+				acc[cc] += a * b_row[cc];
+		}
+		memcpy(&C[(long) (r0 + rr) * dim_n + c0], acc, cols * sizeof(int));
+	}
+}
+
+/**
+ * @brief Computes one tile of Cx with the SIMD micro-kernel, which holds
+ * sub-tiles of it in registers over the whole K dimension.
+ *
+ * @param tile The coordinates of the tile of Cx to compute.
+ */
+void mm_simd(coord_t *tile) {
+	size_t size = mm_type_size(elem_type);
+	long r0 = tile->row * block_size;
+	long c0 = tile->col * block_size;
+
+	mm_kernel_run(kernel, min_int(block_size, dim_m - r0),
+	              min_int(block_size, dim_n - c0), dim_k,
+	              Ax + r0 * dim_k * size, dim_k, Bx + c0 * size, dim_n,
+	              Cx + (r0 * dim_n + c0) * size, dim_n);
+}
+
+/**
+ * @brief Computes one tile of Cx as mm_simd, but from panels of Ax and Bx
+ * packed into the thread's arena, so the micro-kernel reads B contiguously
+ * instead of one row apart.
+ *
+ * @param tile The coordinates of the tile of Cx to compute.
+ */
+void mm_packed(coord_t *tile) {
+	size_t size = mm_type_size(elem_type);
+	long r0 = tile->row * block_size;
+	long c0 = tile->col * block_size;
+
+	mm_gemm(kernel, min_int(block_size, dim_m - r0),
+	        min_int(block_size, dim_n - c0), dim_k, Ax + r0 * dim_k * size,
+	        dim_k, Bx + c0 * size, dim_n, Cx + (r0 * dim_n + c0) * size,
+	        dim_n, my_arena);
+}
+
+/**
+ * @brief The position of a tile in a Morton layout: the layout halves its
+ * longer side (or, for a square, the one cols_first says) over and over,
+ * and every half is a contiguous run of tiles. For a square this is the
+ * Z order, the bits of the row and the column interleaved.
+ *
+ * @param m The layout.
+ * @param r The row of the tile.
+ * @param c The column of the tile.
+ *
+ * @return The position of the tile.
+ */
+static long morton_index(const morton_t *m, int r, int c) {
+	int rows = m->tile_rows, cols = m->tile_cols;
+	long z = 0;
+	while (rows > 1 || cols > 1) {
+		if (rows > cols || (rows == cols && !m->cols_first)) {
+			rows /= 2;
+			if (r >= rows) {
+				z += (long) rows * cols;
+				r -= rows;
+			}
+		} else {
+			cols /= 2;
+			if (c >= cols) {
+				z += (long) rows * cols;
+				c -= cols;
+			}
+		}
+	}
+	return z;
+}
+
+/**
+ * @brief The number of tiles covering a side, padded to a power of two.
+ *
+ * @param n The side, in elements.
+ *
+ * @return The tiles.
+ */
+static int morton_tiles(int n) {
+	int t = 1;
+	while ((long) t * MORTON_TILE < n)
+		t *= 2;
+	return t;
+}
+
+/**
+ * @brief Describes the Morton copies of A, B and C and allocates them,
+ * each padded separately in tile rows and tile columns.
+ *
+ * @return Zero on success or -1 if there is no memory.
+ */
+int init_morton(void) {
+	size_t tile = MORTON_TILE * MORTON_TILE * mm_type_size(elem_type);
+	int tm = morton_tiles(dim_m), tn = morton_tiles(dim_n);
+	int tk = morton_tiles(dim_k);
+
+	/* the halving order of rec_mul: m, then n, then k when they tie */
+	Am = (morton_t) { NULL, Ax, dim_m, dim_k, tm, tk, false };
+	Bm = (morton_t) { NULL, Bx, dim_k, dim_n, tk, tn, true };
+	Cm = (morton_t) { NULL, Cx, dim_m, dim_n, tm, tn, false };
+	size_t a = (size_t) tm * tk * tile, b = (size_t) tk * tn * tile;
+	size_t c = (size_t) tm * tn * tile;
+	arena_destroy(&morton_arena);
+	if (arena_init(&morton_arena, a + b + c + 3 * 64) < 0)
+		return -1;
+	Am.z = arena_alloc(&morton_arena, a, 64);
+	Bm.z = arena_alloc(&morton_arena, b, 64);
+	Cm.z = arena_alloc(&morton_arena, c, 64);
+	return 0;
+}
+
+/**
+ * @brief The tiles a Morton copy has inside its matrix, which are the only
+ * ones rec_mul reads or writes.
+ *
+ * @param m The copy.
+ *
+ * @return The tiles, counted row-major.
+ */
+static long morton_used(const morton_t *m) {
+	return (long) ((m->rows + MORTON_TILE - 1) / MORTON_TILE) *
+	       ((m->cols + MORTON_TILE - 1) / MORTON_TILE);
+}
+
+/**
+ * @brief Copies a tile between a row-major matrix of elem_type and its
+ * Morton copy, padding the part of the tile past the matrix with zeros.
+ *
+ * @param m The Morton copy.
+ * @param i The tile, counted row-major among those of morton_used.
+ * @param x The row-major matrix, or NULL to zero the tile.
+ * @param to_morton Whether to copy into the Morton copy, rather than out.
+ */
+static void morton_tile(const morton_t *m, long i, char *x, bool to_morton) {
+	size_t size = mm_type_size(elem_type);
+	int per_row = (m->cols + MORTON_TILE - 1) / MORTON_TILE;
+	int tr = i / per_row, tc = i % per_row;
+	char *tile = m->z + morton_index(m, tr, tc) * MORTON_TILE * MORTON_TILE *
+	             size;
+	int r0 = tr * MORTON_TILE, c0 = tc * MORTON_TILE;
+	int h = min_int(MORTON_TILE, m->rows - r0);
+	int w = min_int(MORTON_TILE, m->cols - c0);
+
+	for (int r = 0; r < MORTON_TILE; r++) {
+		char *row = tile + r * MORTON_TILE * size;
+		char *xrow = x + ((long) (r0 + r) * m->cols + c0) * size;
+		if (!to_morton) {
+			if (r < h)
+				memcpy(xrow, row, w * size);
+		} else if (x == NULL || r >= h) {
+			memset(row, 0, MORTON_TILE * size);
+		} else {
+			memcpy(row, xrow, w * size);
+			memset(row + w * size, 0, (MORTON_TILE - w) * size);
+		}
+	}
+}
+
+/**
+ * @brief Copies a tile of a matrix into its Morton copy, as a pool_for
+ * body.
+ *
+ * @param i The tile, counted row-major.
+ * @param arg The Morton copy.
+ */
+static void morton_in(long i, void *arg) {
+	const morton_t *m = arg;
+	morton_tile(m, i, m->x, true);
+}
+
+/**
+ * @brief Zeroes a tile of a Morton copy (of C), as a pool_for body.
+ *
+ * @param i The tile, counted row-major.
+ * @param arg The Morton copy.
+ */
+static void morton_zero(long i, void *arg) {
+	morton_tile(arg, i, NULL, true);
+}
+
+/**
+ * @brief Copies a tile of a Morton copy (of C) back into its matrix, as a
+ * pool_for body.
+ *
+ * @param i The tile, counted row-major.
+ * @param arg The Morton copy.
+ */
+static void morton_out(long i, void *arg) {
+	const morton_t *m = arg;
+	morton_tile(m, i, m->x, false);
+}
+
+/** @brief One product of the recursion: C += A * B on blocks of tiles */
+typedef struct {
+	char *c;
+	const char *a, *b;
+	int row, col, k;  /**< Where C's rows and columns and the K range start,
+	                       in tiles, to skip what is only padding */
+	int tm, tn, tk;   /**< The extents of the product in tiles: powers of
+	                       two, as in the Morton copies */
+	int depth;        /**< Halvings of M or N above, to spawn tasks at the
+	                       top ones */
+} rec_t;
+
+/** @brief The pool of the recursive engine's tasks, or NULL to run alone */
+static pool_t *rec_pool;
+/** @brief Levels of the recursion that spawn a task (the second half) */
+static int rec_spawn_depth;
+
+static void rec_mul(const rec_t *r);
+
+/**
+ * @brief Runs one half of a product, as a task.
+ *
+ * @param arg The half.
+ */
+static void rec_task(void *arg) {
+	rec_mul(arg);
+}
+
+/**
+ * @brief Multiplies two blocks of tiles into a third by halving the
+ * longest of M, N and K, down to single tiles, which the micro-kernel
+ * multiplies in registers. The halves of M or N write different parts of
+ * C, so at the top levels the second is a task any worker may steal; the
+ * halves of K both write all of it, and run one after the other.
+ *
+ * @param r The product.
+ */
+static void rec_mul(const rec_t *r) {
+	size_t size = mm_type_size(elem_type);
+	size_t tile = MORTON_TILE * MORTON_TILE * size;
+	if (r->row * MORTON_TILE >= dim_m || r->col * MORTON_TILE >= dim_n ||
+	    r->k * MORTON_TILE >= dim_k)
+		return;
+
+	if (r->tm == 1 && r->tn == 1 && r->tk == 1) {
+		for (int i = 0; i < MORTON_TILE; i += kernel->mr)
+			for (int j = 0; j < MORTON_TILE; j += kernel->nr)
+				kernel->kernel(MORTON_TILE, r->a + i * MORTON_TILE * size,
+				               MORTON_TILE, 1, r->b + j * size, MORTON_TILE,
+				               r->c + (i * MORTON_TILE + j) * size,
+				               MORTON_TILE, 1);
+		return;
+	}
+
+	/* the order of the Morton copies' cols_first: m, then n, then k */
+	rec_t half[2] = { *r, *r };
+	if (r->tm >= r->tn && r->tm >= r->tk) {
+		half[0].tm = half[1].tm = r->tm / 2;
+		half[1].c += (size_t) half[1].tm * r->tn * tile;
+		half[1].a += (size_t) half[1].tm * r->tk * tile;
+		half[1].row += half[1].tm;
+	} else if (r->tn >= r->tk) {
+		half[0].tn = half[1].tn = r->tn / 2;
+		half[1].c += (size_t) r->tm * half[1].tn * tile;
+		half[1].b += (size_t) r->tk * half[1].tn * tile;
+		half[1].col += half[1].tn;
+	} else {
+		half[0].tk = half[1].tk = r->tk / 2;
+		half[1].a += (size_t) r->tm * half[1].tk * tile;
+		half[1].b += (size_t) half[1].tk * r->tn * tile;
+		half[1].k += half[1].tk;
+		rec_mul(&half[0]);
+		rec_mul(&half[1]);
+		return;
+	}
+
+	half[0].depth = half[1].depth = r->depth + 1;
+	if (rec_pool == NULL || r->depth >= rec_spawn_depth) {
+		rec_mul(&half[0]);
+		rec_mul(&half[1]);
+		return;
+	}
+	pool_group_t g = POOL_GROUP_INIT;
+	pool_task_t task;
+	pool_spawn(rec_pool, &g, &task, rec_task, &half[1]);
+	rec_mul(&half[0]);
+	pool_wait(rec_pool, &g);
+}
+
+/**
+ * @brief Computes Cx = Ax * Bx cache-obliviously: converts A and B to
+ * Morton order, multiplies them recursively, and converts C back, all on
+ * the pool (or on the calling thread alone with --spawn).
+ *
+ * @return void
+ */
+void mm_recursive(void) {
+	rec_t top = { Cm.z, Am.z, Bm.z, 0, 0, 0, Cm.tile_rows, Cm.tile_cols,
+	              Am.tile_cols, 0 };
+
+	rec_pool = spawn_per_call ? NULL : pool;
+	/* enough tasks for every worker to steal a few */
+	rec_spawn_depth = 0;
+	while (rec_pool != NULL && rec_spawn_depth < 16 &&
+	       1L << rec_spawn_depth < 4L * n_threads)
+		rec_spawn_depth++;
+
+	if (rec_pool != NULL) {
+		pool_for(rec_pool, 0, morton_used(&Am), 4, morton_in, &Am);
+		pool_for(rec_pool, 0, morton_used(&Bm), 4, morton_in, &Bm);
+		pool_for(rec_pool, 0, morton_used(&Cm), 4, morton_zero, &Cm);
+		rec_mul(&top);
+		pool_for(rec_pool, 0, morton_used(&Cm), 4, morton_out, &Cm);
+	} else {
+		for (long i = 0; i < morton_used(&Am); i++)
+			morton_in(i, &Am);
+		for (long i = 0; i < morton_used(&Bm); i++)
+			morton_in(i, &Bm);
+		for (long i = 0; i < morton_used(&Cm); i++)
+			morton_zero(i, &Cm);
+		rec_mul(&top);
+		for (long i = 0; i < morton_used(&Cm); i++)
+			morton_out(i, &Cm);
+	}
+}
+
+/** @brief The engines, the default first */
+static const engine_t engines[] = {
+	{ "tiled", "Each thread owns a tile of C (no atomics)", mm_tile, false,
+	  false, NULL },
+	{ "atomic", "Each thread adds A*B over a block into C with atomics",
+	  mm_block, true, false, NULL },
+	{ "simd", "Tiles as tiled, by the SIMD micro-kernel (--type, --isa)",
+	  mm_simd, false, true, NULL },
+	{ "packed", "Tiles as simd, from panels packed into huge pages",
+	  mm_packed, false, true, NULL },
+	{ "recursive", "Cache-oblivious halving of Morton-ordered copies, "
+	  "by tasks", NULL, false, true, mm_recursive },
+};
+#define N_ENGINES (int) (sizeof(engines) / sizeof(engines[0]))
+
+/** @brief The engine mm_parallel runs */
+static const engine_t *engine = &engines[0];
+
+/**
+ * @brief Selects an engine by name.
+ *
+ * @param name The name of the engine.
+ *
+ * @return Zero on success or -1 if there is no such engine.
+ */
+int set_engine(const char *name) {
+	for (int i = 0; i < N_ENGINES; i++) {
+		if (strcmp(engines[i].name, name) == 0) {
+			engine = &engines[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
 /**
  * @brief Main routine for each thread we're using in the matrix
  * multiplication.
@@ -131,18 +741,60 @@ void mm_block(coord_t *block) {
  * then performs the matrix multiplication calculation on that sub block of
  * the larger matrix.
  *
- * @param arg Unused, here for pthread_create to type check.
+ * @param arg The index of the thread, used to file its hardware counters.
  *
  * @return NULL, also used for pthread_create to type check.
  */
 void *mm_thread_main(void *arg) {
+	int id = (int) (intptr_t) arg;
 	coord_t block;
+	perf_group_t g;
+	perf_counts_t c;
+
+	my_arena = &thread_arenas[id];
+#ifdef BENCH_RUNNER
+	bench_worker();
+#endif
+	if (use_counters)
+		perf_group_open(&g, 0, -1);
 	while (get_block(&block) >= 0) {
-		mm_block(&block);
+		engine->block(&block);
+	}
+	if (use_counters) {
+		perf_group_read(&g, &c);
+		perf_group_close(&g);
+		perf_counts_add(&thread_counts[id], &c);
 	}
 	return NULL;
 }
 
+/**
+ * @brief Computes one tile of C as a pool_for body, counting its events on
+ * the worker's hardware counters.
+ *
+ * @param i The index of the tile, row by row.
+ * @param arg Unused.
+ */
+void mm_pool_tile(long i, void *arg) {
+	int id = pool_worker_id();
+	coord_t tile = { i / grid_cols(), i % grid_cols() };
+	perf_counts_t c;
+	(void) arg;
+
+	my_arena = &thread_arenas[id];
+	if (!use_counters) {
+		engine->block(&tile);
+		return;
+	}
+	if (!worker_group_open[id])
+		worker_group_open[id] = perf_group_open(&worker_groups[id], 0,
+		                                        -1) == 0;
+	perf_group_reset(&worker_groups[id]);
+	engine->block(&tile);
+	perf_group_read(&worker_groups[id], &c);
+	perf_counts_add(&thread_counts[id], &c);
+}
+
 /**
  * @brief A brute force single threaded matrix multiply function used for
  * verification of the parallel solution.
@@ -150,19 +802,21 @@ void *mm_thread_main(void *arg) {
  * @return void
  */
 void mm_basic(void) {
-	for(int i = 0; i < SIZE * BLOCK; i++) {
-		for(int j = 0; j < SIZE * BLOCK; j++) {
-			C_sol[i][j] = 0;
-			for(int k = 0; k < SIZE * BLOCK; k++) {
-				C_sol[i][j] += A[i][k] * B[k][j];
+	for(int i = 0; i < dim_m; i++) {
+		for(int j = 0; j < dim_n; j++) {
+			int sum = 0;
+			for(int k = 0; k < dim_k; k++) {
+				sum += A[(long) i * dim_k + k] * B[(long) k * dim_n + j];
 			}
+			C_sol[(long) i * dim_n + j] = sum;
 		}
 	}
 }
 
 /**
- * @brief Runs the parallel matrix multiplication function with a defined
- * number of threads.
+ * @brief Runs the matrix multiplication on n_threads new threads, which claim
+ * blocks under next_location_lock (the way mm_parallel used to, for
+ * comparison).
  *
  * @note Each thread will claim a portion of the matrix to operate on, and will
  * return once it detects that there no more unclaimed portions. Once all
@@ -170,24 +824,65 @@ void mm_basic(void) {
  *
  * @return void
  */
-void mm_parallel(void) {
-	pthread_t *threads = malloc(THREADS * sizeof(pthread_t));
+void mm_spawn(void) {
+	pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
 	if (threads == NULL) {
 		dbg_printf("Error: malloc returned NULL.\n");
 		return;
 	}
 
-    for (int i = 0; i < THREADS; i++) {
-    	pthread_create(&threads[i], NULL, mm_thread_main, NULL);
+	/* every run starts from the first block */
+	next_location.row = 0;
+	next_location.col = 0;
+
+    for (int i = 0; i < n_threads; i++) {
+    	pthread_create(&threads[i], NULL, mm_thread_main, (void *) (intptr_t) i);
     }
 
-    for(int i = 0; i < THREADS; i++) {
+    for(int i = 0; i < n_threads; i++) {
     	pthread_join(threads[i], NULL);
     }
 
     free(threads);
 }
 
+/**
+ * @brief Runs the parallel matrix multiplication function with a defined
+ * number of threads.
+ *
+ * @note The tiles are split among the workers of a pool that outlives the
+ * run, by work stealing, so a run neither creates threads nor takes a lock.
+ *
+ * @return void
+ */
+void mm_parallel(void) {
+	/* a zero C to add into */
+	if (engine->accumulates)
+		memset(C, 0, (long) dim_m * dim_n * sizeof(int));
+
+	if (!spawn_per_call &&
+	    (pool == NULL || pool_workers(pool) != n_threads)) {
+		/* the counters of the old workers would count dead threads */
+		for (int i = 0; i < MAX_THREADS; i++) {
+			if (worker_group_open[i])
+				perf_group_close(&worker_groups[i]);
+			worker_group_open[i] = false;
+		}
+		if (pool != NULL)
+			pool_destroy(pool);
+		pool = pool_create(n_threads, 1);
+	}
+	if (engine->run != NULL) {
+		engine->run();
+	} else if (spawn_per_call || pool == NULL) {
+		mm_spawn();
+	} else {
+		pool_for(pool, 0, (long) grid_rows() * grid_cols(), 1, mm_pool_tile,
+		         NULL);
+	}
+	test_runs++;
+}
+
 /**
  * @brief Check that the parallel solution matches the brute force solution.
  *
@@ -195,19 +890,534 @@ void mm_parallel(void) {
  */
 void test_mm_parallel(void) {
 	mm_basic();
-	for(int i = 0; i < SIZE * BLOCK; i++) {
-		for(int j = 0; j < SIZE * BLOCK; j++) {
-			assert(C[i][j] == C_sol[i][j]);
+	for(int i = 0; i < dim_m; i++) {
+		for(int j = 0; j < dim_n; j++) {
+			if (engine->typed)
+				assert(typed_get(Cx, i, j) == C_sol[(long) i * dim_n + j]);
+			else
+				assert(C[(long) i * dim_n + j] == C_sol[(long) i * dim_n + j]);
 		}
 	}
 	dbg_printf("Success!\n");
 }
 
+/**
+ * @brief The rate of a product of the current shape.
+ *
+ * @param time The seconds it took.
+ *
+ * @return Its rate in GFLOP/s, counting a multiply and an add per term.
+ */
+double gflops(double time) {
+	return 2.0 * dim_m * dim_n * dim_k / time * 1e-9;
+}
+
 void time_mm_parallel(void) {
-	double time = func_time(mm_parallel, ERR_MAX);
-	double mbps = (MATRIX_SIZE_BYTES / time) / 10e3;
-	printf("THREADS=%d, BLOCK=%d, Size=%db x %db: %f Mbps (time=%lfms)\n",
-		THREADS, BLOCK, SIZE, SIZE, mbps, time * 10e3);
+	func_stats_t stats;
+	double time = func_time_stats(mm_parallel, ERR_MAX, FUNC_TRIALS, &stats);
+	if (engine->typed)
+		printf("%s (%s %s, %dx%d tiles): ", engine->name, kernel->isa,
+		       mm_type_name(elem_type), kernel->mr, kernel->nr);
+	else
+		printf("%s: ", engine->name);
+	if (spawn_per_call)
+		printf("(spawn) ");
+	printf("THREADS=%d, BLOCK=%d, Size=%dx%dx%d: %.2f GFLOP/s "
+		"(time=%lfms)\n", n_threads, block_size, dim_m, dim_n, dim_k,
+		gflops(time), time * 1e3);
+	printf("  ");
+	func_stats_print(stdout, &stats, 1e3, "ms");
+
+	for (int i = 0; use_counters && i < n_threads; i++) {
+		char label[32];
+		snprintf(label, sizeof(label), "  thread %d (per run)", i);
+		perf_counts_print(stdout, label, &thread_counts[i], 1.0 / test_runs);
+	}
+}
+
+/** @brief One product of the packing sweep: n x n matrices of elem_type */
+static struct {
+	int n;
+	bool pack;
+	char *a, *b, *c;
+	arena_t matrices;  /**< A, B and C, remapped for each size */
+	arena_t panels;    /**< mm_gemm's buffers, reused for every size */
+} sweep;
+
+/**
+ * @brief Allocates and fills the matrices of the packing sweep.
+ *
+ * @param n The number of elements per side.
+ *
+ * @return Zero on success or -1 if there is no memory or no kernel.
+ */
+int init_sweep(int n) {
+	size_t size, bytes;
+
+	kernel = mm_kernel_select(elem_type, kernel_isa);
+	if (kernel == NULL)
+		return -1;
+	size = mm_type_size(elem_type);
+	bytes = (size_t) n * n * size;
+	arena_destroy(&sweep.matrices);
+	if (arena_init(&sweep.matrices, 3 * bytes + 3 * 64) < 0)
+		return -1;
+	sweep.a = arena_alloc(&sweep.matrices, bytes, 64);
+	sweep.b = arena_alloc(&sweep.matrices, bytes, 64);
+	sweep.c = arena_alloc(&sweep.matrices, bytes, 64);
+	/*
+	 * grown, like init_workspaces, whenever a type or size needs more:
+	 * mm_gemm would quietly skip the packing in a workspace too small
+	 */
+	size_t need = mm_gemm_workspace(kernel, n, n);
+	if (sweep.panels.size < need) {
+		arena_destroy(&sweep.panels);
+		if (arena_init(&sweep.panels, need) < 0)
+			return -1;
+	}
+	sweep.n = n;
+	/* small enough that even n = 1024 sums are exact as floats */
+	for (long i = 0; i < (long) n * n; i++) {
+		switch (elem_type) {
+		case MM_FLOAT:
+			((float *) sweep.a)[i] = rand() % 16;
+			((float *) sweep.b)[i] = rand() % 16;
+			break;
+		case MM_DOUBLE:
+			((double *) sweep.a)[i] = rand() % 16;
+			((double *) sweep.b)[i] = rand() % 16;
+			break;
+		default:
+			((int32_t *) sweep.a)[i] = rand() % 16;
+			((int32_t *) sweep.b)[i] = rand() % 16;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Multiplies the sweep's matrices on one thread, packed or straight
+ * from A and B.
+ *
+ * @return void
+ */
+void mm_sweep(void) {
+	int n = sweep.n;
+	if (sweep.pack)
+		mm_gemm(kernel, n, n, n, sweep.a, n, sweep.b, n, sweep.c, n,
+		        &sweep.panels);
+	else
+		mm_kernel_run(kernel, n, n, n, sweep.a, n, sweep.b, n, sweep.c, n);
+}
+
+/**
+ * @brief Times mm_sweep unpacked and packed over pack_sizes, and checks
+ * that both give the same C.
+ *
+ * @return Zero on success or -1 if a size could not be set up.
+ */
+int time_packing(void) {
+	mm_blocking_t bl;
+
+	printf("packing (%s %s, %dx%d tiles", kernel->isa,
+	       mm_type_name(elem_type), kernel->mr, kernel->nr);
+	mm_blocking(kernel, &bl);
+	printf(", mc=%d kc=%d nc=%d):\n", bl.mc, bl.kc, bl.nc);
+	printf("%6s %14s %14s %8s\n", "n", "unpacked GF/s", "packed GF/s",
+	       "speedup");
+	for (int s = 0; s < N_PACK_SIZES; s++) {
+		int n = pack_sizes[s];
+		double flops = 2.0 * n * n * n;
+		double t[2];
+		func_stats_t stats;
+		if (init_sweep(n) < 0)
+			return -1;
+		size_t bytes = (size_t) n * n * mm_type_size(elem_type);
+		char *unpacked = malloc(bytes);
+		for (int p = 0; p < 2; p++) {
+			sweep.pack = p;
+			t[p] = func_time_stats(mm_sweep, ERR_MAX, 5, &stats);
+			if (p == 0 && unpacked != NULL)
+				memcpy(unpacked, sweep.c, bytes);
+		}
+		if (unpacked != NULL && memcmp(unpacked, sweep.c, bytes) != 0)
+			printf("  packed and unpacked C differ at n=%d!\n", n);
+		free(unpacked);
+		printf("%6d %14.2f %14.2f %7.2fx\n", n, flops / t[0] * 1e-9,
+		       flops / t[1] * 1e-9, t[0] / t[1]);
+	}
+	return 0;
+}
+
+/**
+ * @brief Sets the block size and the thread count, and gives the threads
+ * the panel buffers such blocks need.
+ *
+ * @param block The side of the blocks.
+ * @param threads The number of threads.
+ *
+ * @return Zero on success or -1 if either is out of range or there is no
+ * memory.
+ */
+int set_config(int block, int threads) {
+	if (block < 1 || block > MAX_BLOCK || threads < 1 ||
+	    threads > MAX_THREADS)
+		return -1;
+	block_size = block;
+	n_threads = threads;
+	return kernel != NULL ? init_workspaces() : 0;
+}
+
+/** @brief The most configurations a tuning file holds */
+#define MAX_TUNINGS 256
+
+/** @brief The best configuration of an engine for one shape */
+typedef struct {
+	char engine[16];
+	char type[16];  /**< elem_type, or "-" for the int-only engines */
+	char isa[16];   /**< kernel_isa, "best" or "-" likewise */
+	int m, n, k;
+	int block, threads;
+	double gflops;  /**< what it ran at when tuned */
+} tuning_t;
+
+/**
+ * @brief Fills in the key of a tuning: the engine, its type and instruction
+ * set, and the shape, as they are now.
+ *
+ * @param t The tuning.
+ */
+void tuning_key(tuning_t *t) {
+	memset(t, 0, sizeof(*t));
+	snprintf(t->engine, sizeof(t->engine), "%s", engine->name);
+	snprintf(t->type, sizeof(t->type), "%s",
+	         engine->typed ? mm_type_name(elem_type) : "-");
+	snprintf(t->isa, sizeof(t->isa), "%s", !engine->typed ? "-" :
+	         kernel_isa != NULL ? kernel_isa : "best");
+	t->m = dim_m;
+	t->n = dim_n;
+	t->k = dim_k;
+}
+
+/**
+ * @brief Whether two tunings are for the same engine and shape.
+ */
+static bool tuning_match(const tuning_t *a, const tuning_t *b) {
+	return strcmp(a->engine, b->engine) == 0 &&
+	       strcmp(a->type, b->type) == 0 && strcmp(a->isa, b->isa) == 0 &&
+	       a->m == b->m && a->n == b->n && a->k == b->k;
+}
+
+/**
+ * @brief Loads the tunings of a file written by --autotune.
+ *
+ * @param path The file.
+ * @param t An array of MAX_TUNINGS tunings to fill in.
+ *
+ * @return The number of tunings, or -1 if the file cannot be read.
+ */
+int load_tunings(const char *path, tuning_t *t) {
+	char line[256], machine[ENV_MACHINE_LEN];
+	env_t env;
+	int n = 0;
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	env_capture(&env);
+	env_machine(&env, machine, sizeof(machine));
+	while (fgets(line, sizeof(line), f) != NULL && n < MAX_TUNINGS) {
+		if (strncmp(line, "# machine: ", 11) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			if (strcmp(line + 11, machine) != 0)
+				fprintf(stderr, "Warning: %s was tuned on another "
+				        "machine:\n  %s\n", path, line + 11);
+			continue;
+		}
+		if (sscanf(line, "%15[^,],%15[^,],%15[^,],%d,%d,%d,%d,%d,%lf",
+		           t[n].engine, t[n].type, t[n].isa, &t[n].m, &t[n].n,
+		           &t[n].k, &t[n].block, &t[n].threads,
+		           &t[n].gflops) == 9)
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/**
+ * @brief Records a tuning in a file, replacing any for the same engine and
+ * shape.
+ *
+ * @param path The file.
+ * @param best The tuning.
+ *
+ * @return Zero on success or -1 if the file cannot be written.
+ */
+int save_tuning(const char *path, const tuning_t *best) {
+	static tuning_t t[MAX_TUNINGS];
+	char machine[ENV_MACHINE_LEN];
+	env_t env;
+	int n = load_tunings(path, t);
+	FILE *f;
+
+	if (n < 0)
+		n = 0;
+	for (int i = 0; i < n; i++) {
+		if (tuning_match(&t[i], best)) {
+			t[i--] = t[--n];
+		}
+	}
+	if (n == MAX_TUNINGS)
+		n--;
+	t[n++] = *best;
+
+	f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	env_capture(&env);
+	env_machine(&env, machine, sizeof(machine));
+	fprintf(f, "# machine: %s\n", machine);
+	fprintf(f, "engine,type,isa,m,n,k,block,threads,gflops\n");
+	for (int i = 0; i < n; i++)
+		fprintf(f, "%s,%s,%s,%d,%d,%d,%d,%d,%.3f\n", t[i].engine,
+		        t[i].type, t[i].isa, t[i].m, t[i].n, t[i].k, t[i].block,
+		        t[i].threads, t[i].gflops);
+	fclose(f);
+	return 0;
+}
+
+/**
+ * @brief Uses the configuration a tuning file holds for the current engine
+ * and shape, if it has one.
+ *
+ * @param path The file.
+ *
+ * @return Zero if a configuration was applied or -1 if there is none.
+ */
+int apply_tuning(const char *path) {
+	static tuning_t t[MAX_TUNINGS];
+	tuning_t key;
+	int n = load_tunings(path, t);
+
+	tuning_key(&key);
+	for (int i = 0; i < n; i++) {
+		if (tuning_match(&t[i], &key) &&
+		    set_config(t[i].block, t[i].threads) == 0) {
+			printf("# tuned: block=%d threads=%d (%.2f GFLOP/s in %s)\n",
+			       t[i].block, t[i].threads, t[i].gflops, path);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Times the current engine and shape for every block size and
+ * thread count worth trying, keeps the fastest, and records it in a tuning
+ * file.
+ *
+ * @note Thread counts are the powers of two up to twice the CPUs, and the
+ * number of CPUs; blocks are the powers of two from 8 up to the one that
+ * covers C. A thread count larger than the number of blocks is skipped,
+ * since the extra threads would have nothing to do. Engines that run the
+ * whole product themselves (recursive) have no blocks: only their thread
+ * count is searched, and the block size is kept.
+ *
+ * @param path The tuning file.
+ *
+ * @return Zero on success or -1 if a configuration could not be set up.
+ */
+int autotune(const char *path) {
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int counts[32], n_counts = 0;
+	tuning_t best;
+	func_stats_t stats;
+
+	if (n_cpus < 1)
+		n_cpus = 1;
+	for (int t = 1; t <= 2 * n_cpus && t <= MAX_THREADS; t *= 2) {
+		if (t / 2 < n_cpus && n_cpus < t && n_cpus <= MAX_THREADS)
+			counts[n_counts++] = n_cpus;
+		counts[n_counts++] = t;
+	}
+
+	tuning_key(&best);
+	printf("autotune %s, %dx%dx%d:\n%6s %8s %10s\n", engine->name, dim_m,
+	       dim_n, dim_k, "block", "threads", "GFLOP/s");
+	bool blocked = engine->run == NULL;
+	for (int b = blocked ? 8 : block_size; b <= MAX_BLOCK; b *= 2) {
+		for (int c = 0; c < n_counts; c++) {
+			if (set_config(b, counts[c]) < 0)
+				return -1;
+			if (blocked && counts[c] > (long) grid_rows() * grid_cols())
+				break;
+			double rate = gflops(func_time_stats(mm_parallel, ERR_MAX,
+			                                     TUNE_TRIALS, &stats));
+			printf("%6d %8d %10.2f\n", b, counts[c], rate);
+			if (rate > best.gflops) {
+				best.block = b;
+				best.threads = counts[c];
+				best.gflops = rate;
+			}
+		}
+		/* a single block: larger ones would all be the same */
+		if (!blocked || (grid_rows() == 1 && grid_cols() == 1))
+			break;
+	}
+	if (set_config(best.block, best.threads) < 0)
+		return -1;
+	printf("best: block=%d threads=%d, %.2f GFLOP/s\n", best.block,
+	       best.threads, best.gflops);
+	if (save_tuning(path, &best) < 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef BENCH_RUNNER
+/**
+ * @brief Sets the shape, block size and thread count of a benchmark from
+ * its parameters, and allocates its matrices.
+ *
+ * @param ctx The benchmark.
+ *
+ * @return Zero on success or -1 on a bad parameter or no memory.
+ */
+static int bench_shape(bench_ctx_t *ctx) {
+	dim_m = dim_n = dim_k = bench_param_long(ctx, "size", DEFAULT_SIZE);
+	if (dim_m < 1 || set_config(bench_param_long(ctx, "block",
+	        DEFAULT_BLOCK), bench_param_long(ctx, "threads",
+	        DEFAULT_THREADS)) < 0) {
+		fprintf(stderr, "mmt: bad size, block or threads.\n");
+		return -1;
+	}
+	return init_matrices();
+}
+
+BENCH(bench_mm_simd, "mmt/simd",
+      "type=int32|float|double isa=best|scalar size=128 block=16 threads=32") {
+	const char *isa = bench_param(ctx, "isa", "best");
+	int type = mm_type_parse(bench_param(ctx, "type", "int32"));
+	if (type < 0) {
+		fprintf(stderr, "mmt: unknown type.\n");
+		return;
+	}
+	elem_type = type;
+	kernel_isa = strcmp(isa, "best") == 0 ? NULL : isa;
+	set_engine("simd");
+	if (bench_shape(ctx) < 0)
+		return;
+	if (select_kernel() < 0) {
+		fprintf(stderr, "mmt: this CPU lacks %s.\n", isa);
+		return;
+	}
+	if (init_typed() < 0) {
+		fprintf(stderr, "mmt: cannot set up the matrices.\n");
+		return;
+	}
+	bench_time(ctx, "time", mm_parallel);
+}
+
+/* sizes that are not multiples of the blocks nor of the Morton tiles */
+BENCH(bench_mm_oblivious, "mmt/oblivious",
+      "engine=packed|recursive size=100|333|1000 type=float block=64 "
+      "threads=32") {
+	int type = mm_type_parse(bench_param(ctx, "type", "float"));
+	if (type < 0 || set_engine(bench_param(ctx, "engine", "recursive")) < 0) {
+		fprintf(stderr, "mmt: unknown type or engine.\n");
+		return;
+	}
+	elem_type = type;
+	kernel_isa = NULL;
+	if (bench_shape(ctx) < 0)
+		return;
+	if (select_kernel() < 0 || init_typed() < 0 ||
+	    (engine->run == mm_recursive && init_morton() < 0)) {
+		fprintf(stderr, "mmt: cannot set up the matrices.\n");
+		return;
+	}
+	bench_time(ctx, "time", mm_parallel);
+}
+
+BENCH(bench_mm_packing, "mmt/packing",
+      "n=128|256|512|1024 pack=no|yes type=float") {
+	int type = mm_type_parse(bench_param(ctx, "type", "float"));
+	if (type < 0) {
+		fprintf(stderr, "mmt: unknown type.\n");
+		return;
+	}
+	elem_type = type;
+	kernel_isa = NULL;
+	sweep.pack = strcmp(bench_param(ctx, "pack", "yes"), "yes") == 0;
+	if (init_sweep(bench_param_long(ctx, "n", 256)) < 0) {
+		fprintf(stderr, "mmt: cannot set up the matrices.\n");
+		return;
+	}
+	bench_time(ctx, "time", mm_sweep);
+}
+
+BENCH(bench_mm_parallel, "mmt/parallel",
+      "engine=tiled|atomic sched=pool|spawn size=128 block=16 threads=32") {
+	spawn_per_call = strcmp(bench_param(ctx, "sched", "pool"), "spawn") == 0;
+	if (set_engine(bench_param(ctx, "engine", "tiled")) < 0) {
+		fprintf(stderr, "mmt: unknown engine.\n");
+		return;
+	}
+	if (bench_shape(ctx) < 0)
+		return;
+	bench_time(ctx, "time", mm_parallel);
+}
+#else
+/**
+ * @brief Picks the micro-kernel and sets up the typed matrices, the first
+ * time an engine needs them.
+ *
+ * @return Zero on success or -1 if the CPU lacks the instruction set or
+ * there is no memory.
+ */
+int setup_typed(void) {
+	if (kernel != NULL)
+		return 0;
+	if (select_kernel() < 0) {
+		fprintf(stderr, "This CPU lacks %s.\n", kernel_isa);
+		return -1;
+	}
+	if (init_typed() < 0) {
+		kernel = NULL;
+		fprintf(stderr, "Not enough memory for the %s matrices.\n",
+		        mm_type_name(elem_type));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Parses the shape of --size: M for square matrices, or MxNxK for
+ * C[M][N] = A[M][K] * B[K][N].
+ *
+ * @param arg The value of --size.
+ *
+ * @return Zero on success or -1 if it is malformed.
+ */
+int parse_size(const char *arg) {
+	int m, n, k;
+	char end;
+	switch (sscanf(arg, "%dx%dx%d%c", &m, &n, &k, &end)) {
+	case 1:
+		n = k = m;
+		break;
+	case 3:
+		break;
+	default:
+		return -1;
+	}
+	if (m < 1 || n < 1 || k < 1)
+		return -1;
+	dim_m = m;
+	dim_n = n;
+	dim_k = k;
+	return 0;
 }
 
 /**
@@ -215,12 +1425,107 @@ void time_mm_parallel(void) {
  * for them to all finish.
  *
  * @param argc The argc
- * @param argv The argv
+ * @param argv The argv; --counters reports hardware counters per thread,
+ * --engine=name picks the engine (--all times each), --type=int32|float|double
+ * and --isa=avx512|avx2|sse4|scalar the element type and instruction set
+ * of the simd and packed engines (by default the best the CPU has), and
+ * --packing times packed against unpacked products of growing size instead,
+ * and --spawn creates the threads on every run instead of keeping a pool.
+ * --size=M[xNxK] sets the shape, and --block and --threads the block side
+ * and thread count; without them, those of the tuning file (--tune-file,
+ * mmt.tune by default) for the engine and shape are used, which
+ * --autotune searches for and writes there.
  *
- * @return { description_of_the_return_value }
+ * @return Zero on success or -1 on a bad argument.
  */
 int main(int argc, char *argv[]) {
-    init_matrices();
-    time_mm_parallel();
+    env_t env;
+    bool all = false, packing = false, tune = false, explicit_config = false;
+    const char *tune_path = TUNE_FILE;
+    int block = DEFAULT_BLOCK, threads = DEFAULT_THREADS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--counters") == 0) {
+            use_counters = 1;
+        } else if (strcmp(argv[i], "--all") == 0) {
+            all = true;
+        } else if (strcmp(argv[i], "--spawn") == 0) {
+            spawn_per_call = true;
+        } else if (strcmp(argv[i], "--packing") == 0) {
+            packing = true;
+        } else if (strcmp(argv[i], "--autotune") == 0) {
+            tune = true;
+        } else if (strncmp(argv[i], "--tune-file=", 12) == 0) {
+            tune_path = argv[i] + 12;
+        } else if (strncmp(argv[i], "--block=", 8) == 0 &&
+                   atoi(argv[i] + 8) > 0 && atoi(argv[i] + 8) <= MAX_BLOCK) {
+            block = atoi(argv[i] + 8);
+            explicit_config = true;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0 &&
+                   atoi(argv[i] + 10) > 0 &&
+                   atoi(argv[i] + 10) <= MAX_THREADS) {
+            threads = atoi(argv[i] + 10);
+            explicit_config = true;
+        } else if (strncmp(argv[i], "--size=", 7) == 0 &&
+                   parse_size(argv[i] + 7) == 0) {
+            continue;
+        } else if (strncmp(argv[i], "--type=", 7) == 0 &&
+                   mm_type_parse(argv[i] + 7) >= 0) {
+            elem_type = mm_type_parse(argv[i] + 7);
+        } else if (strncmp(argv[i], "--isa=", 6) == 0) {
+            kernel_isa = argv[i] + 6;
+        } else if (strncmp(argv[i], "--engine=", 9) != 0 ||
+                   set_engine(argv[i] + 9) < 0) {
+            fprintf(stderr, "Usage: %s [--counters] [--spawn] [--all | "
+                    "--engine=name | --packing]\n"
+                    "\t[--type=int32|float|double] "
+                    "[--isa=avx512|avx2|sse4|scalar]\n"
+                    "\t[--size=M[xNxK]] [--block=B] [--threads=T] "
+                    "[--autotune] [--tune-file=FILE]\n", argv[0]);
+            for (int e = 0; e < N_ENGINES; e++)
+                fprintf(stderr, "\t%-10s %s\n", engines[e].name,
+                        engines[e].description);
+            return -1;
+        }
+    }
+    env_capture(&env);
+    env_print(stdout, &env);
+    if (packing) {
+        if (select_kernel() < 0) {
+            fprintf(stderr, "This CPU lacks %s.\n", kernel_isa);
+            return -1;
+        }
+        return time_packing();
+    }
+    if (init_matrices() < 0)
+        return -1;
+    for (int e = 0; e < N_ENGINES; e++) {
+        if (all)
+            engine = &engines[e];
+        else if (e > 0)
+            break;
+        /* --isa only matters, and can only fail, for the typed engines */
+        if (engine->typed && setup_typed() < 0)
+            return -1;
+        if (engine->run == mm_recursive && init_morton() < 0) {
+            fprintf(stderr, "Not enough memory for the Morton copies.\n");
+            return -1;
+        }
+        /* each engine has its own tuning */
+        if (set_config(block, threads) < 0)
+            return -1;
+        if (!explicit_config && !tune)
+            apply_tuning(tune_path);
+        memset(thread_counts, 0, sizeof(thread_counts));
+        test_runs = 0;
+        if (tune) {
+            if (autotune(tune_path) < 0)
+                return -1;
+        } else {
+            time_mm_parallel();
+        }
+        /* the timed runs left C = A * B */
+        test_mm_parallel();
+    }
     return 0;
 }
+#endif /* BENCH_RUNNER */
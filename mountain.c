@@ -1,7 +1,22 @@
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include "perf.h"
+#include "env.h"
+#ifdef BENCH_RUNNER
+#include "bench.h"
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -16,9 +31,47 @@
 #define STRIDE_MAX    32
 #define LOGSIZE_MIN   10     // Should be at least sizeof(uint64_t)
 #define LOGSIZE_MAX   30
+#define CHASE_LOADS   4096   // Dependent loads per call in latency mode
+#define MAX_THREADS   256
+#define MAX_NODES     64
+#define PAGE_4K       4096   // Unit of the stride in TLB mode
+#define LINE_SIZE     64
+#define PAGE_WORDS    (PAGE_4K / sizeof(data_t))
+#define PREFETCH_DIST 16     // Default software prefetch distance (accesses)
+#define MAX_PREFETCH_DIST 4096
+
+// Adaptive sweep (--adaptive)
+#define CI_TARGET     0.02   // Stop sampling at a 95% CI of +/- 2% of the mean
+#define MIN_SAMPLES   3
+#define MAX_SAMPLES   30
+#define CLIFF         0.15   // Refine between neighbours differing by 15%
+#define LOGSIZE_STEP  0.25   // Finest logsize refinement
+
+// From linux/mman.h, which conflicts with sys/mman.h on older glibc
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB  (21 << 26)
+#define MAP_HUGE_1GB  (30 << 26)
+#endif
 
 typedef double data_t;
 
+enum {
+  MODE_SIMPLE,
+  MODE_BETTER,
+  MODE_LATENCY,
+  MODE_TLB
+};
+
+const char *mode_names[] = { "simple", "better", "latency", "tlb" };
+
+enum {
+  FORMAT_TEXT,
+  FORMAT_CSV,
+  FORMAT_JSON
+};
+
+const char *format_names[] = { "text", "csv", "json" };
+
 ////////////////////////////////////////////////////////////////////////////////
 
 // Simple timer functions
@@ -27,6 +80,12 @@ typedef struct timespec timespec;
 
 typedef void (*test_funct)(void);
 
+// The adaptive sweep gets its precision from repeated samples instead
+long min_repeat = MIN_REPEAT;
+
+// Kernel calls since the counters were last reset
+__thread long calls_made;
+
 // Clock resolution (should be about one microsecond)
 double delta;
 void init_delta() {
@@ -41,14 +100,15 @@ double timespec_diff(timespec *start, timespec *end) {
   return sec_diff + nsec_diff * 1e-9;
 }
 
-double func_time(test_funct f, double tolerance) {
+double time_kernel(test_funct f, double tolerance) {
   timespec start, end;
   double elapsed;
-  long n = MIN_REPEAT;
+  long n = min_repeat;
   while(1) {
     clock_gettime(CLOCK_ID, &start);
     for(long i = 0; i < n; i++) { f(); }
     clock_gettime(CLOCK_ID, &end);
+    calls_made += n;
     elapsed = timespec_diff(&start, &end);
     if(elapsed >= delta / tolerance) { break; }
     n *= 2;
@@ -58,9 +118,10 @@ double func_time(test_funct f, double tolerance) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-data_t *data;     // Data (has to be large enough)
-long size_param;    // Size of the array (in Bytes)
-long stride_param;  // Stride (in words of 8 Bytes)
+// Thread-local so that every worker of a multi-threaded run has its own slice
+__thread data_t *data;     // Data (has to be large enough)
+__thread long size_param;    // Size of the array (in Bytes)
+__thread long stride_param;  // Stride (in words of 8 Bytes)
 
 // Loads size/stride bytes of memory
 void test_simple() {
@@ -74,6 +135,620 @@ void test_simple() {
   sink = result; // So compiler does not optimize away the loop
 }
 
+// The 'better' read kernel. The simple loop above is bound by the latency of
+// its single add chain, so it cannot keep enough loads in flight to saturate
+// L1 or L2. We break the chain into independent accumulators and, for unit
+// strides, use the widest vector loads the CPU supports (picked at runtime).
+
+#define N_ACCUMULATORS 8
+
+// Scalar fallback, also used for every stride > 1
+data_t read_unrolled(const data_t *src, long n, long stride) {
+  data_t acc[N_ACCUMULATORS] = { 0 };
+  long step = stride * N_ACCUMULATORS;
+  long i = 0;
+  for (; i + step <= n; i += step) {
+    for (int k = 0; k < N_ACCUMULATORS; k++) {
+      acc[k] += src[i + k * stride];
+    }
+  }
+  for (; i < n; i += stride) {
+    acc[0] += src[i];
+  }
+  data_t result = 0;
+  for (int k = 0; k < N_ACCUMULATORS; k++) result += acc[k];
+  return result;
+}
+
+data_t read_scalar(const data_t *src, long n) {
+  return read_unrolled(src, n, 1);
+}
+
+__attribute__((target("sse2")))
+data_t read_sse2(const data_t *src, long n) {
+  __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+  __m128d a2 = _mm_setzero_pd(), a3 = _mm_setzero_pd();
+  long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    a0 = _mm_add_pd(a0, _mm_load_pd(src + i));
+    a1 = _mm_add_pd(a1, _mm_load_pd(src + i + 2));
+    a2 = _mm_add_pd(a2, _mm_load_pd(src + i + 4));
+    a3 = _mm_add_pd(a3, _mm_load_pd(src + i + 6));
+  }
+  a0 = _mm_add_pd(_mm_add_pd(a0, a1), _mm_add_pd(a2, a3));
+  double lanes[2];
+  _mm_storeu_pd(lanes, a0);
+  data_t result = lanes[0] + lanes[1];
+  for (; i < n; i++) result += src[i];
+  return result;
+}
+
+__attribute__((target("avx2")))
+data_t read_avx2(const data_t *src, long n) {
+  __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+  __m256d a2 = _mm256_setzero_pd(), a3 = _mm256_setzero_pd();
+  long i = 0;
+  for (; i + 16 <= n; i += 16) {
+    a0 = _mm256_add_pd(a0, _mm256_load_pd(src + i));
+    a1 = _mm256_add_pd(a1, _mm256_load_pd(src + i + 4));
+    a2 = _mm256_add_pd(a2, _mm256_load_pd(src + i + 8));
+    a3 = _mm256_add_pd(a3, _mm256_load_pd(src + i + 12));
+  }
+  a0 = _mm256_add_pd(_mm256_add_pd(a0, a1), _mm256_add_pd(a2, a3));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, a0);
+  data_t result = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  for (; i < n; i++) result += src[i];
+  return result;
+}
+
+__attribute__((target("avx512f")))
+data_t read_avx512(const data_t *src, long n) {
+  __m512d a0 = _mm512_setzero_pd(), a1 = _mm512_setzero_pd();
+  __m512d a2 = _mm512_setzero_pd(), a3 = _mm512_setzero_pd();
+  long i = 0;
+  for (; i + 32 <= n; i += 32) {
+    a0 = _mm512_add_pd(a0, _mm512_load_pd(src + i));
+    a1 = _mm512_add_pd(a1, _mm512_load_pd(src + i + 8));
+    a2 = _mm512_add_pd(a2, _mm512_load_pd(src + i + 16));
+    a3 = _mm512_add_pd(a3, _mm512_load_pd(src + i + 24));
+  }
+  a0 = _mm512_add_pd(_mm512_add_pd(a0, a1), _mm512_add_pd(a2, a3));
+  data_t result = _mm512_reduce_add_pd(a0);
+  for (; i < n; i++) result += src[i];
+  return result;
+}
+
+// Write kernels. Strided versions serve the simple mode and every stride > 1;
+// the vector versions below serve unit strides in the better mode.
+
+void store_strided(data_t *dst, long n, long stride) {
+  for (long i = 0; i < n; i += stride) {
+    dst[i] = 1.0;
+  }
+}
+
+void copy_strided(data_t *dst, const data_t *src, long n, long stride) {
+  for (long i = 0; i < n; i += stride) {
+    dst[i] = src[i];
+  }
+}
+
+void rmw_strided(data_t *dst, long n, long stride) {
+  for (long i = 0; i < n; i += stride) {
+    dst[i] += 1.0;
+  }
+}
+
+// Non-temporal stores bypass the caches, and so skip the read for ownership
+// that an ordinary store miss costs
+void stream_strided(data_t *dst, long n, long stride) {
+  long long one;
+  data_t value = 1.0;
+  memcpy(&one, &value, sizeof(one));
+  for (long i = 0; i < n; i += stride) {
+    _mm_stream_si64((long long *) &dst[i], one);
+  }
+  _mm_sfence();
+}
+
+void store_scalar(data_t *dst, long n) { store_strided(dst, n, 1); }
+void copy_scalar(data_t *dst, const data_t *src, long n) {
+  copy_strided(dst, src, n, 1);
+}
+void rmw_scalar(data_t *dst, long n) { rmw_strided(dst, n, 1); }
+void stream_scalar(data_t *dst, long n) { stream_strided(dst, n, 1); }
+
+// Unit-stride write kernels for one vector width
+#define VECTOR_WRITE_KERNELS(isa, target_isa, vec_t, width,                  \
+                             load, store, stream, add, set1)                 \
+  __attribute__((target(target_isa)))                                        \
+  void store_##isa(data_t *dst, long n) {                                    \
+    vec_t v = set1(1.0);                                                     \
+    long i = 0;                                                              \
+    for (; i + width <= n; i += width) store(dst + i, v);                    \
+    for (; i < n; i++) dst[i] = 1.0;                                         \
+  }                                                                          \
+  __attribute__((target(target_isa)))                                        \
+  void copy_##isa(data_t *dst, const data_t *src, long n) {                  \
+    long i = 0;                                                              \
+    for (; i + width <= n; i += width) store(dst + i, load(src + i));        \
+    for (; i < n; i++) dst[i] = src[i];                                      \
+  }                                                                          \
+  __attribute__((target(target_isa)))                                        \
+  void rmw_##isa(data_t *dst, long n) {                                      \
+    vec_t one = set1(1.0);                                                   \
+    long i = 0;                                                              \
+    for (; i + width <= n; i += width) store(dst + i, add(load(dst + i), one)); \
+    for (; i < n; i++) dst[i] += 1.0;                                        \
+  }                                                                          \
+  __attribute__((target(target_isa)))                                        \
+  void stream_##isa(data_t *dst, long n) {                                   \
+    vec_t v = set1(1.0);                                                     \
+    long i = 0;                                                              \
+    for (; i + width <= n; i += width) stream(dst + i, v);                   \
+    for (; i < n; i++) dst[i] = 1.0;                                         \
+    _mm_sfence();                                                            \
+  }
+
+VECTOR_WRITE_KERNELS(sse2, "sse2", __m128d, 2, _mm_load_pd, _mm_store_pd,
+                     _mm_stream_pd, _mm_add_pd, _mm_set1_pd)
+VECTOR_WRITE_KERNELS(avx2, "avx2", __m256d, 4, _mm256_load_pd,
+                     _mm256_store_pd, _mm256_stream_pd, _mm256_add_pd,
+                     _mm256_set1_pd)
+VECTOR_WRITE_KERNELS(avx512, "avx512f", __m512d, 8, _mm512_load_pd,
+                     _mm512_store_pd, _mm512_stream_pd, _mm512_add_pd,
+                     _mm512_set1_pd)
+
+// The unit-stride kernels of one instruction set
+typedef struct {
+  const char *name;
+  data_t (*read)(const data_t *src, long n);
+  void (*store)(data_t *dst, long n);
+  void (*copy)(data_t *dst, const data_t *src, long n);
+  void (*rmw)(data_t *dst, long n);
+  void (*stream)(data_t *dst, long n);
+} isa_kernels_t;
+
+#define ISA_KERNELS(name, isa) \
+  { name, read_##isa, store_##isa, copy_##isa, rmw_##isa, stream_##isa }
+
+const isa_kernels_t isa_avx512 = ISA_KERNELS("AVX-512", avx512);
+const isa_kernels_t isa_avx2   = ISA_KERNELS("AVX2", avx2);
+const isa_kernels_t isa_sse2   = ISA_KERNELS("SSE2", sse2);
+const isa_kernels_t isa_scalar = ISA_KERNELS("scalar", scalar);
+
+const isa_kernels_t *isa = &isa_scalar;
+
+// Picks the widest vector kernels supported by this CPU (and OS)
+const char *select_isa() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    isa = &isa_avx512;
+  }
+  else if (__builtin_cpu_supports("avx2")) {
+    isa = &isa_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    isa = &isa_sse2;
+  }
+  else {
+    isa = &isa_scalar;
+  }
+  return isa->name;
+}
+
+// Loads size/stride words of memory, as fast as the hardware allows
+void test_better() {
+  long n = size_param / sizeof(data_t);
+  volatile data_t sink __attribute__((unused));
+  if (stride_param == 1) {
+    sink = isa->read(data, n);
+  }
+  else {
+    sink = read_unrolled(data, n, stride_param);
+  }
+}
+
+// Stores size/stride words of memory
+void test_store() {
+  store_strided(data, size_param / sizeof(data_t), stride_param);
+}
+
+void test_store_better() {
+  long n = size_param / sizeof(data_t);
+  if (stride_param == 1) isa->store(data, n);
+  else store_strided(data, n, stride_param);
+}
+
+// Words in each half of the working set for the copy kernels: a multiple of
+// 64 bytes, since a thread's slice or an adaptive size need not be one and
+// the vector stores into the second half are aligned
+long copy_half() {
+  return size_param / sizeof(data_t) / 2 / (64 / sizeof(data_t)) *
+    (64 / sizeof(data_t));
+}
+
+// Copies the first half of the working set into the second half
+void test_copy() {
+  long half = copy_half();
+  copy_strided(data + half, data, half, stride_param);
+}
+
+void test_copy_better() {
+  long half = copy_half();
+  if (stride_param == 1) isa->copy(data + half, data, half);
+  else copy_strided(data + half, data, half, stride_param);
+}
+
+// Loads and stores back size/stride words of memory
+void test_rmw() {
+  rmw_strided(data, size_param / sizeof(data_t), stride_param);
+}
+
+void test_rmw_better() {
+  long n = size_param / sizeof(data_t);
+  if (stride_param == 1) isa->rmw(data, n);
+  else rmw_strided(data, n, stride_param);
+}
+
+// Stores size/stride words of memory with non-temporal (movnt*) stores
+void test_stream() {
+  stream_strided(data, size_param / sizeof(data_t), stride_param);
+}
+
+void test_stream_better() {
+  long n = size_param / sizeof(data_t);
+  if (stride_param == 1) isa->stream(data, n);
+  else stream_strided(data, n, stride_param);
+}
+
+// Access patterns that the hardware prefetchers cannot follow, as in hash
+// probes and tree walks. The page-structured patterns visit the words at
+// offsets 0, stride, 2*stride... of each 4 KiB page, which is the same set as
+// the forward loop whenever the stride divides 512.
+
+// Words per page and accesses per page for the page-structured patterns
+long page_words(long n) { return n < (long) PAGE_WORDS ? n : PAGE_WORDS; }
+
+long page_accesses(long n, long stride) {
+  long per_page = page_words(n) / stride;
+  return per_page > 0 ? per_page : 1;
+}
+
+// Loads size/stride words of memory, from the end of the array backwards
+void test_reverse() {
+  long n = size_param / sizeof(data_t);
+  long stride = stride_param;
+  data_t result = 0;
+  volatile data_t sink __attribute__((unused));
+  for (long i = (n - 1) / stride * stride; i >= 0; i -= stride) {
+    result += data[i];
+  }
+  sink = result;
+}
+
+void test_reverse_better() {
+  long n = size_param / sizeof(data_t);
+  long stride = stride_param;
+  data_t a0 = 0, a1 = 0, a2 = 0, a3 = 0, a4 = 0, a5 = 0, a6 = 0, a7 = 0;
+  volatile data_t sink __attribute__((unused));
+  long i = (n - 1) / stride * stride;
+  for (; i >= 7 * stride; i -= 8 * stride) {
+    a0 += data[i];              a1 += data[i - stride];
+    a2 += data[i - 2 * stride]; a3 += data[i - 3 * stride];
+    a4 += data[i - 4 * stride]; a5 += data[i - 5 * stride];
+    a6 += data[i - 6 * stride]; a7 += data[i - 7 * stride];
+  }
+  for (; i >= 0; i -= stride) a0 += data[i];
+  sink = a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7;
+}
+
+// Offsets (in words) visited within each page by page-random, in a random
+// order that is rebuilt whenever the stride or the size changes (below a
+// page, the size bounds the offsets)
+__thread long page_order[PAGE_WORDS];
+__thread long page_order_len, page_order_n, page_order_stride;
+
+uint64_t rng_next();
+
+void build_page_order(long n, long stride) {
+  page_order_len = page_accesses(n, stride);
+  for (long j = 0; j < page_order_len; j++) page_order[j] = j * stride;
+  for (long j = page_order_len - 1; j > 0; j--) {
+    long k = rng_next() % (j + 1);
+    long tmp = page_order[j];
+    page_order[j] = page_order[k];
+    page_order[k] = tmp;
+  }
+  page_order_n = n;
+  page_order_stride = stride;
+}
+
+// Walks the pages in order, but visits the words of each page randomly
+void test_page_random() {
+  long n = size_param / sizeof(data_t);
+  long words = page_words(n);
+  data_t result = 0;
+  volatile data_t sink __attribute__((unused));
+  if (page_order_n != n || page_order_stride != stride_param) {
+    build_page_order(n, stride_param);
+  }
+  long whole = n - n % words;
+  for (long page = 0; page < whole; page += words) {
+    for (long j = 0; j < page_order_len; j++) {
+      result += data[page + page_order[j]];
+    }
+  }
+  // A partial last page, as page_cross: only the offsets inside the buffer
+  for (long j = 0; whole < n && j < page_order_len; j++) {
+    if (whole + page_order[j] < n) result += data[whole + page_order[j]];
+  }
+  sink = result;
+}
+
+void test_page_random_better() {
+  long n = size_param / sizeof(data_t);
+  long words = page_words(n);
+  data_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+  volatile data_t sink __attribute__((unused));
+  if (page_order_n != n || page_order_stride != stride_param) {
+    build_page_order(n, stride_param);
+  }
+  long whole = n - n % words;
+  for (long page = 0; page < whole; page += words) {
+    const data_t *src = data + page;
+    long j = 0;
+    for (; j + 4 <= page_order_len; j += 4) {
+      a0 += src[page_order[j]];     a1 += src[page_order[j + 1]];
+      a2 += src[page_order[j + 2]]; a3 += src[page_order[j + 3]];
+    }
+    for (; j < page_order_len; j++) a0 += src[page_order[j]];
+  }
+  for (long j = 0; whole < n && j < page_order_len; j++) {
+    if (whole + page_order[j] < n) a0 += data[whole + page_order[j]];
+  }
+  sink = a0 + a1 + a2 + a3;
+}
+
+// Every access is in a different page from the previous one: offset j of
+// every page, then offset j + stride of every page... The L2 streamer only
+// tracks accesses within a 4 KiB page, so it never gets triggered.
+void test_page_cross() {
+  long n = size_param / sizeof(data_t);
+  long words = page_words(n);
+  long per_page = page_accesses(n, stride_param);
+  data_t result = 0;
+  volatile data_t sink __attribute__((unused));
+  for (long j = 0; j < per_page; j++) {
+    for (long i = j * stride_param; i < n; i += words) {
+      result += data[i];
+    }
+  }
+  sink = result;
+}
+
+void test_page_cross_better() {
+  long n = size_param / sizeof(data_t);
+  long words = page_words(n);
+  long per_page = page_accesses(n, stride_param);
+  data_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+  volatile data_t sink __attribute__((unused));
+  for (long j = 0; j < per_page; j++) {
+    long i = j * stride_param;
+    for (; i + 3 * words < n; i += 4 * words) {
+      a0 += data[i];             a1 += data[i + words];
+      a2 += data[i + 2 * words]; a3 += data[i + 3 * words];
+    }
+    for (; i < n; i += words) a0 += data[i];
+  }
+  sink = a0 + a1 + a2 + a3;
+}
+
+// Whole pages take every access; a partial last page only those inside it
+double page_pattern_accesses(long size, long stride) {
+  long n = size / sizeof(data_t);
+  long words = page_words(n), per_page = page_accesses(n, stride);
+  long last = (n % words + stride - 1) / stride;
+  return (double) (n / words) * per_page + (last < per_page ? last : per_page);
+}
+
+// Software prefetch: test_simple, plus a prefetch of the word prefetch_dist
+// accesses ahead
+long prefetch_dist = PREFETCH_DIST;
+
+void test_prefetch() {
+  long n = size_param / sizeof(data_t);
+  long stride = stride_param;
+  long ahead = prefetch_dist * stride;
+  data_t result = 0;
+  volatile data_t sink __attribute__((unused));
+  for (long i = 0; i < n; i += stride) {
+    __builtin_prefetch(&data[i + ahead]);
+    result += data[i];
+  }
+  sink = result;
+}
+
+void test_prefetch_better() {
+  long n = size_param / sizeof(data_t);
+  long stride = stride_param;
+  long ahead = prefetch_dist * stride;
+  data_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+  volatile data_t sink __attribute__((unused));
+  long i = 0;
+  for (; i + 3 * stride < n; i += 4 * stride) {
+    __builtin_prefetch(&data[i + ahead]);
+    a0 += data[i];              a1 += data[i + stride];
+    a2 += data[i + 2 * stride]; a3 += data[i + 3 * stride];
+  }
+  for (; i < n; i += stride) a0 += data[i];
+  sink = a0 + a1 + a2 + a3;
+}
+
+// The kernels selectable with --kernel. 'traffic' is the number of bytes the
+// kernel loads or stores per byte of stride-sampled working set, so speeds
+// are comparable across kernels. Write-allocate traffic is deliberately not
+// counted: its cost is what shows up as lower effective bandwidth.
+// Kernels that do not sample every stride-th word also give their number of
+// accesses per call.
+typedef struct {
+  const char *name;
+  test_funct simple;
+  test_funct better;
+  int traffic;
+  double (*accesses)(long size, long stride);
+} kernel_t;
+
+const kernel_t kernels[] = {
+  { "read",        test_simple,      test_better,             1, NULL },
+  { "store",       test_store,       test_store_better,       1, NULL },
+  { "copy",        test_copy,        test_copy_better,        1, NULL },
+  { "rmw",         test_rmw,         test_rmw_better,         2, NULL },
+  { "stream",      test_stream,      test_stream_better,      1, NULL },
+  { "reverse",     test_reverse,     test_reverse_better,     1, NULL },
+  { "page-random", test_page_random, test_page_random_better, 1,
+    page_pattern_accesses },
+  { "page-cross",  test_page_cross,  test_page_cross_better,  1,
+    page_pattern_accesses },
+  { "prefetch",    test_prefetch,    test_prefetch_better,    1, NULL },
+};
+
+#define N_KERNELS ((int) (sizeof(kernels) / sizeof(kernels[0])))
+
+const kernel_t *find_kernel(const char *name) {
+  for (int k = 0; k < N_KERNELS; k++) {
+    if (strcmp(kernels[k].name, name) == 0) return &kernels[k];
+  }
+  return NULL;
+}
+
+// Latency kernel: instead of streaming, follow a randomized cyclic chain of
+// pointers stored inside data. Every load depends on the previous one and
+// the order is unpredictable, so neither out-of-order execution nor the
+// prefetchers can hide the load-to-use latency.
+
+__thread void **chase_cursor;
+
+void purge_caches();
+
+__thread uint64_t rng_state = 88172645463325252ULL;
+
+// xorshift64*: rand() is too slow and too narrow for 2^27 chain nodes
+uint64_t rng_next() {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+// Links n nodes into a single random cycle (Sattolo's algorithm, shuffled in
+// place). Node i lives at chain[i * spacing + offset(i)], where offset(i)
+// rotates through the cache lines of a page if rotate is set: nodes one page
+// apart would otherwise all fall into the same cache set.
+void link_chain(long n, long spacing, int rotate) {
+  void **chain = (void **) data;
+  long words = LINE_SIZE / sizeof(void *);
+  long lines = PAGE_4K / LINE_SIZE;
+#define NODE(i) chain[(i) * spacing + (rotate ? ((i) % lines) * words : 0)]
+  if (n < 1) n = 1; // A thread's slice can be smaller than one stride
+  for (long i = 0; i < n; i++) {
+    NODE(i) = (void *) i;
+  }
+  for (long i = n - 1; i > 0; i--) {
+    long j = rng_next() % i;
+    void *tmp = NODE(i);
+    NODE(i) = NODE(j);
+    NODE(j) = tmp;
+  }
+  for (long i = 0; i < n; i++) {
+    NODE(i) = &NODE((long) NODE(i));
+  }
+  chase_cursor = &NODE(0);
+#undef NODE
+}
+
+// Latency mode: one node every stride words of the first size bytes of data
+void build_chain(long size, long stride) {
+  link_chain(size / (stride * sizeof(void *)), stride, 0);
+}
+
+// TLB mode: one node every stride 4 KiB pages. Only one line per page is
+// touched, so the lines of even large spans fit in cache and the latency
+// that remains is the cost of dTLB misses and page walks.
+void build_page_chain(long size, long stride) {
+  link_chain(size / (stride * PAGE_4K), stride * PAGE_4K / sizeof(void *), 1);
+}
+
+// Builds the chain of a chasing mode and cleans the caches before a point
+void setup_point(int mode) {
+  if(mode == MODE_LATENCY) build_chain(size_param, stride_param);
+  if(mode == MODE_TLB) build_page_chain(size_param, stride_param);
+  if(PURGE_CACHES) purge_caches();
+}
+
+// Follows CHASE_LOADS links, resuming where the previous call stopped so
+// large chains are walked in full across calls
+void test_latency() {
+  void **p = chase_cursor;
+  for (long i = 0; i < CHASE_LOADS; i += 8) {
+    p = *p; p = *p; p = *p; p = *p;
+    p = *p; p = *p; p = *p; p = *p;
+  }
+  chase_cursor = p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Page backing of data and dummy, selected with --pages
+
+enum {
+  PAGES_4K,
+  PAGES_THP,
+  PAGES_2M,
+  PAGES_1G
+};
+
+const char *page_names[] = { "4k", "thp", "2m", "1g" };
+
+int page_mode = PAGES_4K;
+
+// Returns size bytes with the selected backing, without touching them
+void *allocate_pages(long size) {
+  void *buf;
+  if (page_mode == PAGES_2M || page_mode == PAGES_1G) {
+    long huge = page_mode == PAGES_2M ? 1L << 21 : 1L << 30;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+      (page_mode == PAGES_2M ? MAP_HUGE_2MB : MAP_HUGE_1GB);
+    size = (size + huge - 1) / huge * huge;
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (buf == MAP_FAILED) {
+      fprintf(stderr, "Could not map %ld bytes of %s pages "
+              "(see /sys/kernel/mm/hugepages).\n", size,
+              page_names[page_mode]);
+      exit(1);
+    }
+    return buf;
+  }
+
+  if (posix_memalign(&buf, 1 << LOGALIGN, size) != 0) {
+    fprintf(stderr, "Could not allocate %ld bytes.\n", size);
+    exit(1);
+  }
+  // Ask explicitly for either backing: hosts differ in their THP default
+  madvise(buf, size, page_mode == PAGES_THP ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+  return buf;
+}
+
+void free_pages(void *buf, long size) {
+  if (page_mode == PAGES_2M || page_mode == PAGES_1G) {
+    long huge = page_mode == PAGES_2M ? 1L << 21 : 1L << 30;
+    munmap(buf, (size + huge - 1) / huge * huge);
+  }
+  else {
+    free(buf);
+  }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -81,8 +756,11 @@ data_t *dummy;
 long dummy_len;
 
 void allocate_dummy(long size) {
-  posix_memalign((void**) &dummy, 1 << LOGALIGN, size);
+  dummy = allocate_pages(size);
   dummy_len = size / sizeof(data_t);
+  for(long i = 0; i < dummy_len; i++) {
+    dummy[i] = 1.0;
+  }
 }
 
 void purge_caches() {
@@ -94,66 +772,821 @@ void purge_caches() {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void take_measurements(int simple_mode) {
+// Data allocation and NUMA placement. We call mbind directly, as perf.c does
+// with perf_event_open, rather than depend on libnuma.
+
+int n_threads = 1;
+int numa_remote = 0; // Place each worker's slice on another node
+
+long mbind(void *addr, unsigned long len, int mode,
+           const unsigned long *nodemask, unsigned long maxnode,
+           unsigned flags) {
+  return syscall(SYS_mbind, addr, len, mode, nodemask, maxnode, flags);
+}
+
+int count_nodes() {
+  int n = 0;
+  char path[64];
+  while (n < MAX_NODES) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+    if (access(path, F_OK) != 0) break;
+    n++;
+  }
+  return n > 0 ? n : 1;
+}
+
+// Allocates and first-touches size bytes, bound to the given NUMA node
+// (or following the default policy if node < 0)
+data_t *allocate_data(long size, int node) {
+  data_t *buf = allocate_pages(size);
+  if (node >= 0) {
+    unsigned long mask = 1UL << node;
+    if (mbind(buf, size, MPOL_BIND, &mask, MAX_NODES, 0) != 0) {
+      perror("mbind");
+    }
+  }
+
+  // Touch every page: untouched pages all map to the shared zero page, which
+  // would make even the largest sizes look like L1 hits
+  for(long i = 0; i < size / (long) sizeof(data_t); i++) {
+    buf[i] = 1.0;
+  }
+  return buf;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Hardware counters (--counters), opened per thread through perf.c. They are
+// reported per access, so that a cliff in the mountain lines up with a jump
+// in the misses of the cache level that causes it.
+
+typedef struct {
+  const char *name;
+  unsigned int type;
+  unsigned long long config;
+} counter_t;
+
+const counter_t counters[] = {
+  { "l1d_miss",  PERF_TYPE_HW_CACHE, CACHE_EVENT(L1D, READ, MISS) },
+  // There is no generic L2 event; LLC references are L2 misses on Intel
+  { "l2_miss",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+  { "llc_miss",  PERF_TYPE_HW_CACHE, CACHE_EVENT(LL, READ, MISS) },
+  { "dtlb_miss", PERF_TYPE_HW_CACHE, CACHE_EVENT(DTLB, READ, MISS) },
+  { "cycles",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+};
+
+#define N_COUNTERS ((int) (sizeof(counters) / sizeof(counters[0])))
+
+int use_counters = 0;
+__thread int counter_fds[N_COUNTERS];
+
+void open_counters(int verbose) {
+  for (int k = 0; k < N_COUNTERS; k++) {
+    counter_fds[k] = open_counter(counters[k].type, counters[k].config);
+    if (counter_fds[k] < 0 && verbose) {
+      fprintf(stderr, "Counter %s is unavailable.\n", counters[k].name);
+    }
+  }
+}
+
+void reset_counters() {
+  for (int k = 0; k < N_COUNTERS; k++) {
+    if (counter_fds[k] >= 0) reset_counter(counter_fds[k]);
+  }
+  calls_made = 0;
+}
+
+// Adds the counts since the last reset to counts (NAN if unavailable or if
+// the read fails)
+void read_counters(double *counts) {
+  for (int k = 0; k < N_COUNTERS; k++) {
+    long long count = counter_fds[k] >= 0 ? read_counter(counter_fds[k]) : -1;
+    counts[k] += count >= 0 ? count : NAN;
+  }
+}
+
+// Loads and stores issued by one kernel call
+double accesses_per_call(int mode, const kernel_t *kernel, long size,
+                         long stride) {
+  if (mode >= MODE_LATENCY) return CHASE_LOADS;
+  if (kernel->accesses != NULL) return kernel->accesses(size, stride);
+  return ((double) size) / sizeof(data_t) * kernel->traffic / stride;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Multi-threaded measurements. Workers are pinned, each owns 1/n_threads of
+// the working set on its own node, and they run the same doubling loop as
+// time_kernel in lockstep: the main thread picks the repeat count, and all
+// workers start each round together behind a barrier.
+
+enum {
+  CMD_SETUP,
+  CMD_RUN,
+  CMD_EXIT
+};
+
+typedef struct {
+  pthread_t thread;
+  int id;
+  int cpu;
+  double elapsed;  // Seconds taken by the last round
+  long calls;      // Kernel calls since the point was set up
+  double counts[N_COUNTERS]; // Counter values since the point was set up
+} worker_t;
+
+worker_t workers[MAX_THREADS];
+pthread_barrier_t round_start, round_end;
+int worker_cmd;
+long worker_repeat;
+int worker_mode;
+test_funct worker_test;
+long point_size, point_stride;
+
+void *worker_main(void *arg) {
+  worker_t *self = arg;
+  int cpu, node;
+  syscall(SYS_getcpu, &cpu, &node, NULL);
+  if (numa_remote) node = (node + 1) % count_nodes();
+  data = allocate_data((1L << LOGSIZE_MAX) / n_threads, node);
+  if (use_counters) open_counters(self->id == 0);
+
+  while (1) {
+    pthread_barrier_wait(&round_start);
+    if (worker_cmd == CMD_EXIT) break;
+    if (worker_cmd == CMD_SETUP) {
+      size_param = point_size / n_threads;
+      stride_param = point_stride;
+      setup_point(worker_mode);
+      if (use_counters) reset_counters();
+      if (min_repeat == 1) { worker_test(); calls_made++; } // Warm up
+    }
+    else {
+      timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for(long i = 0; i < worker_repeat; i++) { worker_test(); }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      self->elapsed = timespec_diff(&start, &end);
+      calls_made += worker_repeat;
+      self->calls = calls_made;
+      if (use_counters) {
+        memset(self->counts, 0, sizeof(self->counts));
+        read_counters(self->counts);
+      }
+    }
+    pthread_barrier_wait(&round_end);
+  }
+  free_pages(data, (1L << LOGSIZE_MAX) / n_threads);
+  return NULL;
+}
+
+void run_workers(int cmd) {
+  worker_cmd = cmd;
+  pthread_barrier_wait(&round_start);
+  if (cmd != CMD_EXIT) pthread_barrier_wait(&round_end);
+}
+
+void start_workers(int mode, test_funct test) {
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  worker_mode = mode;
+  worker_test = test;
+  pthread_barrier_init(&round_start, NULL, n_threads + 1);
+  pthread_barrier_init(&round_end, NULL, n_threads + 1);
+  for (int i = 0; i < n_threads; i++) {
+    cpu_set_t cpuset;
+    pthread_attr_t attr;
+    workers[i].id = i;
+    workers[i].cpu = i % ncpus;
+    CPU_ZERO(&cpuset);
+    CPU_SET(workers[i].cpu, &cpuset);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+    if (pthread_create(&workers[i].thread, &attr, worker_main,
+                       &workers[i]) != 0) {
+      fprintf(stderr, "pthread_create(): Failed to create thread.\n");
+      exit(1);
+    }
+    pthread_attr_destroy(&attr);
+  }
+}
+
+void stop_workers() {
+  run_workers(CMD_EXIT);
+  for (int i = 0; i < n_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+}
+
+// Times one round of every worker, doubling the repeat count until the
+// slowest worker's round is long enough to be measured to within tolerance
+long func_time_workers(double tolerance) {
+  timespec res;
+  clock_getres(CLOCK_MONOTONIC, &res);
+  double threshold = (double) res.tv_nsec * 1e-9 / tolerance;
+  worker_repeat = min_repeat;
+  while(1) {
+    run_workers(CMD_RUN);
+    double slowest = 0;
+    for (int i = 0; i < n_threads; i++) {
+      if (workers[i].elapsed > slowest) slowest = workers[i].elapsed;
+    }
+    if(slowest >= threshold) { break; }
+    worker_repeat *= 2;
+  }
+  return worker_repeat;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Converts the time of one kernel call into the reported metric
+double point_metric(int mode, const kernel_t *kernel, long size, long stride,
+                    double time) {
+  if(mode == MODE_LATENCY || mode == MODE_TLB) {
+    return time * 1e9 / CHASE_LOADS; // ns per load
+  }
+  double accessed = accesses_per_call(mode, kernel, size, stride) *
+    sizeof(data_t);
+  return accessed / (time * 1024 * 1024); // MB/s
+}
+
+int adaptive = 0;
+int output_format = FORMAT_TEXT;
+
+// A measured point. values[0] is the reported metric, which with several
+// threads is their aggregate, followed by one value per thread (if more than
+// one) and one per hardware counter (with --counters).
+typedef struct {
+  long stride;
+  double logsize;
+  int n_values;
+  double *values;
+} point_t;
+
+// Names of the values of a point, for the csv and json formats
+const char *column_names[MAX_THREADS + N_COUNTERS + 1];
+int n_columns;
+
+void init_columns(int mode) {
+  static char thread_names[MAX_THREADS][12];
+  n_columns = 0;
+  column_names[n_columns++] = mode >= MODE_LATENCY ? "ns/load" : "MB/s";
+  for (int i = 0; n_threads > 1 && i < n_threads; i++) {
+    snprintf(thread_names[i], sizeof(thread_names[i]), "t%d", i);
+    column_names[n_columns++] = thread_names[i];
+  }
+  for (int k = 0; use_counters && k < N_COUNTERS; k++) {
+    column_names[n_columns++] = counters[k].name;
+  }
+}
+
+void print_header(FILE *out) {
+  if (output_format == FORMAT_JSON) return;
+  fprintf(out, output_format == FORMAT_CSV ? "stride,logsize" :
+          "# stride  logsize");
+  for (int i = 0; i < n_columns; i++) {
+    fprintf(out, output_format == FORMAT_CSV ? ",%s" : "  %s",
+            column_names[i]);
+  }
+  fprintf(out, "\n");
+}
+
+void print_point(FILE *out, int format, int mode, const point_t *p) {
+  const char *value_format = mode >= MODE_LATENCY ? "%.2lf" : "%.1lf";
+  if (format == FORMAT_JSON) {
+    fprintf(out, "{\"stride\": %ld, \"logsize\": %g", p->stride, p->logsize);
+  }
+  else if (format == FORMAT_CSV) {
+    fprintf(out, "%ld,%g", p->stride, p->logsize);
+  }
+  else {
+    fprintf(out, "%-3ld  %-3g", p->stride, p->logsize);
+  }
+  for (int i = 0; i < p->n_values; i++) {
+    double v = p->values[i];
+    // Counters are small per-access ratios, print them with more digits
+    const char *f = i >= p->n_values - (use_counters ? N_COUNTERS : 0) ?
+      "%.4lf" : value_format;
+    if (format == FORMAT_JSON) {
+      fprintf(out, ", \"%s\": ", column_names[i]);
+      if (isnan(v)) fprintf(out, "null");
+      else fprintf(out, f, v);
+      continue;
+    }
+    fprintf(out, format == FORMAT_CSV ? "," : "  ");
+    fprintf(out, f, v);
+  }
+  fprintf(out, format == FORMAT_JSON ? "}\n" : "\n");
+}
+
+// Builds chains and cleans the caches of every thread before a point
+void prepare_point(int mode, test_funct test, long size, long stride) {
+  if (n_threads == 1) {
+    size_param = size;
+    stride_param = stride;
+    setup_point(mode);
+    if (use_counters) reset_counters();
+    if (adaptive) { test(); calls_made++; } // Warm up: a sample may be one call
+    return;
+  }
+  point_size = size;
+  point_stride = stride;
+  run_workers(CMD_SETUP);
+}
+
+// Takes one sample of the metric and per-thread values of a point into
+// values, and returns their number
+int sample_point(int mode, const kernel_t *kernel, test_funct test,
+                 long size, long stride, double *values) {
+  if (n_threads == 1) {
+    double time = time_kernel(test, TOLERANCE);
+    values[0] = point_metric(mode, kernel, size, stride, time);
+    return 1;
+  }
+
+  long repeat = func_time_workers(TOLERANCE);
+  long slice = size / n_threads;
+  double slowest = 0, total = 0;
+  for (int i = 0; i < n_threads; i++) {
+    double time = workers[i].elapsed / repeat;
+    if (time > slowest) slowest = time;
+    values[i + 1] = point_metric(mode, kernel, slice, stride, time);
+    total += values[i + 1];
+  }
+  if (mode >= MODE_LATENCY) {
+    values[0] = total / n_threads; // mean ns per load
+  }
+  else {
+    values[0] = point_metric(mode, kernel, size, stride, slowest);
+  }
+  return n_threads + 1;
+}
+
+// Stores the counts per access of every thread since prepare_point in counts
+void sample_counters(int mode, const kernel_t *kernel, long size,
+                     long stride, double *counts) {
+  double accesses;
+  memset(counts, 0, N_COUNTERS * sizeof(double));
+  if (n_threads == 1) {
+    read_counters(counts);
+    accesses = calls_made * accesses_per_call(mode, kernel, size, stride);
+  }
+  else {
+    accesses = 0;
+    for (int i = 0; i < n_threads; i++) {
+      for (int k = 0; k < N_COUNTERS; k++) counts[k] += workers[i].counts[k];
+      accesses += workers[i].calls *
+        accesses_per_call(mode, kernel, size / n_threads, stride);
+    }
+  }
+  for (int k = 0; k < N_COUNTERS; k++) counts[k] /= accesses;
+}
+
+// Two-sided 95% Student t quantiles, by degrees of freedom
+double student_t(long dof) {
+  static const double t[] = { 0, 12.71, 4.30, 3.18, 2.78, 2.57, 2.45, 2.36,
+                              2.31, 2.26, 2.23 };
+  return dof <= 10 ? t[dof] : 1.96 + 2.5 / dof;
+}
+
+// Measures a point. A full sweep takes one sample; an adaptive one samples
+// until the confidence interval of the metric is tight enough.
+void measure_point(int mode, const kernel_t *kernel, test_funct test,
+                   point_t *p) {
+  double values[MAX_THREADS + 1], sums[MAX_THREADS + 1] = { 0 };
+  double mean = 0, m2 = 0;
+  long size = ((long) exp2(p->logsize)) / LINE_SIZE * LINE_SIZE;
+  int n_values = 0;
+  long n = 0;
+
+  prepare_point(mode, test, size, p->stride);
+  while (1) {
+    n_values = sample_point(mode, kernel, test, size, p->stride, values);
+    for (int i = 0; i < n_values; i++) sums[i] += values[i];
+    n++;
+    double d = values[0] - mean; // Welford's running variance
+    mean += d / n;
+    m2 += d * (values[0] - mean);
+    if (!adaptive || n >= MAX_SAMPLES) break;
+    if (n >= MIN_SAMPLES &&
+        student_t(n - 1) * sqrt(m2 / (n - 1) / n) <= CI_TARGET * mean) break;
+  }
+
+  p->n_values = n_values + (use_counters ? N_COUNTERS : 0);
+  p->values = malloc(p->n_values * sizeof(double));
+  for (int i = 0; i < n_values; i++) p->values[i] = sums[i] / n;
+  if (use_counters) {
+    sample_counters(mode, kernel, size, p->stride, p->values + n_values);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Finished points, also appended to the checkpoint file (--checkpoint) so an
+// interrupted sweep resumes where it stopped. The checkpoint always uses the
+// text format.
+
+#define LINE_LEN (16 * (MAX_THREADS + N_COUNTERS + 3))
+
+point_t *points;
+long n_points, points_cap;
+FILE *checkpoint;
+const char *checkpoint_path;
+
+point_t *add_point(long stride, double logsize) {
+  if (n_points == points_cap) {
+    points_cap = points_cap ? 2 * points_cap : 1024;
+    points = realloc(points, points_cap * sizeof(point_t));
+  }
+  point_t *p = &points[n_points++];
+  p->stride = stride;
+  p->logsize = logsize;
+  p->n_values = 0;
+  p->values = NULL;
+  return p;
+}
+
+point_t *find_point(long stride, double logsize) {
+  for (long i = 0; i < n_points; i++) {
+    if (points[i].stride == stride && fabs(points[i].logsize - logsize) < 1e-9)
+      return &points[i];
+  }
+  return NULL;
+}
+
+// Loads the points of a previous run with the same configuration, and opens
+// the checkpoint for appending
+void open_checkpoint(const char *config) {
+  char line[LINE_LEN];
+  FILE *f = fopen(checkpoint_path, "r");
+  if (f != NULL) {
+    if (fgets(line, sizeof(line), f) == NULL || strcmp(line, config) != 0) {
+      fprintf(stderr, "Checkpoint %s is from another configuration.\n",
+              checkpoint_path);
+      exit(1);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+      double values[MAX_THREADS + N_COUNTERS + 1];
+      char *pos = line, *end;
+      if (line[0] == '#') continue;
+      long stride = strtol(pos, &end, 10);
+      if (end == pos) continue;
+      double logsize = strtod(pos = end, &end);
+      int n_values = 0;
+      while (n_values < n_columns) {
+        values[n_values] = strtod(pos = end, &end);
+        if (end == pos) break;
+        n_values++;
+      }
+      if (n_values != n_columns) continue; // Truncated by the interruption
+      point_t *p = add_point(stride, logsize);
+      p->n_values = n_values;
+      p->values = malloc(n_values * sizeof(double));
+      memcpy(p->values, values, n_values * sizeof(double));
+    }
+    fclose(f);
+    fprintf(stderr, "Resuming from %ld points in %s.\n", n_points,
+            checkpoint_path);
+  }
+  checkpoint = fopen(checkpoint_path, "a");
+  if (checkpoint == NULL) {
+    perror(checkpoint_path);
+    exit(1);
+  }
+  if (f == NULL) {
+    fputs(config, checkpoint);
+    print_header(checkpoint);
+  }
+}
+
+// Returns the metric of a point, measuring it unless it is already known
+double get_point(int mode, const kernel_t *kernel, test_funct test,
+                 long stride, double logsize) {
+  point_t *p = find_point(stride, logsize);
+  if (p == NULL) {
+    fprintf(stderr, "logsize=%-5g stride=%-3ld  \r", logsize, stride);
+    p = add_point(stride, logsize);
+    measure_point(mode, kernel, test, p);
+    if (checkpoint != NULL) {
+      print_point(checkpoint, FORMAT_TEXT, mode, p);
+      fflush(checkpoint);
+    }
+  }
+  print_point(stdout, output_format, mode, p);
+  return p->values[0];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Adaptive sweep: measure a coarse grid (every logsize, power-of-two strides),
+// then bisect between neighbouring points wherever the metric jumps. Dense
+// points end up only around the cache-size cliffs.
+
+int is_cliff(double a, double b) {
+  return fabs(a - b) > CLIFF * fmin(a, b);
+}
+
+void refine_strides(int mode, const kernel_t *kernel, test_funct test,
+                    double logsize, long lo, double v_lo, long hi, double v_hi) {
+  if (hi - lo < 2 || !is_cliff(v_lo, v_hi)) return;
+  long mid = (lo + hi) / 2;
+  double v_mid = get_point(mode, kernel, test, mid, logsize);
+  refine_strides(mode, kernel, test, logsize, lo, v_lo, mid, v_mid);
+  refine_strides(mode, kernel, test, logsize, mid, v_mid, hi, v_hi);
+}
+
+void refine_logsizes(int mode, const kernel_t *kernel, test_funct test,
+                     long stride, double lo, double v_lo, double hi,
+                     double v_hi) {
+  if (hi - lo <= LOGSIZE_STEP || !is_cliff(v_lo, v_hi)) return;
+  double mid = (lo + hi) / 2;
+  double v_mid = get_point(mode, kernel, test, stride, mid);
+  refine_logsizes(mode, kernel, test, stride, lo, v_lo, mid, v_mid);
+  refine_logsizes(mode, kernel, test, stride, mid, v_mid, hi, v_hi);
+}
+
+void adaptive_sweep(int mode, const kernel_t *kernel, test_funct test) {
+  long strides[64];
+  int n_strides = 0;
+  for (long s = STRIDE_MIN; s < STRIDE_MAX; s *= 2) strides[n_strides++] = s;
+  strides[n_strides++] = STRIDE_MAX;
+
+  int n_logsizes = LOGSIZE_MAX - LOGSIZE_MIN + 1;
+  double coarse[LOGSIZE_MAX - LOGSIZE_MIN + 1][64];
+  for (int l = 0; l < n_logsizes; l++) {
+    for (int k = 0; k < n_strides; k++) {
+      coarse[l][k] = get_point(mode, kernel, test, strides[k],
+                               LOGSIZE_MAX - l);
+    }
+  }
+
+  for (int l = 0; l < n_logsizes; l++) {
+    for (int k = 0; k + 1 < n_strides; k++) {
+      refine_strides(mode, kernel, test, LOGSIZE_MAX - l, strides[k],
+                     coarse[l][k], strides[k + 1], coarse[l][k + 1]);
+    }
+  }
+  for (int k = 0; k < n_strides; k++) {
+    for (int l = 0; l + 1 < n_logsizes; l++) {
+      refine_logsizes(mode, kernel, test, strides[k], LOGSIZE_MAX - l - 1,
+                      coarse[l + 1][k], LOGSIZE_MAX - l, coarse[l][k]);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void take_measurements(int mode, const kernel_t *kernel) {
 
   test_funct test;
-  if (simple_mode) {
-    test = test_simple;
+  if (mode == MODE_SIMPLE) {
+    test = kernel->simple;
+  }
+  else if (mode == MODE_BETTER) {
+    test = kernel->better;
+    fprintf(stderr, "Using %s kernels.\n", select_isa());
   }
   else {
-    test = test_simple;
+    test = test_latency;
   }
+  fprintf(stderr, "Using '%s' kernel on %s pages.\n",
+          mode >= MODE_LATENCY ? "chase" : kernel->name,
+          page_names[page_mode]);
 
-  long data_size = 1 << LOGSIZE_MAX;
-  posix_memalign((void**) &data,  1 << LOGALIGN, data_size);
+  init_columns(mode);
+  if (checkpoint_path != NULL) {
+    char config[256];
+    snprintf(config, sizeof(config), "# mode=%s kernel=%s threads=%d "
+             "numa=%s pages=%s adaptive=%d counters=%d\n",
+             mode_names[mode], kernel->name, n_threads,
+             numa_remote ? "remote" : "local", page_names[page_mode],
+             adaptive, use_counters);
+    open_checkpoint(config);
+  }
+  print_header(stdout);
 
   allocate_dummy(PURGE_SIZE);
+  if (n_threads > 1) {
+    fprintf(stderr, "Using %d threads, %s NUMA placement.\n", n_threads,
+            numa_remote ? "remote" : "local");
+    if (numa_remote && count_nodes() < 2) {
+      fprintf(stderr, "Only one NUMA node: remote placement is local.\n");
+    }
+    start_workers(mode, test);
+  }
+  else {
+    data = allocate_data(1L << LOGSIZE_MAX, -1);
+    if (use_counters) open_counters(1);
+  }
 
   // Make the measurements
-  for(long logsize = LOGSIZE_MAX; logsize >= LOGSIZE_MIN; logsize--) {
-    fprintf(stderr, "logsize=%ld  \r", logsize);
-    for(long stride = STRIDE_MIN; stride <= STRIDE_MAX; stride++) {
-      if(PURGE_CACHES) purge_caches();
-      size_param = 1 << logsize;
-      stride_param = stride;
-      double time = func_time(test, TOLERANCE);
-      double accessed = ((double) size_param) / stride_param;
-      double speed = accessed / (time * 1024 * 1024); // MB/s
-      printf("%-3ld  %-3ld  %.1lf\n", stride, logsize, speed);
+  if (adaptive) {
+    adaptive_sweep(mode, kernel, test);
+  }
+  else {
+    for(long logsize = LOGSIZE_MAX; logsize >= LOGSIZE_MIN; logsize--) {
+      for(long stride = STRIDE_MIN; stride <= STRIDE_MAX; stride++) {
+        get_point(mode, kernel, test, stride, logsize);
+      }
     }
   }
+  if (n_threads > 1) stop_workers();
+  if (checkpoint != NULL) fclose(checkpoint);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+#ifdef BENCH_RUNNER
+
+// One point of the mountain per parameter combination, timed by the runner
+// in seconds per kernel call (func_time_stats rather than time_kernel)
+// Measures one point; with slices=N, at the size of one of N threads'
+// slices of it, which need not be a round number of bytes
+static void bench_mountain(bench_ctx_t *ctx) {
+  const char *mode_name = bench_param(ctx, "mode", "better");
+  const char *kernel_name = bench_param(ctx, "kernel", "read");
+  long logsize = bench_param_long(ctx, "logsize", LOGSIZE_MIN);
+  long stride = bench_param_long(ctx, "stride", STRIDE_MIN);
+  long slices = bench_param_long(ctx, "slices", 1);
+  const kernel_t *kernel = find_kernel(kernel_name);
+
+  int mode = -1;
+  for (int m = MODE_SIMPLE; m <= MODE_TLB; m++) {
+    if (strcmp(mode_name, mode_names[m]) == 0) mode = m;
+  }
+  if (mode < 0 || kernel == NULL || logsize < LOGSIZE_MIN ||
+      logsize > LOGSIZE_MAX || stride < STRIDE_MIN || stride > STRIDE_MAX ||
+      slices < 1 || slices > MAX_THREADS) {
+    fprintf(stderr, "mountain: invalid point.\n");
+    return;
+  }
+
+  test_funct test = mode == MODE_SIMPLE ? kernel->simple :
+    mode == MODE_BETTER ? kernel->better : test_latency;
+  size_param = (1L << logsize) / slices;
+  stride_param = stride;
+  data = allocate_data(1L << logsize, -1);
+  setup_point(mode);
+  bench_time(ctx, "time", test);
+  free_pages(data, 1L << logsize);
+  data = NULL;
+}
+
+BENCH(bench_point, "mountain/point",
+      "mode=better kernel=read logsize=14|20|26 stride=1|8") {
+  bench_mountain(ctx);
+}
+
+// the slices of --threads=3: kernels must not assume a round size
+BENCH(bench_slice, "mountain/slice",
+      "mode=simple|better kernel=copy|page-random logsize=14|20 stride=1"
+      " slices=3") {
+  bench_mountain(ctx);
+}
+
+#else
+
 const char *arg_error = \
-  "This program expects one argument ('simple' or 'better').";
+  "Usage: mountain (simple | better | latency | tlb) [OPTIONS]\n"
+  "  tlb            Like latency, but one line per stride x 4 KiB pages\n"
+  "  --kernel=NAME  read [default], store, copy, rmw or stream (non-temporal)\n"
+  "                 or a read pattern: reverse, page-random (random order\n"
+  "                 within each 4 KiB page), page-cross (every access in a\n"
+  "                 new page) or prefetch (software prefetching)\n"
+  "  --prefetch-distance=D  Accesses ahead for the prefetch kernel [16]\n"
+  "  --threads=N    Split the working set over N pinned threads; prints the\n"
+  "                 aggregate followed by one column per thread\n"
+  "  --numa=PLACE   local [default] or remote memory for each thread\n"
+  "  --pages=SIZE   4k [default], thp (madvise), 2m or 1g (hugetlbfs)\n"
+  "  --adaptive     Sample each point until its 95% CI is within 2%, and\n"
+  "                 refine the grid only around cliffs\n"
+  "  --checkpoint=FILE  Save finished points to FILE, resuming from it\n"
+  "  --counters     Add L1D, L2 and LLC misses, dTLB misses and cycles per\n"
+  "                 access (from perf_event_open) to every point\n"
+  "  --format=FMT   text [default], csv or json (one object per line)";
+
+// Matches "--name=value" or "--name value" and returns the value (advancing
+// *i past it in the second case), or NULL if argv[*i] is another option
+const char *match_option(int argc, char *argv[], int *i, const char *name) {
+  size_t len = strlen(name);
+  if (strncmp(argv[*i], name, len) != 0) return NULL;
+  if (argv[*i][len] == '=') return argv[*i] + len + 1;
+  if (argv[*i][len] == '\0' && *i + 1 < argc) return argv[++*i];
+  return NULL;
+}
 
 int main (int argc, char *argv[]) {
 
-  int simple = 1;
-  if (argc != 2) {
+  int mode;
+  const kernel_t *kernel = &kernels[0];
+  if (argc < 2) {
     fprintf(stderr, "%s\n", arg_error);
     return 1;
   }
   if (strcmp(argv[1], "simple") == 0) {
     fprintf(stderr, "Using 'simple' measurement mode.\n");
+    mode = MODE_SIMPLE;
   }
   else if (strcmp(argv[1], "better") == 0) {
     fprintf(stderr, "Using 'better' measurement mode.\n");
-    simple = 0;
+    mode = MODE_BETTER;
+  }
+  else if (strcmp(argv[1], "latency") == 0) {
+    fprintf(stderr, "Using 'latency' measurement mode (ns per load).\n");
+    mode = MODE_LATENCY;
+  }
+  else if (strcmp(argv[1], "tlb") == 0) {
+    fprintf(stderr, "Using 'tlb' measurement mode (ns per load).\n");
+    mode = MODE_TLB;
   }
   else {
     fprintf(stderr, "%s\n", arg_error);
     return 1;
   }
 
+  for (int i = 2; i < argc; i++) {
+    const char *value;
+    if ((value = match_option(argc, argv, &i, "--kernel")) != NULL) {
+      kernel = find_kernel(value);
+      if (kernel == NULL || (mode >= MODE_LATENCY && kernel != &kernels[0])) {
+        fprintf(stderr, "Invalid kernel '%s' for this mode.\n", value);
+        return 1;
+      }
+    }
+    else if ((value = match_option(argc, argv, &i, "--prefetch-distance"))
+             != NULL) {
+      char *end;
+      prefetch_dist = strtol(value, &end, 10);
+      if (*end != '\0' || prefetch_dist < 0 ||
+          prefetch_dist > MAX_PREFETCH_DIST) {
+        fprintf(stderr, "Prefetch distance must be in [0, %d].\n",
+                MAX_PREFETCH_DIST);
+        return 1;
+      }
+    }
+    else if ((value = match_option(argc, argv, &i, "--threads")) != NULL) {
+      n_threads = atoi(value);
+      if (n_threads < 1 || n_threads > MAX_THREADS) {
+        fprintf(stderr, "Thread count must be in [1, %d].\n", MAX_THREADS);
+        return 1;
+      }
+    }
+    else if ((value = match_option(argc, argv, &i, "--numa")) != NULL) {
+      if (strcmp(value, "local") == 0) numa_remote = 0;
+      else if (strcmp(value, "remote") == 0) numa_remote = 1;
+      else {
+        fprintf(stderr, "%s\n", arg_error);
+        return 1;
+      }
+    }
+    else if ((value = match_option(argc, argv, &i, "--pages")) != NULL) {
+      page_mode = -1;
+      for (int p = PAGES_4K; p <= PAGES_1G; p++) {
+        if (strcmp(value, page_names[p]) == 0) page_mode = p;
+      }
+      if (page_mode < 0) {
+        fprintf(stderr, "%s\n", arg_error);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--adaptive") == 0) {
+      adaptive = 1;
+      min_repeat = 1;
+    }
+    else if ((value = match_option(argc, argv, &i, "--checkpoint")) != NULL) {
+      checkpoint_path = value;
+    }
+    else if (strcmp(argv[i], "--counters") == 0) {
+      use_counters = 1;
+    }
+    else if ((value = match_option(argc, argv, &i, "--format")) != NULL) {
+      output_format = -1;
+      for (int f = FORMAT_TEXT; f <= FORMAT_JSON; f++) {
+        if (strcmp(value, format_names[f]) == 0) output_format = f;
+      }
+      if (output_format < 0) {
+        fprintf(stderr, "%s\n", arg_error);
+        return 1;
+      }
+    }
+    else {
+      fprintf(stderr, "%s\n", arg_error);
+      return 1;
+    }
+  }
+
   fprintf(stderr, "Size of data_t: %luB\n", sizeof(data_t));
 
+  // On stderr: plot.py reads json output from its first line
+  env_t env;
+  env_capture(&env);
+  env_print(stderr, &env);
+
   init_delta();
-  take_measurements(simple);
+  take_measurements(mode, kernel);
 
   return 0;
 }
 
+#endif // BENCH_RUNNER
+
 ////////////////////////////////////////////////////////////////////////////////
@@ -12,6 +12,7 @@
 #include "perf.h"
 #include <time.h>
 #include <unistd.h>
+#include <cpuid.h>
 
 //avoid header conflict
 #define CLOCK_MONOTONIC_RAW 4
@@ -87,6 +88,77 @@ long double get_etime_hw(void)
         (curr.tv_nsec - first_h.tv_nsec)*1e-9);
 }
 
+/*
+ * TSC cycle timer routines
+ */
+#define TSC_CALIBRATE_NS 20000000 /* 20ms per calibration round */
+#define TSC_ROUNDS 5
+
+double tsc_ghz;
+uint64_t tsc_overhead;
+
+/* return whether the TSC ticks at a constant rate in every P/C-state */
+int tsc_is_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (edx >> 8) & 1;
+}
+
+/* return nanoseconds elapsed on the raw monotonic clock */
+static long long raw_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/*
+ * calibrate the TSC against CLOCK_MONOTONIC_RAW (keeping the median of a
+ * few rounds) and measure the overhead of the timer itself; returns -1 if
+ * the TSC is not invariant, in which case readings may not be comparable
+ * across frequency changes or cores
+ */
+int tsc_init(void)
+{
+    double rates[TSC_ROUNDS];
+
+    for (int r = 0; r < TSC_ROUNDS; r++) {
+        long long ns0 = raw_ns();
+        uint64_t t0 = tsc_start();
+        long long ns1;
+        while ((ns1 = raw_ns()) - ns0 < TSC_CALIBRATE_NS)
+            continue;
+        uint64_t t1 = tsc_stop();
+        rates[r] = (double) (t1 - t0) / (ns1 - ns0);
+    }
+    for (int i = 1; i < TSC_ROUNDS; i++) {
+        for (int j = i; j > 0 && rates[j] < rates[j - 1]; j--) {
+            double tmp = rates[j];
+            rates[j] = rates[j - 1];
+            rates[j - 1] = tmp;
+        }
+    }
+    tsc_ghz = rates[TSC_ROUNDS / 2];
+
+    tsc_overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t t0 = tsc_start();
+        uint64_t t1 = tsc_stop();
+        if (t1 - t0 < tsc_overhead)
+            tsc_overhead = t1 - t0;
+    }
+
+    return tsc_is_invariant() ? 0 : -1;
+}
+
+/* convert TSC ticks to nanoseconds */
+double tsc_to_ns(uint64_t ticks)
+{
+    return ticks / tsc_ghz;
+}
+
 long perf_event_open( struct perf_event_attr *hw_event, pid_t pid,
                       int cpu, int group_fd, unsigned long flags )
 {
@@ -127,4 +199,184 @@ long long get_cachemiss_count(void)
     close(perf_fd);
 
     return count;
-}
\ No newline at end of file
+}
+
+/*
+ * Free-running counters for the calling thread: unlike the cache miss count
+ * above, several can be open at once and they are read without being closed
+ */
+
+/* open and enable a counter, returning its fd or -1 if unsupported */
+int open_counter(unsigned int type, unsigned long long config)
+{
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(struct perf_event_attr));
+    pe.type = type;
+    pe.size = sizeof(struct perf_event_attr);
+    pe.config = config;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return perf_event_open(&pe, 0, -1, -1, 0);
+}
+
+/* zero a counter */
+void reset_counter(int fd)
+{
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+}
+
+/* return the count since open_counter or the last reset_counter */
+long long read_counter(int fd)
+{
+    long long count;
+    if (read(fd, &count, sizeof(long long)) != sizeof(long long))
+        return -1;
+    return count;
+}
+
+void close_counter(int fd)
+{
+    close(fd);
+}
+
+/*
+ * Counter groups: every event of a group is scheduled onto the PMU together
+ * and read with a single read(2), so ratios such as IPC are consistent. A
+ * group belongs to the thread (or CPU) it was opened for, so threads each
+ * open their own and groups nest freely.
+ */
+
+static const struct {
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+} group_events[PERF_N_EVENTS] = {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache-refs",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { "cache-misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "dtlb-misses",   PERF_TYPE_HW_CACHE, CACHE_EVENT(DTLB, READ, MISS) },
+};
+
+/*
+ * open a group counting for thread tid (0 for the calling thread, -1 for
+ * every thread) on cpu (-1 for any); returns the number of events opened
+ */
+int perf_group_open(perf_group_t *g, pid_t tid, int cpu)
+{
+    int opened = 0;
+    g->leader = -1;
+    for (int e = 0; e < PERF_N_EVENTS; e++) {
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(struct perf_event_attr));
+        pe.type = group_events[e].type;
+        pe.size = sizeof(struct perf_event_attr);
+        pe.config = group_events[e].config;
+        pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pe.disabled = (g->leader == -1);
+        pe.exclude_kernel = 1;
+        pe.exclude_hv = 1;
+        g->fds[e] = perf_event_open(&pe, tid, cpu, g->leader, 0);
+        if (g->fds[e] < 0) {
+            g->fds[e] = -1;
+            continue;
+        }
+        ioctl(g->fds[e], PERF_EVENT_IOC_ID, &g->ids[e]);
+        if (g->leader == -1)
+            g->leader = g->fds[e];
+        opened++;
+    }
+    if (g->leader != -1)
+        ioctl(g->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return opened;
+}
+
+/* zero every counter of the group */
+void perf_group_reset(perf_group_t *g)
+{
+    if (g->leader != -1)
+        ioctl(g->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+}
+
+/*
+ * read the group without stopping it; returns 0 on success, or -1 (with
+ * every count negative) if no counter could be opened or read
+ */
+int perf_group_read(perf_group_t *g, perf_counts_t *c)
+{
+    struct {
+        unsigned long long nr, time_enabled, time_running;
+        struct { unsigned long long value, id; } values[PERF_N_EVENTS];
+    } buf;
+
+    memset(c, 0, sizeof(perf_counts_t));
+    for (int e = 0; e < PERF_N_EVENTS; e++)
+        c->counts[e] = -1;
+    if (g->leader == -1 || read(g->leader, &buf, sizeof(buf)) <= 0)
+        return -1;
+
+    c->time_enabled = buf.time_enabled;
+    c->time_running = buf.time_running;
+    /* the group was only on the PMU for time_running out of time_enabled */
+    double scale = buf.time_running ?
+        (double) buf.time_enabled / buf.time_running : 0;
+    for (unsigned long long i = 0; i < buf.nr && i < PERF_N_EVENTS; i++) {
+        for (int e = 0; e < PERF_N_EVENTS; e++) {
+            if (g->fds[e] != -1 && g->ids[e] == buf.values[i].id)
+                c->counts[e] = buf.values[i].value * scale;
+        }
+    }
+    return 0;
+}
+
+void perf_group_close(perf_group_t *g)
+{
+    for (int e = 0; e < PERF_N_EVENTS; e++) {
+        if (g->fds[e] != -1)
+            close(g->fds[e]);
+        g->fds[e] = -1;
+    }
+    g->leader = -1;
+}
+
+/* accumulate c into acc, keeping unavailable counts negative */
+void perf_counts_add(perf_counts_t *acc, const perf_counts_t *c)
+{
+    for (int e = 0; e < PERF_N_EVENTS; e++) {
+        if (c->counts[e] < 0)
+            acc->counts[e] = -1;
+        else if (acc->counts[e] >= 0)
+            acc->counts[e] += c->counts[e];
+    }
+    acc->time_enabled += c->time_enabled;
+    acc->time_running += c->time_running;
+}
+
+/* instructions per cycle, or -1 if either is unavailable */
+double perf_counts_ipc(const perf_counts_t *c)
+{
+    if (c->counts[PERF_EV_CYCLES] <= 0 || c->counts[PERF_EV_INSTRUCTIONS] < 0)
+        return -1;
+    return c->counts[PERF_EV_INSTRUCTIONS] / c->counts[PERF_EV_CYCLES];
+}
+
+/* print one line of counts, each multiplied by scale (e.g. 1/runs) */
+void perf_counts_print(FILE *out, const char *label, const perf_counts_t *c,
+                       double scale)
+{
+    fprintf(out, "%s:", label);
+    for (int e = 0; e < PERF_N_EVENTS; e++) {
+        if (c->counts[e] < 0)
+            fprintf(out, " %s=n/a", group_events[e].name);
+        else
+            fprintf(out, " %s=%.0f", group_events[e].name,
+                    c->counts[e] * scale);
+    }
+    double ipc = perf_counts_ipc(c);
+    if (ipc < 0)
+        fprintf(out, " IPC=n/a\n");
+    else
+        fprintf(out, " IPC=%.2f\n", ipc);
+}
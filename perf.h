@@ -6,6 +6,11 @@
 #ifndef PERF_H
 #define PERF_H
 
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <x86intrin.h>
+
 #define MAX_ETIME 86400
 
 void init_etime(void);
@@ -20,4 +25,80 @@ long double get_etime_hw(void);
 void start_cachemiss_count(void);
 long long get_cachemiss_count(void);
 
+/*
+ * Cycle timer: the time stamp counter, serialized so that the timed code
+ * cannot drift out of the interval. Bracket the code with tsc_start() and
+ * tsc_stop(); tsc_init() must be called once before converting to time.
+ */
+
+extern double tsc_ghz;          /* TSC ticks per nanosecond */
+extern uint64_t tsc_overhead;   /* ticks of an empty tsc_start/tsc_stop */
+
+int tsc_init(void);
+int tsc_is_invariant(void);
+double tsc_to_ns(uint64_t ticks);
+
+/* read the TSC once every earlier instruction has completed */
+static inline uint64_t tsc_start(void)
+{
+    _mm_lfence();
+    uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+}
+
+/* read the TSC once the timed code has completed, before anything later */
+static inline uint64_t tsc_stop(void)
+{
+    unsigned int aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+}
+
+/* config of a PERF_TYPE_HW_CACHE event, e.g. CACHE_EVENT(L1D, READ, MISS) */
+#define CACHE_EVENT(cache, op, result) \
+    (PERF_COUNT_HW_CACHE_##cache | (PERF_COUNT_HW_CACHE_OP_##op << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_##result << 16))
+
+int open_counter(unsigned int type, unsigned long long config);
+void reset_counter(int fd);
+long long read_counter(int fd);
+void close_counter(int fd);
+
+/* the events of a counter group */
+enum {
+    PERF_EV_CYCLES,
+    PERF_EV_INSTRUCTIONS,
+    PERF_EV_CACHE_REFS,
+    PERF_EV_CACHE_MISSES,
+    PERF_EV_BRANCH_MISSES,
+    PERF_EV_DTLB_MISSES,
+    PERF_N_EVENTS
+};
+
+/* a set of counters read together (PERF_FORMAT_GROUP); owned by one thread */
+typedef struct {
+    int leader;                     /* fd read for the whole group, or -1 */
+    int fds[PERF_N_EVENTS];         /* -1 for events the host lacks */
+    unsigned long long ids[PERF_N_EVENTS];
+} perf_group_t;
+
+/* counts of a group, scaled up when the kernel multiplexed the counters */
+typedef struct {
+    double counts[PERF_N_EVENTS];   /* negative if unavailable */
+    unsigned long long time_enabled;
+    unsigned long long time_running;
+} perf_counts_t;
+
+int perf_group_open(perf_group_t *g, pid_t tid, int cpu);
+void perf_group_reset(perf_group_t *g);
+int perf_group_read(perf_group_t *g, perf_counts_t *c);
+void perf_group_close(perf_group_t *g);
+
+void perf_counts_add(perf_counts_t *acc, const perf_counts_t *c);
+double perf_counts_ipc(const perf_counts_t *c);
+void perf_counts_print(FILE *out, const char *label, const perf_counts_t *c,
+                       double scale);
+
 #endif /* PERF_H */
\ No newline at end of file
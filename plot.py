@@ -6,13 +6,41 @@ import matplotlib.pyplot as plt
 from mpl_toolkits.mplot3d import Axes3D
 import numpy
 import matplotlib.cm as cm
+import matplotlib.tri
 import argparse
+import json
 import os
 
 
 stride_label = "Stride (x8 Bytes)"
 logsize_label = "log2(size) (Bytes)"
 perf_label = "MB/s"
+latency_label = "ns/load"
+page_stride_label = "Stride (x4 KiB pages)"
+
+
+def load(path):
+    """Returns a dict of columns from mountain output in any --format.
+
+    Text and csv outputs name their columns in a header line; files without
+    one (older runs) only have the stride, logsize and metric columns."""
+    with open(path) as f:
+        lines = [l.strip() for l in f if l.strip()]
+    if lines and lines[0].startswith("{"):
+        rows = [json.loads(l) for l in lines]
+        return {name: numpy.array([numpy.nan if r[name] is None else r[name]
+                                   for r in rows], dtype=float)
+                for name in rows[0]}
+    names = ["stride", "logsize", "value"]
+    rows = []
+    for line in lines:
+        fields = line.lstrip("#").replace(",", " ").split()
+        if fields and fields[0] == "stride":
+            names = fields
+        elif not line.startswith("#"):
+            rows.append([float(v) for v in fields[:len(names)]])
+    data = numpy.array(rows, dtype=float)
+    return {name: data[:, i] for i, name in enumerate(names)}
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser()
@@ -21,9 +49,23 @@ if __name__ == "__main__":
                             default="mountain.png", help="Output file")
     parser.add_argument("-s", "--sections", action="store_true", \
                             default=False, help="Show sections")
+    parser.add_argument("-l", "--latency", action="store_true", \
+                            default=False, help="Input is a latency mountain")
+    parser.add_argument("-t", "--tlb", action="store_true", \
+                            default=False, help="Input is a TLB mountain")
+    parser.add_argument("-c", "--color", type=str, default=None, \
+                            help="Colour the surface by this column " \
+                            "(e.g. a --counters column such as l1d_miss)")
     args = parser.parse_args()
 
-    x, y, z = numpy.loadtxt(args.file, unpack=True)
+    if args.latency or args.tlb:
+        perf_label = latency_label
+    if args.tlb:
+        stride_label = page_stride_label
+
+    columns = load(args.file)
+    names = list(columns)
+    x, y, z = (columns[name] for name in names[:3])
 
     # Mountain
     fig = plt.figure()
@@ -35,7 +77,16 @@ if __name__ == "__main__":
     ax.set_zlabel(perf_label)
     #plt.tight_layout()
 
-    ax.plot_trisurf(x, y, z, cmap="terrain")
+    surf = ax.plot_trisurf(x, y, z, cmap="terrain")
+    if args.color is not None:
+        if args.color not in columns:
+            parser.error("no column {} in {}".format(args.color, args.file))
+        # One colour per triangle: the mean of its vertices
+        c = columns[args.color]
+        triangles = matplotlib.tri.Triangulation(x, y).triangles
+        surf.set_cmap("viridis")
+        surf.set_array(numpy.nanmean(c[triangles], axis=1))
+        fig.colorbar(surf, label=args.color, shrink=0.6)
     plt.savefig(args.out, dpi=300)
 
     if not args.sections:
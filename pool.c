@@ -0,0 +1,332 @@
+/**
+ * @file pool.c
+ * @brief Work-stealing thread pool over Chase-Lev deques
+ **/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* pthread_attr_setaffinity_np */
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <immintrin.h>
+#include "atomic.h"
+#include "pool.h"
+
+/* tasks a deque holds; splitting a range only needs its depth */
+#define DEQUE_CAPACITY 256
+/* failed rounds of stealing before a worker sleeps, or a waiter yields */
+#define SPIN_ROUNDS 256
+
+/* keeps the compiler from moving memory accesses across it */
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+/*
+ * The owner pushes and pops at bottom, thieves take from top. Only the
+ * last task is contended, and a compare-and-swap of top settles who gets
+ * it.
+ */
+typedef struct {
+    pool_task_t *tasks[DEQUE_CAPACITY];
+    volatile long top __attribute__((aligned(64)));
+    volatile long bottom __attribute__((aligned(64)));
+} __attribute__((aligned(64))) deque_t;
+
+struct pool {
+    int n_workers;
+    deque_t *deques;
+    pthread_t *threads;
+    int spin_rounds;        /* SPIN_ROUNDS, or 0 with more workers than CPUs */
+    volatile int stop;
+    /* bumped by every spawn, so a worker going to sleep sees it missed one */
+    volatile long epoch __attribute__((aligned(64)));
+    volatile int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+/* the worker each thread is, and a seed for picking victims */
+static __thread int worker_id = -1;
+static __thread unsigned victim_seed;
+
+static int deque_push(deque_t *d, pool_task_t *t)
+{
+    long b = d->bottom;
+    if (b - d->top >= DEQUE_CAPACITY)
+        return -1;
+    d->tasks[b % DEQUE_CAPACITY] = t;
+    barrier();
+    d->bottom = b + 1;
+    return 0;
+}
+
+static pool_task_t *deque_pop(deque_t *d)
+{
+    long b = d->bottom - 1;
+    pool_task_t *t;
+
+    /* the swap is a full fence: thieves see the claim before we read top */
+    atomic_swap64((long *) &d->bottom, b);
+    long top = d->top;
+    if (top > b) {
+        d->bottom = b + 1;
+        return NULL;
+    }
+    t = d->tasks[b % DEQUE_CAPACITY];
+    if (top == b) {
+        /* the last task: race the thieves for it */
+        if (atomic_cas64((long *) &d->top, top, top + 1) != top)
+            t = NULL;
+        d->bottom = b + 1;
+    }
+    return t;
+}
+
+static pool_task_t *deque_steal(deque_t *d)
+{
+    long top = d->top;
+    barrier();
+    long b = d->bottom;
+    if (top >= b)
+        return NULL;
+    pool_task_t *t = d->tasks[top % DEQUE_CAPACITY];
+    if (atomic_cas64((long *) &d->top, top, top + 1) != top)
+        return NULL;
+    return t;
+}
+
+static void run_task(pool_task_t *t)
+{
+    pool_group_t *g = t->group;
+    t->fn(t->arg);
+    /* the waiter may free t as soon as it sees the count drop */
+    atomic_increment64((long *) &g->pending, -1);
+}
+
+/* one task of ours, or else one stolen from a random victim onward */
+static pool_task_t *find_task(pool_t *p)
+{
+    pool_task_t *t = deque_pop(&p->deques[worker_id]);
+    if (t != NULL || p->n_workers == 1)
+        return t;
+    int start = rand_r(&victim_seed) % p->n_workers;
+    for (int i = 0; i < p->n_workers; i++) {
+        int v = (start + i) % p->n_workers;
+        if (v != worker_id && (t = deque_steal(&p->deques[v])) != NULL)
+            return t;
+    }
+    return NULL;
+}
+
+/*
+ * A sleeper counts itself before it rechecks the epoch, and a spawner bumps
+ * the epoch before it checks for sleepers; both are full fences, so one of
+ * them sees the other.
+ */
+static void sleep_until_spawn(pool_t *p, long epoch)
+{
+    pthread_mutex_lock(&p->lock);
+    atomic_increment((int *) &p->sleepers, 1);
+    while (p->epoch == epoch && !p->stop)
+        pthread_cond_wait(&p->wake, &p->lock);
+    atomic_increment((int *) &p->sleepers, -1);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *worker_main(void *arg)
+{
+    pool_t *p = arg;
+    int idle = 0;
+
+    while (!p->stop) {
+        long epoch = p->epoch;
+        pool_task_t *t = find_task(p);
+        if (t != NULL) {
+            run_task(t);
+            idle = 0;
+        } else if (++idle < p->spin_rounds) {
+            _mm_pause();
+        } else {
+            sleep_until_spawn(p, epoch);
+            idle = 0;
+        }
+    }
+    return NULL;
+}
+
+/* worker ids are handed out by the creator before the threads start */
+typedef struct {
+    pool_t *p;
+    int id;
+} worker_arg_t;
+
+static void *worker_start(void *arg)
+{
+    worker_arg_t *w = arg;
+    pool_t *p = w->p;
+    worker_id = w->id;
+    victim_seed = w->id;
+    free(w);
+    return worker_main(p);
+}
+
+pool_t *pool_create(int n_workers, int pin)
+{
+    pool_t *p = calloc(1, sizeof(pool_t));
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_attr_t attr;
+
+    if (p == NULL || n_workers < 1)
+        goto fail;
+    p->threads = calloc(n_workers, sizeof(pthread_t));
+    if (p->threads == NULL ||
+        posix_memalign((void **) &p->deques, 64,
+                       n_workers * sizeof(deque_t)) != 0)
+        goto fail;
+    for (int i = 0; i < n_workers; i++)
+        p->deques[i].top = p->deques[i].bottom = 0;
+    /* spinning would only take the CPU from a worker with a task */
+    p->spin_rounds = n_cpus > 0 && n_workers > n_cpus ? 0 : SPIN_ROUNDS;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+
+    worker_id = 0;
+    victim_seed = 0;
+    /* counts the workers started, for pool_destroy to join on failure */
+    p->n_workers = 1;
+    pthread_attr_init(&attr);
+    for (int i = 1; i < n_workers; i++) {
+        worker_arg_t *w = malloc(sizeof(worker_arg_t));
+        if (pin && n_cpus > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % n_cpus, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        if (w == NULL)
+            goto fail_threads;
+        w->p = p;
+        w->id = i;
+        if (pthread_create(&p->threads[i], &attr, worker_start, w) != 0) {
+            free(w);
+            goto fail_threads;
+        }
+        p->n_workers = i + 1;
+    }
+    p->n_workers = n_workers;
+    pthread_attr_destroy(&attr);
+    return p;
+
+fail_threads:
+    pthread_attr_destroy(&attr);
+    pool_destroy(p);
+    return NULL;
+fail:
+    if (p != NULL) {
+        free(p->threads);
+        free(p);
+    }
+    return NULL;
+}
+
+void pool_destroy(pool_t *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    /* only the workers that were started have a thread to join */
+    for (int i = 1; i < p->n_workers; i++)
+        pthread_join(p->threads[i], NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    worker_id = -1;
+    free(p->deques);
+    free(p->threads);
+    free(p);
+}
+
+int pool_workers(const pool_t *p)
+{
+    return p->n_workers;
+}
+
+int pool_worker_id(void)
+{
+    return worker_id;
+}
+
+void pool_spawn(pool_t *p, pool_group_t *g, pool_task_t *t,
+                void (*fn)(void *arg), void *arg)
+{
+    t->fn = fn;
+    t->arg = arg;
+    t->group = g;
+    atomic_increment64((long *) &g->pending, 1);
+    if (deque_push(&p->deques[worker_id], t) < 0) {
+        run_task(t);
+        return;
+    }
+    atomic_increment64((long *) &p->epoch, 1);
+    if (p->sleepers > 0) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_signal(&p->wake);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+void pool_wait(pool_t *p, pool_group_t *g)
+{
+    int idle = 0;
+    while (g->pending > 0) {
+        pool_task_t *t = find_task(p);
+        if (t != NULL) {
+            run_task(t);
+            idle = 0;
+        } else if (++idle < p->spin_rounds) {
+            _mm_pause();
+        } else {
+            /* the thieves may need our CPU to finish */
+            sched_yield();
+        }
+    }
+}
+
+/* a half of a pool_for range, as a task */
+typedef struct {
+    pool_t *p;
+    long begin, end, grain;
+    void (*body)(long i, void *arg);
+    void *arg;
+} range_t;
+
+static void run_range(void *arg)
+{
+    range_t *r = arg;
+    pool_group_t g = POOL_GROUP_INIT;
+    /* one spawned half per halving, so 64 covers any long range */
+    pool_task_t tasks[64];
+    range_t halves[64];
+    long begin = r->begin, end = r->end;
+    int n = 0;
+
+    while (end - begin > r->grain) {
+        long mid = begin + (end - begin) / 2;
+        halves[n] = *r;
+        halves[n].begin = mid;
+        halves[n].end = end;
+        pool_spawn(r->p, &g, &tasks[n], run_range, &halves[n]);
+        end = mid;
+        n++;
+    }
+    for (long i = begin; i < end; i++)
+        r->body(i, r->arg);
+    pool_wait(r->p, &g);
+}
+
+void pool_for(pool_t *p, long begin, long end, long grain,
+              void (*body)(long i, void *arg), void *arg)
+{
+    range_t r = { p, begin, end, grain < 1 ? 1 : grain, body, arg };
+    run_range(&r);
+}
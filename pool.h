@@ -0,0 +1,58 @@
+/**
+ * @file pool.h
+ * @brief A persistent pool of pinned workers with work stealing
+ *
+ * Each worker owns a Chase-Lev deque: it pushes and pops tasks at the
+ * bottom, and idle workers steal from the top of the others', so most
+ * operations touch only the owner's cache lines. The thread that creates
+ * the pool is worker 0 and runs tasks while it waits for them; the others
+ * spin for a while when there is nothing to steal, then sleep until a task
+ * is spawned.
+ **/
+
+#ifndef POOL_H
+#define POOL_H
+
+typedef struct pool pool_t;
+
+/* tasks spawned together, waited for together */
+typedef struct {
+    volatile long pending;
+} pool_group_t;
+
+#define POOL_GROUP_INIT { 0 }
+
+/*
+ * A task belongs to the caller and must stay valid until pool_wait on its
+ * group returns, which makes the spawner's stack a fine place for it.
+ */
+typedef struct {
+    void (*fn)(void *arg);
+    void *arg;
+    pool_group_t *group;
+} pool_task_t;
+
+/* NULL if a thread could not be created; pin puts worker i on CPU i */
+pool_t *pool_create(int n_workers, int pin);
+void pool_destroy(pool_t *p);
+int pool_workers(const pool_t *p);
+/* the calling thread's index in its pool, or -1 if it is in none */
+int pool_worker_id(void);
+
+/*
+ * Spawn and wait may only be called by the pool's creator or its tasks.
+ * A task that does not fit in the deque runs at once instead.
+ */
+void pool_spawn(pool_t *p, pool_group_t *g, pool_task_t *t,
+                void (*fn)(void *arg), void *arg);
+/* runs tasks, the group's or stolen ones, until the group is done */
+void pool_wait(pool_t *p, pool_group_t *g);
+
+/*
+ * body(i, arg) for every i in [begin, end): the range is halved into tasks
+ * until a half is at most grain long, and the halves are stolen as a whole
+ */
+void pool_for(pool_t *p, long begin, long end, long grain,
+              void (*body)(long i, void *arg), void *arg);
+
+#endif /* POOL_H */
@@ -0,0 +1,531 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include "atomic.h"
+#include "lockfree.h"
+#include "func_time.h"
+#include "perf.h"
+#include "env.h"
+#include "hist.h"
+#ifdef BENCH_RUNNER
+#include "bench.h"
+#endif
+
+/** @brief Largest number of producers or of consumers */
+#define MAX_THREADS 64
+/** @brief Values a queue holds */
+#define CAPACITY 1024
+/** @brief Values each producer passes through the queue in one run */
+#define ITEMS_PER_PRODUCER (1 << 16)
+/** @brief Largest batch, and the batches of a sweep */
+#define MAX_BATCH 256
+#define BATCH_LEVELS { 1, 16, 64 }
+/** @brief Failed attempts of a thread before it yields the CPU */
+#define SPIN_YIELD 1024
+
+/** @brief Keeps the compiler from moving memory accesses across it */
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+/** @brief A queue under test, passing up to a batch of values per call */
+typedef struct {
+	const char *name;
+	const char *description;
+	int spsc;                               /**< One producer and consumer only */
+	void (*init)(void);
+	void (*destroy)(void);
+	int (*push)(const long *values, int n); /**< Returns the values pushed */
+	int (*pop)(long *values, int n);        /**< Returns the values popped */
+} queue_t;
+
+/* bounded MPMC ring: a compare-and-swap per value */
+
+static mpmc_ring_t mpmc;
+
+static void mpmc_q_init(void) {
+	mpmc_init(&mpmc, CAPACITY);
+}
+
+static void mpmc_q_destroy(void) {
+	mpmc_destroy(&mpmc);
+}
+
+static int mpmc_q_push(const long *values, int n) {
+	int i;
+	for (i = 0; i < n && mpmc_push(&mpmc, values[i]) == 0; i++)
+		continue;
+	return i;
+}
+
+static int mpmc_q_pop(long *values, int n) {
+	int i;
+	for (i = 0; i < n && mpmc_pop(&mpmc, &values[i]) == 0; i++)
+		continue;
+	return i;
+}
+
+/* SPSC ring: a batch is published with one store */
+
+static spsc_ring_t spsc;
+
+static void spsc_q_init(void) {
+	spsc_init(&spsc, CAPACITY);
+}
+
+static void spsc_q_destroy(void) {
+	spsc_destroy(&spsc);
+}
+
+static int spsc_q_push(const long *values, int n) {
+	return spsc_push_n(&spsc, values, n);
+}
+
+static int spsc_q_pop(long *values, int n) {
+	return spsc_pop_n(&spsc, values, n);
+}
+
+/*
+ * Treiber stack: the nodes circulate between a free stack and the stack
+ * of values, so they are reused all the time (which the ABA tags make
+ * safe). A batch is pushed as one chain.
+ */
+
+static treiber_stack_t stack, free_nodes;
+static treiber_node_t *nodes;
+
+static void stack_q_init(void) {
+	nodes = calloc(CAPACITY, sizeof(treiber_node_t));
+	treiber_init(&stack);
+	treiber_init(&free_nodes);
+	for (int i = 0; i < CAPACITY; i++)
+		treiber_push(&free_nodes, &nodes[i]);
+}
+
+static void stack_q_destroy(void) {
+	free(nodes);
+}
+
+static int stack_q_push(const long *values, int n) {
+	treiber_node_t *first = NULL, *last = NULL;
+	int i;
+	for (i = 0; i < n; i++) {
+		treiber_node_t *node = treiber_pop(&free_nodes);
+		if (node == NULL)
+			break;
+		node->value = values[i];
+		node->next = first;
+		first = node;
+		if (last == NULL)
+			last = node;
+	}
+	if (i > 0)
+		treiber_push_chain(&stack, first, last);
+	return i;
+}
+
+static int stack_q_pop(long *values, int n) {
+	treiber_node_t *first = NULL, *last = NULL;
+	int i;
+	for (i = 0; i < n; i++) {
+		treiber_node_t *node = treiber_pop(&stack);
+		if (node == NULL)
+			break;
+		values[i] = node->value;
+		node->next = first;
+		first = node;
+		if (last == NULL)
+			last = node;
+	}
+	if (i > 0)
+		treiber_push_chain(&free_nodes, first, last);
+	return i;
+}
+
+/* baseline: a ring under a pthread mutex, taken once per batch */
+
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long ring[CAPACITY];
+static long ring_head, ring_tail;
+
+static void mutex_q_init(void) {
+	ring_head = ring_tail = 0;
+}
+
+static int mutex_q_push(const long *values, int n) {
+	pthread_mutex_lock(&ring_mutex);
+	if (n > CAPACITY - (ring_tail - ring_head))
+		n = CAPACITY - (ring_tail - ring_head);
+	for (int i = 0; i < n; i++)
+		ring[(ring_tail + i) % CAPACITY] = values[i];
+	ring_tail += n;
+	pthread_mutex_unlock(&ring_mutex);
+	return n;
+}
+
+static int mutex_q_pop(long *values, int n) {
+	pthread_mutex_lock(&ring_mutex);
+	if (n > ring_tail - ring_head)
+		n = ring_tail - ring_head;
+	for (int i = 0; i < n; i++)
+		values[i] = ring[(ring_head + i) % CAPACITY];
+	ring_head += n;
+	pthread_mutex_unlock(&ring_mutex);
+	return n;
+}
+
+static const queue_t queues[] = {
+	{ "mpmc", "Bounded MPMC ring (sequence-numbered cells)", 0,
+	  mpmc_q_init, mpmc_q_destroy, mpmc_q_push, mpmc_q_pop },
+	{ "spsc", "SPSC ring with cached indices", 1,
+	  spsc_q_init, spsc_q_destroy, spsc_q_push, spsc_q_pop },
+	{ "stack", "Treiber stack with ABA-tagged top", 0,
+	  stack_q_init, stack_q_destroy, stack_q_push, stack_q_pop },
+	{ "mutex", "Ring protected by a pthread mutex (baseline)", 0,
+	  mutex_q_init, NULL, mutex_q_push, mutex_q_pop },
+};
+#define N_QUEUES (int) (sizeof(queues) / sizeof(queues[0]))
+
+/** @brief Shape of the current test */
+static const queue_t *queue;
+static int n_producers, n_consumers, batch;
+static int spin_yield = SPIN_YIELD;
+static int use_latency;
+
+/** @brief Producers done with their values */
+static volatile int producers_done;
+/** @brief What each consumer got, checked against what was produced */
+static long consumed_sum[MAX_THREADS], consumed_count[MAX_THREADS];
+/** @brief Latency of the calls of each thread (--latency), producers first */
+static hist_t *thread_hists;
+static pthread_barrier_t start;
+
+static inline void spin_wait(int *spins) {
+	if (++*spins < spin_yield)
+		_mm_pause();
+	else
+		sched_yield();
+}
+
+static inline uint64_t call_start(void) {
+	return use_latency ? tsc_start() : 0;
+}
+
+static inline void call_stop(int id, uint64_t t0) {
+	if (use_latency)
+		hist_record(&thread_hists[id], tsc_stop() - t0);
+}
+
+/**
+ * @brief Pushes the values 1 to ITEMS_PER_PRODUCER, a batch at a time,
+ * retrying while the queue is full.
+ *
+ * @param arg The producer's index.
+ *
+ * @return NULL
+ */
+static void *do_produce(void *arg) {
+	int id = (long) arg;
+	long values[MAX_BATCH];
+#ifdef BENCH_RUNNER
+	bench_worker();
+#endif
+	pthread_barrier_wait(&start);
+	for (long i = 0; i < ITEMS_PER_PRODUCER;) {
+		int n = ITEMS_PER_PRODUCER - i < batch ? ITEMS_PER_PRODUCER - i : batch;
+		for (int k = 0; k < n; k++)
+			values[k] = i + k + 1;
+		for (int done = 0, spins = 0; done < n;) {
+			uint64_t t0 = call_start();
+			int got = queue->push(values + done, n - done);
+			if (got > 0) {
+				call_stop(id, t0);
+				done += got;
+				spins = 0;
+			} else {
+				spin_wait(&spins);
+			}
+		}
+		i += n;
+	}
+	atomic_increment((int *) &producers_done, 1);
+	return NULL;
+}
+
+/**
+ * @brief Pops up to a batch at a time until the producers are done and the
+ * queue is empty.
+ *
+ * @param arg The consumer's index.
+ *
+ * @return NULL
+ */
+static void *do_consume(void *arg) {
+	int id = (long) arg;
+	long values[MAX_BATCH], sum = 0, count = 0;
+	int spins = 0;
+#ifdef BENCH_RUNNER
+	bench_worker();
+#endif
+	pthread_barrier_wait(&start);
+	for (;;) {
+		/* read before popping: an empty queue after it means no more values */
+		int finished = producers_done == n_producers;
+		barrier();
+		uint64_t t0 = call_start();
+		int got = queue->pop(values, batch);
+		if (got == 0) {
+			if (finished)
+				break;
+			spin_wait(&spins);
+			continue;
+		}
+		call_stop(n_producers + id, t0);
+		spins = 0;
+		for (int k = 0; k < got; k++)
+			sum += values[k];
+		count += got;
+	}
+	consumed_sum[id] = sum;
+	consumed_count[id] = count;
+	return NULL;
+}
+
+/**
+ * @brief Passes every producer's values through the queue to the
+ * consumers.
+ *
+ * @return void
+ */
+static void do_test(void) {
+	pthread_t threads[2 * MAX_THREADS];
+	int n_threads = n_producers + n_consumers;
+
+	queue->init();
+	producers_done = 0;
+	pthread_barrier_init(&start, NULL, n_threads);
+	for (long i = 0; i < n_threads; i++) {
+		int ok = i < n_producers ?
+		    pthread_create(&threads[i], NULL, do_produce, (void *) i) :
+		    pthread_create(&threads[i], NULL, do_consume,
+		                   (void *) (i - n_producers));
+		if (ok != 0) {
+			fprintf(stderr, "pthread_create(): Failed to create thread.\n");
+			exit(-1);
+		}
+	}
+	for (int i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&start);
+	if (queue->destroy != NULL)
+		queue->destroy();
+}
+
+/**
+ * @brief Checks that the consumers of the last run got every value exactly
+ * once.
+ *
+ * @return Non-zero if they did.
+ */
+static int test_check(void) {
+	long sum = 0, count = 0;
+	long n = ITEMS_PER_PRODUCER;
+	for (int i = 0; i < n_consumers; i++) {
+		sum += consumed_sum[i];
+		count += consumed_count[i];
+	}
+	return count == n * n_producers && sum == n * (n + 1) / 2 * n_producers;
+}
+
+/**
+ * @brief Sets up a test of one queue.
+ *
+ * @return 0, or -1 if the queue cannot have that many threads.
+ */
+static int test_setup(const queue_t *q, int producers, int consumers,
+                      int batch_size) {
+	if (producers < 1 || producers > MAX_THREADS || consumers < 1 ||
+	    consumers > MAX_THREADS || batch_size < 1 || batch_size > MAX_BATCH ||
+	    (q->spsc && (producers != 1 || consumers != 1)))
+		return -1;
+	queue = q;
+	n_producers = producers;
+	n_consumers = consumers;
+	batch = batch_size;
+	spin_yield = producers + consumers > sysconf(_SC_NPROCESSORS_ONLN) ?
+	             1 : SPIN_YIELD;
+	thread_hists = aligned_alloc(64,
+	                             (producers + consumers) * sizeof(hist_t));
+	for (int i = 0; i < producers + consumers; i++)
+		hist_reset(&thread_hists[i]);
+	return 0;
+}
+
+static void test_teardown(void) {
+	free(thread_hists);
+	thread_hists = NULL;
+}
+
+/**
+ * @brief Finds a queue by name.
+ *
+ * @return Its index in queues, or -1.
+ */
+static int find_queue(const char *name) {
+	for (int i = 0; i < N_QUEUES; i++)
+		if (strcmp(queues[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+#ifdef BENCH_RUNNER
+/**
+ * @brief Times do_test for the queue and shape given by the runner.
+ */
+static void bench_queue(bench_ctx_t *ctx) {
+	int q = find_queue(bench_param(ctx, "queue", "mpmc"));
+	if (q < 0 || test_setup(&queues[q],
+	                        bench_param_long(ctx, "producers", 1),
+	                        bench_param_long(ctx, "consumers", 1),
+	                        bench_param_long(ctx, "batch", 1)) < 0) {
+		fprintf(stderr, "queue: invalid queue, thread count or batch.\n");
+		return;
+	}
+	bench_time(ctx, "time", do_test);
+	assert(test_check());
+	test_teardown();
+}
+
+BENCH(bench_mpmc, "queue/mpmc",
+      "queue=mpmc|stack|mutex producers=1|2|4 consumers=1|2|4 batch=1|16") {
+	bench_queue(ctx);
+}
+
+BENCH(bench_spsc, "queue/spsc",
+      "queue=spsc|mpmc|mutex producers=1 consumers=1 batch=1|16|64") {
+	bench_queue(ctx);
+}
+#else
+/**
+ * @brief Times one queue in one shape and prints a row of the table.
+ *
+ * @return void
+ */
+static void run_test(const queue_t *q, int producers, int consumers,
+                     int batch_size) {
+	func_stats_t stats;
+	if (test_setup(q, producers, consumers, batch_size) < 0)
+		return;
+
+	double time = func_time_stats(do_test, 0.001, FUNC_TRIALS, &stats);
+	assert(test_check());
+	printf("%-8s %9d %9d %5d %10.2lf\n", q->name, producers, consumers,
+	       batch_size, (double) ITEMS_PER_PRODUCER * producers / time / 1e6);
+	if (use_latency) {
+		hist_t push, pop;
+		hist_reset(&push);
+		hist_reset(&pop);
+		for (int i = 0; i < producers; i++)
+			hist_merge(&push, &thread_hists[i]);
+		for (int i = 0; i < consumers; i++)
+			hist_merge(&pop, &thread_hists[producers + i]);
+		printf("  push: ");
+		hist_print(stdout, &push, 1 / tsc_ghz);
+		printf("  pop:  ");
+		hist_print(stdout, &pop, 1 / tsc_ghz);
+	}
+	fflush(stdout);
+	test_teardown();
+}
+
+static int next_threads(int t, int max_threads) {
+	return (t < max_threads && 2 * t > max_threads) ? max_threads : 2 * t;
+}
+
+/**
+ * @brief Prints the usage instructions to stderr.
+ *
+ * @param argv The argv program's argument vector.
+ *
+ * @return void
+ */
+static void print_usage(char *argv[]) {
+	fprintf(stderr, "Usage: %s <max_threads>\n", argv[0]);
+	fprintf(stderr, "Sweeps 1, 2, 4, ... up to max_threads producers and "
+	        "consumers each.\nOptional Arguments:\n");
+	for (int i = 0; i < N_QUEUES; i++)
+		fprintf(stderr, "\t--%-8s %s\n", queues[i].name,
+		        queues[i].description);
+	fprintf(stderr, "\t--all     Test every queue in turn (or give several)\n");
+	fprintf(stderr, "\t--batch=N Values per push or pop call [1, 16, 64]\n");
+	fprintf(stderr, "\t--latency Report percentiles of the push and pop "
+	        "calls\n");
+}
+
+/**
+ * @brief Parses the command line arguments and prints the throughput of
+ * every selected queue, in millions of values passed per second.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv A vector of the command line arguments.
+ *
+ * @return Zero on success or negative error code on failure.
+ */
+int main(int argc, char *argv[]) {
+	int selected[N_QUEUES], any = 0, max_threads;
+	int batches[] = BATCH_LEVELS;
+	int n_batches = sizeof(batches) / sizeof(batches[0]);
+	env_t env;
+
+	if (argc < 2 || (max_threads = atoi(argv[1])) < 1 ||
+	    max_threads > MAX_THREADS) {
+		print_usage(argv);
+		exit(-1);
+	}
+	for (int q = 0; q < N_QUEUES; q++)
+		selected[q] = 0;
+	for (int i = 2; i < argc; i++) {
+		int q = strncmp(argv[i], "--", 2) == 0 ? find_queue(argv[i] + 2) : -1;
+		if (strcmp(argv[i], "--all") == 0) {
+			for (q = 0; q < N_QUEUES; q++)
+				selected[q] = any = 1;
+		} else if (q >= 0) {
+			selected[q] = any = 1;
+		} else if (strncmp(argv[i], "--batch=", 8) == 0) {
+			batches[0] = atoi(argv[i] + 8);
+			n_batches = 1;
+		} else if (strcmp(argv[i], "--latency") == 0) {
+			use_latency = 1;
+		} else {
+			print_usage(argv);
+			exit(-1);
+		}
+	}
+	if (!any)
+		selected[0] = 1;
+	if (batches[0] < 1 || batches[0] > MAX_BATCH) {
+		fprintf(stderr, "The batch must be in [1, %d].\n", MAX_BATCH);
+		exit(-1);
+	}
+	if (use_latency && tsc_init() < 0)
+		fprintf(stderr, "Warning: the TSC is not invariant.\n");
+
+	env_capture(&env);
+	env_print(stdout, &env);
+	printf("%-8s %9s %9s %5s %10s\n", "queue", "producers", "consumers",
+	       "batch", "Mvalues/s");
+	for (int q = 0; q < N_QUEUES; q++) {
+		if (!selected[q])
+			continue;
+		for (int p = 1; p <= max_threads; p = next_threads(p, max_threads))
+			for (int c = 1; c <= max_threads; c = next_threads(c, max_threads))
+				for (int b = 0; b < n_batches; b++)
+					run_test(&queues[q], p, c, batches[b]);
+	}
+	return 0;
+}
+#endif /* BENCH_RUNNER */
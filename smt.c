@@ -3,8 +3,14 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <string.h>
 
 #include "func_time.h"
+#include "perf.h"
+#include "env.h"
+#ifdef BENCH_RUNNER
+#include "bench.h"
+#endif
 
 // size of the array each thread has to access
 #define WORKSIZE (1 << 16)
@@ -16,6 +22,11 @@ static int arr[MAX_THREADS][WORKSIZE];
 
 static size_t thread_count;
 
+// hardware counters per thread (with --counters), summed over test runs
+static int use_counters;
+static perf_counts_t counts[MAX_THREADS];
+static int test_runs;
+
 void bind_to_core(void) {
 	cpu_set_t cpuset;
 	pthread_attr_t attr;
@@ -29,7 +40,15 @@ void bind_to_core(void) {
 
 void *work(void *arg) {
 	size_t id = (size_t) arg;
+	perf_group_t g;
+	perf_counts_t c;
+	if (use_counters) perf_group_open(&g, 0, -1);
 	for (int i = 0; i < WORKSIZE; ++i) arr[id][i]++;
+	if (use_counters) {
+		perf_group_read(&g, &c);
+		perf_group_close(&g);
+		perf_counts_add(&counts[id], &c);
+	}
 	return NULL;
 }
 
@@ -58,17 +77,52 @@ void _run_test(void) {
 	for (size_t i = 0; i < thread_count; i++) {
 		pthread_join(threads[i], NULL);
 	}
+	free(threads);
+	test_runs++;
 }
 
 void run_test(size_t n_threads) {
 	thread_count = n_threads;
-	double time = func_time(_run_test, 0.01);
-	printf("%lu Threads took %lf ms.\n", n_threads, time * 10e3);
+	memset(counts, 0, sizeof(counts));
+	test_runs = 0;
+	func_stats_t stats;
+	double time = func_time_stats(_run_test, 0.01, FUNC_TRIALS, &stats);
+	printf("%lu Threads took %lf ms.\n", n_threads, time * 1e3);
+	printf("  ");
+	func_stats_print(stdout, &stats, 1e3, "ms");
+	for (size_t i = 0; use_counters && i < n_threads; i++) {
+		/* room for the widest size_t */
+		char label[48];
+		snprintf(label, sizeof(label), "  thread %zu (per run)", i);
+		perf_counts_print(stdout, label, &counts[i], 1.0 / test_runs);
+	}
 }
 
+#ifdef BENCH_RUNNER
+BENCH(bench_smt, "smt/threads", "threads=1|2|4|8") {
+	thread_count = bench_param_long(ctx, "threads", 1);
+	if (thread_count < 1 || thread_count > MAX_THREADS) {
+		fprintf(stderr, "smt: threads must be in [1, %d].\n", MAX_THREADS);
+		return;
+	}
+	bench_time(ctx, "time", _run_test);
+}
+#else
 int main(int argc, char *argv[]) {
+	env_t env;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--counters") == 0) {
+			use_counters = 1;
+		} else {
+			fprintf(stderr, "Usage: %s [--counters]\n", argv[0]);
+			return -1;
+		}
+	}
+	env_capture(&env);
+	env_print(stdout, &env);
 	for (size_t i = 1; i < 10; i++) {
 		run_test(i);
 	}
 	return 0;
-}
\ No newline at end of file
+}
+#endif /* BENCH_RUNNER */